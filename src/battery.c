@@ -12,6 +12,8 @@
 #include "config.h"
 #include "battery.h"
 #include "sensor.h"
+#include "comm.h"
+#include "timer.h"
 
 // Battery level auto-adjustment logic (except when debugging, as indicated by BTKEEPALIVE)
 #ifdef BATTERYDEBUG
@@ -35,6 +37,11 @@ static bool batteryRecoveryMode = false;
 // Default this to TRUE so that we charge up to MAX at boot before starting to draw down
 static bool fullBatteryRecoveryMode = true;
 
+// Average current drawn from the battery during each hour of the local solar day,
+// where negative means that it is charging.
+static float hourlyCurrent[24];
+static bool hourlyCurrentValid[24];
+
 // Set the last known SOC
 void battery_set_soc_to_unknown() {
     lastKnownBatterySOC = 100.0;
@@ -165,6 +172,87 @@ uint16_t battery_status() {
 
 }
 
+// Get the local solar hour, approximated from UTC and longitude
+bool battery_local_hour(uint16_t *pHour) {
+    uint32_t date, time, offset, secs;
+    float lat, lon, alt;
+    int32_t local;
+
+    if (!get_current_timestamp(&date, &time, &offset))
+        return false;
+    if (comm_gps_get_value(&lat, &lon, &alt) != GPS_LOCATION_FULL)
+        return false;
+    secs = ((time / 10000) * 3600) + (((time / 100) % 100) * 60) + (time % 100) + offset;
+    local = (int32_t) (secs % (24L * 60L * 60L)) + (int32_t) ((lon / 15.0) * 3600.0);
+    local = (local + (48L * 60L * 60L)) % (24L * 60L * 60L);
+    *pHour = (uint16_t) (local / 3600);
+    return true;
+}
+
+// Record the current being drawn from the battery, in mA and including whatever comms were drawing
+// while it was sampled, into the bin for this hour
+void battery_set_current(float mA) {
+    uint16_t hour;
+    if (!battery_local_hour(&hour))
+        return;
+    if (!hourlyCurrentValid[hour]) {
+        hourlyCurrent[hour] = mA;
+        hourlyCurrentValid[hour] = true;
+    } else
+        hourlyCurrent[hour] = ((hourlyCurrent[hour] * 3.0) + mA) / 4.0;
+}
+
+// Forecast the SOC at dawn, from the current SOC and what we've seen drawn at each hour.
+// This fails until we've seen every hour between now and dawn.
+bool battery_forecast_dawn_soc(float *pSOC) {
+    uint16_t i, hour, hours;
+    float mAh = 0.0;
+
+    if (lastKnownBatterySOC == 0 || !battery_local_hour(&hour))
+        return false;
+    hours = (BATTERY_PLAN_DAWN_HOUR + 24 - hour) % 24;
+    for (i=0; i<hours; i++) {
+        if (!hourlyCurrentValid[(hour + i) % 24])
+            return false;
+        mAh += hourlyCurrent[(hour + i) % 24];
+    }
+    *pSOC = lastKnownBatterySOC - ((mAh * 100.0) / BATTERY_CAPACITY_MAH);
+    return true;
+}
+
+// Get the percentage by which intervals should be scaled so as to reach dawn at the target SOC.
+// We fall back to the fixed behavior of each battery status whenever things aren't normal.
+uint16_t battery_plan_percent() {
+    float soc, shortfall;
+    int32_t percent;
+
+    switch (battery_status()) {
+    case BAT_FULL:
+    case BAT_NORMAL:
+    case BAT_LOW:
+        break;
+    default:
+        return 100;
+    }
+    if (!battery_forecast_dawn_soc(&soc))
+        return 100;
+
+    // Stretch intervals by 10% for each point of SOC that we're forecast to fall short,
+    // and shrink them similarly when there's surplus.
+    shortfall = BATTERY_PLAN_TARGET_SOC - soc;
+    percent = 100 + (int32_t) (shortfall * 10.0);
+    if (percent < BATTERY_PLAN_MIN_PERCENT)
+        percent = BATTERY_PLAN_MIN_PERCENT;
+    if (percent > BATTERY_PLAN_MAX_PERCENT)
+        percent = BATTERY_PLAN_MAX_PERCENT;
+    return ((uint16_t) percent);
+}
+
+// Scale an interval according to the power plan
+uint32_t battery_plan_interval(uint32_t seconds) {
+    return ((seconds * battery_plan_percent()) / 100);
+}
+
 // Compute a simulated SOC value based on voltage data
 
 // Note that our goal is that 100% means "normal full", however
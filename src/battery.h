@@ -9,6 +9,10 @@ void battery_set_soc(float SOC);
 float battery_soc();
 float battery_soc_from_voltage(float voltage);
 char *battery_status_name();
+void battery_set_current(float mA);
+bool battery_forecast_dawn_soc(float *pSOC);
+uint16_t battery_plan_percent();
+uint32_t battery_plan_interval(uint32_t seconds);
 
 // Only one mode is ever active, however this is defined bitwise so that
 // we can test using a bitwise-AND operator rather than just == or switch.
@@ -17,6 +17,8 @@
 #include "io.h"
 #include "serial.h"
 #include "storage.h"
+#include "prof.h"
+#include "btdebug.h"
 #include "ble_hci.h"
 #include "ble_advertising.h"
 #include "ble_db_discovery.h"
@@ -200,6 +202,10 @@ static btp_t m_btp;
 static uint16_t btp_conn_handle = BLE_CONN_HANDLE_INVALID;
 static uint32_t current_bluetooth_session_id = 0L;
 
+// Console output being accumulated into the next notification
+static uint8_t btp_tx_buffer[BTP_MAX_NOTIFY_LEN];
+static uint16_t btp_tx_used = 0;
+
 // Controller context
 #ifndef NOBTC
 static btc_t m_btc;
@@ -488,7 +494,7 @@ void reset_prepare(void) {
     }
     advertising_stop();
     ble_conn_params_stop();
-    nrf_delay_ms(500);
+    prof_delay_ms(500);
 }
 #endif
 
@@ -1168,6 +1174,7 @@ void on_ble_peripheral_evt(ble_evt_t *p_ble_evt) {
         btp_conn_handle = BLE_CONN_HANDLE_INVALID;
         m_btp.conn_handle = BLE_CONN_HANDLE_INVALID;
         m_btp.is_notification_enabled = false;
+        btp_tx_used = 0;
         break;
 
     case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
@@ -1186,6 +1193,11 @@ void on_ble_peripheral_evt(ble_evt_t *p_ble_evt) {
         // Write event
         break;
 
+    case BLE_EVT_TX_COMPLETE:
+        // The softdevice has room for more notifications, so resume console output
+        btdebug_tx_complete();
+        break;
+
 #if !defined(NSDKV10) && !defined(NSDKV11)
     case BLE_GATTC_EVT_TIMEOUT:
         // Disconnect on GATT Client timeout event.
@@ -1328,6 +1340,7 @@ void db_discover_evt_handler(ble_db_discovery_evt_t *p_evt) {
 
 // Dispatch a SoftDevice event to the appropriate event handler
 void ble_evt_dispatch(ble_evt_t *p_ble_evt) {
+    uint32_t began = prof_begin();
 
     // The connection handle and role should really be retrievable for any event type.
     uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
@@ -1434,6 +1447,8 @@ void ble_evt_dispatch(ble_evt_t *p_ble_evt) {
     }
 #endif
 
+    prof_end(PROF_ISR_BLE, began);
+
 }
 
 // Function for dispatching a system event to interested modules.
@@ -1517,6 +1532,15 @@ void bluetooth_softdevice_init(void) {
     }
     DEBUG_CHECK(err_code);
 
+    // Let connection events be extended so that several notifications can go out in each
+#if (NRF_SD_BLE_API_VERSION >= 3)
+    ble_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = 1;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+    DEBUG_CHECK(err_code);
+#endif
+
 #endif // NSDKV10
 
     // Subscribe for BLE events.
@@ -1613,16 +1637,46 @@ uint32_t bluetooth_session_id() {
     return(current_bluetooth_session_id);
 }
 
+// Send what has been accumulated as a single notification.  This returns FALSE if the
+// softdevice is out of TX buffers, in which case the data is kept and the caller must wait
+// for BLE_EVT_TX_COMPLETE before trying again.
+bool bluetooth_flush() {
+    uint32_t status;
+
+    if (btp_tx_used == 0)
+        return true;
+
+    // If we can't send, just discard it
+    if (!can_send_to_bluetooth()) {
+        btp_tx_used = 0;
+        return true;
+    }
+
+    // Queue it, and only hold onto it if the softdevice's buffers are full
+    status = btp_string_send(&m_btp, btp_tx_buffer, btp_tx_used);
+    if (status == BLE_ERROR_NO_TX_PACKETS)
+        return false;
+    btp_tx_used = 0;
+    return true;
+
+}
+
+// See whether the caller can send another byte without pausing
+bool bluetooth_tx_ready() {
+    if (btp_tx_used < btp_max_data_len(&m_btp))
+        return true;
+    return bluetooth_flush();
+}
+
 // Transmit to the BT controller device
 // This function will receive a single character from the caller, and append it to
-// a string. The string will be be sent over BLE when the last character received was a
-// 'new line' i.e '\n' (hex 0x0D) or if the string has reached a length of BTP_MAX_DATA_LENGTH.
-// The function returns TRUE if the caller can just keep sending without worrying about
-// any form of pauses, or FALSE if we must pause before trying to send the next byte.
-// In no case is there any data loss.
+// the notification being accumulated, which is sent once it fills the negotiated MTU.
+// Notifications are queued to the softdevice back-to-back, so that several go out in
+// each connection event, and the caller should use bluetooth_flush() once it has
+// nothing more to send.  The function returns TRUE if the caller can keep sending, or
+// FALSE if the softdevice is out of TX buffers and the caller must pause until
+// bluetooth_tx_ready() says otherwise.
 bool send_byte_to_bluetooth(uint8_t databyte) {
-    static uint8_t data_array[BTP_MAX_DATA_LEN];
-    static uint8_t index = 0;
 
     // If we can't send, don't even try.  Just swallow the character.
     if (!can_send_to_bluetooth())
@@ -1633,22 +1687,14 @@ bool send_byte_to_bluetooth(uint8_t databyte) {
     serial_send_byte(databyte);
 #endif
 
-    // Append the data byte
-    if (index < BTP_MAX_DATA_LEN)
-        data_array[index++] = databyte;
-
-    if (databyte == '\n' || index >= BTP_MAX_DATA_LEN) {
-
-        // Transmit one packet to the host
-        btp_string_send(&m_btp, data_array, index);
-
-        // Reset the buffer
-        index = 0;
-
-        // Exit, noting that the caller *must* now pause
+    // Append the data byte, which can only fail if the caller didn't wait when told to
+    if (btp_tx_used >= btp_max_data_len(&m_btp) && !bluetooth_flush())
         return false;
+    btp_tx_buffer[btp_tx_used++] = databyte;
 
-    }
+    // Transmit one packet to the host when it is full
+    if (btp_tx_used >= btp_max_data_len(&m_btp))
+        return bluetooth_flush();
 
     // The caller is allowed to come back quickly.
     return true;
@@ -8,6 +8,8 @@
 void bluetooth_init();
 void bluetooth_softdevice_init(void);
 bool send_byte_to_bluetooth(uint8_t databyte);
+bool bluetooth_tx_ready(void);
+bool bluetooth_flush(void);
 bool can_send_to_bluetooth(void);
 uint32_t bluetooth_session_id();
 void drop_bluetooth(void);
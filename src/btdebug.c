@@ -10,6 +10,8 @@
 #include "nrf_delay.h"
 #include "nrf_error.h"
 #include "app_timer.h"
+#include "app_util_platform.h"
+#include "app_scheduler.h"
 #include "timer.h"
 #include "debug.h"
 #include "bt.h"
@@ -31,10 +33,58 @@ static uint16_t output_buffer_drain_next = 0;
 static uint16_t output_buffer_used = 0;
 static uint16_t timer_debounce_count = 0;
 
-#define BTDEBUG_TIMER_MILLISECONDS          50
+// Deferred output is queued in the output buffer as a marker byte, a length byte, the format
+// pointer, and then the captured arguments.  It is expanded into text only as it is drained.
+#define BTDEBUG_DEFERRED                    0x01
+#define BTDEBUG_DEFERRED_ARGS               128
+#define BTDEBUG_DEFERRED_STRING             48
+#define BTDEBUG_DEFERRED_RAM                0x20000000
+#define BTDEBUG_ARG_UNSUPPORTED             -1
+#define BTDEBUG_ARG_NONE                    0
+#define BTDEBUG_ARG_INT                     1
+#define BTDEBUG_ARG_LONG                    2
+#define BTDEBUG_ARG_LONGLONG                3
+#define BTDEBUG_ARG_DOUBLE                  4
+#define BTDEBUG_ARG_STRING                  5
+#define BTDEBUG_ARG_POINTER                 6
+static char expanded[256];
+static uint16_t expanded_length = 0;
+static uint16_t expanded_next = 0;
+
+// Output is drained whenever it's appended and whenever the softdevice completes a transmission,
+// so the timer is only a backstop and a way of knowing when output has gone quiet.
+#define BTDEBUG_TIMER_MILLISECONDS          250
 #define BTDEBUG_TIMER_DEBOUNCE_MILLISECONDS 2000
 #define BTDEBUG_TIMER_INTERVAL APP_TIMER_TICKS(BTDEBUG_TIMER_MILLISECONDS, APP_TIMER_PRESCALER)
 APP_TIMER_DEF(btdebug_timer);
+static bool drain_scheduled = false;
+static void btdebug_drain_handler(void *unused1, uint16_t unused2);
+
+// Drain as soon as the scheduler gets to it, rather than waiting for the timer
+static void btdebug_schedule_drain() {
+    if (!drain_scheduled && app_sched_event_put(NULL, 0, btdebug_drain_handler) == NRF_SUCCESS)
+        drain_scheduled = true;
+}
+
+// Start draining the output buffer if it isn't already being drained
+static void btdebug_start_timer() {
+    if (output_buffer_used == 0)
+        return;
+    btdebug_schedule_drain();
+    if (!timer_started) {
+        if (NRF_SUCCESS == app_timer_start(btdebug_timer, BTDEBUG_TIMER_INTERVAL, NULL))
+            timer_started = true;
+#ifdef INDICATORS
+        if (!gpio_indicators_are_active())
+            gpio_pin_set(LED_PIN_RED, true);
+#endif
+    }
+}
+
+// See whether output would go anywhere, so that callers can skip formatting entirely
+bool btdebug_active() {
+    return (init && can_send_to_bluetooth() && !io_optimize_power());
+}
 
 void btdebug_send_byte(uint8_t databyte) {
     char strbuf[2];
@@ -71,6 +121,12 @@ void btdebug_send_string(char *str) {
     // Loop over input chars
     while (*str != '\0') {
 
+        // Don't let text be mistaken for a deferred record
+        if (*str == BTDEBUG_DEFERRED) {
+            str++;
+            continue;
+        }
+
 #ifdef BTDEBUG_BYPASS_BUFFERING
 
         // This causes huge problems if done at driver level, but
@@ -99,21 +155,320 @@ void btdebug_send_string(char *str) {
 
     // If we need the timer, start it.
 #ifndef BTDEBUG_BYPASS_BUFFERING
-    if (output_buffer_used != 0 && !timer_started) {
-        if (NRF_SUCCESS == app_timer_start(btdebug_timer, BTDEBUG_TIMER_INTERVAL, NULL))
-            timer_started = true;
-#ifdef INDICATORS
-        if (!gpio_indicators_are_active())
-            gpio_pin_set(LED_PIN_RED, true);
+    btdebug_start_timer();
+#else
+    bluetooth_flush();
 #endif
+
+    // Done
+    --recursion;
+
+}
+
+// Parse the conversion spec at a '%', copying it and returning the type of argument that it takes
+static int btdebug_spec(const char **format, char *spec, uint16_t length) {
+    const char *p = *format;
+    uint16_t i = 0;
+    int longs = 0;
+
+    spec[i++] = *p++;
+    while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && i < length-4)
+        spec[i++] = *p++;
+    while (*p == 'l' || *p == 'h') {
+        if (*p == 'l')
+            longs++;
+        spec[i++] = *p++;
+        if (i >= length-2)
+            return BTDEBUG_ARG_UNSUPPORTED;
     }
+    spec[i++] = *p;
+    spec[i] = '\0';
+    if (*p == '\0')
+        return BTDEBUG_ARG_UNSUPPORTED;
+    *format = p+1;
+
+    // Widths taken from arguments, and less common modifiers, are just formatted immediately
+    if (strchr("diouxXc", *p) != NULL)
+        return (longs == 0 ? BTDEBUG_ARG_INT : (longs == 1 ? BTDEBUG_ARG_LONG : BTDEBUG_ARG_LONGLONG));
+    if (strchr("eEfFgGaA", *p) != NULL)
+        return BTDEBUG_ARG_DOUBLE;
+    if (*p == 's' && longs == 0)
+        return BTDEBUG_ARG_STRING;
+    if (*p == 'p')
+        return BTDEBUG_ARG_POINTER;
+    if (*p == '%')
+        return BTDEBUG_ARG_NONE;
+    return BTDEBUG_ARG_UNSUPPORTED;
+}
+
+// Capture a debug message's arguments so that the formatting is done by the drain timer rather than
+// the caller.  Messages that can't be captured, such as those whose format isn't a constant, are
+// formatted immediately.
+void btdebug_send_deferred(const char *format, va_list args) {
+    uint8_t record[2 + sizeof(char *) + BTDEBUG_DEFERRED_ARGS];
+    uint16_t i, used = 2 + sizeof(char *);
+    const char *p = format;
+    char spec[16];
+    va_list original;
+    bool fDeferrable = ((uintptr_t) format < BTDEBUG_DEFERRED_RAM);
+
+    // Exit if not yet initialized, or if it's not going anywhere
+    if (!init || !can_send_to_bluetooth())
+        return;
+    welcome_message();
+    if (io_optimize_power())
+        return;
+
+#ifdef BTDEBUG_BYPASS_BUFFERING
+    fDeferrable = false;
 #endif
 
+    // Capture the arguments, deferring only those messages whose strings are short
+    va_copy(original, args);
+    while (fDeferrable && *p != '\0') {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+        int type = btdebug_spec(&p, spec, sizeof(spec));
+        uint8_t *arg = &record[used];
+        uint16_t left = sizeof(record) - used;
+        switch (type) {
+        case BTDEBUG_ARG_NONE:
+            break;
+        case BTDEBUG_ARG_INT:
+            if (left < sizeof(int)) {
+                fDeferrable = false;
+                break;
+            }
+            int intval = va_arg(args, int);
+            memcpy(arg, &intval, sizeof(intval));
+            used += sizeof(intval);
+            break;
+        case BTDEBUG_ARG_LONG:
+            if (left < sizeof(long)) {
+                fDeferrable = false;
+                break;
+            }
+            long longval = va_arg(args, long);
+            memcpy(arg, &longval, sizeof(longval));
+            used += sizeof(longval);
+            break;
+        case BTDEBUG_ARG_LONGLONG:
+            if (left < sizeof(long long)) {
+                fDeferrable = false;
+                break;
+            }
+            long long longlongval = va_arg(args, long long);
+            memcpy(arg, &longlongval, sizeof(longlongval));
+            used += sizeof(longlongval);
+            break;
+        case BTDEBUG_ARG_DOUBLE:
+            if (left < sizeof(double)) {
+                fDeferrable = false;
+                break;
+            }
+            double doubleval = va_arg(args, double);
+            memcpy(arg, &doubleval, sizeof(doubleval));
+            used += sizeof(doubleval);
+            break;
+        case BTDEBUG_ARG_POINTER:
+            if (left < sizeof(void *)) {
+                fDeferrable = false;
+                break;
+            }
+            void *pointerval = va_arg(args, void *);
+            memcpy(arg, &pointerval, sizeof(pointerval));
+            used += sizeof(pointerval);
+            break;
+        case BTDEBUG_ARG_STRING: {
+            const char *str = va_arg(args, const char *);
+            if (str == NULL)
+                str = "(null)";
+            // Rather than truncating a long string, format the whole message now
+            for (i=0; str[i] != '\0' && i < BTDEBUG_DEFERRED_STRING && i < left; i++)
+                arg[i] = str[i];
+            if (i >= left || str[i] != '\0') {
+                fDeferrable = false;
+                break;
+            }
+            arg[i++] = '\0';
+            used += i;
+            break;
+        }
+        default:
+            fDeferrable = false;
+            break;
+        }
+    }
+
+    // Format it right now if we couldn't capture it
+    if (!fDeferrable) {
+        char buffer[256];
+        vsnprintf(buffer, sizeof(buffer)-1, format, original);
+        va_end(original);
+        btdebug_send_string(buffer);
+        return;
+    }
+    va_end(original);
+
+    // Same defensive programming as when sending a string
+    if (recursion++ != 0) {
+        --recursion;
+        return;
+    }
+
+    // Append the record only if all of it fits, because a partial record can't be expanded
+    record[0] = BTDEBUG_DEFERRED;
+    record[1] = (uint8_t) (used - (2 + sizeof(char *)));
+    memcpy(&record[2], &format, sizeof(char *));
+    CRITICAL_REGION_ENTER();
+    if (output_buffer_used + used <= sizeof(output_buffer)) {
+        for (i=0; i<used; i++) {
+            output_buffer[output_buffer_fill_next++] = record[i];
+            if (output_buffer_fill_next >= sizeof(output_buffer))
+                output_buffer_fill_next = 0;
+        }
+        output_buffer_used += used;
+    }
+    CRITICAL_REGION_EXIT();
+    btdebug_start_timer();
+
     // Done
     --recursion;
 
 }
 
+// Take the next byte from the output buffer
+static uint8_t btdebug_get() {
+    uint8_t databyte = output_buffer[output_buffer_drain_next++];
+    if (output_buffer_drain_next >= sizeof(output_buffer))
+        output_buffer_drain_next = 0;
+    output_buffer_used--;
+    return databyte;
+}
+
+// Expand the deferred record at the head of the output buffer into text
+static void btdebug_expand() {
+    uint8_t record[sizeof(char *) + BTDEBUG_DEFERRED_ARGS];
+    uint16_t i, length = sizeof(char *) + btdebug_get();
+    const char *format, *p;
+    uint8_t *arg = &record[sizeof(char *)];
+    char spec[16];
+
+    for (i=0; i<length && output_buffer_used != 0; i++)
+        record[i] = btdebug_get();
+    memcpy(&format, record, sizeof(char *));
+    expanded_length = expanded_next = 0;
+
+    for (p = format; *p != '\0' && expanded_length < sizeof(expanded)-1;) {
+        char *out = &expanded[expanded_length];
+        uint16_t left = sizeof(expanded) - expanded_length;
+        int len = 0;
+        if (*p != '%') {
+            expanded[expanded_length++] = *p++;
+            continue;
+        }
+        switch (btdebug_spec(&p, spec, sizeof(spec))) {
+        case BTDEBUG_ARG_NONE:
+            len = snprintf(out, left, spec);
+            break;
+        case BTDEBUG_ARG_INT: {
+            int intval;
+            memcpy(&intval, arg, sizeof(intval));
+            arg += sizeof(intval);
+            len = snprintf(out, left, spec, intval);
+            break;
+        }
+        case BTDEBUG_ARG_LONG: {
+            long longval;
+            memcpy(&longval, arg, sizeof(longval));
+            arg += sizeof(longval);
+            len = snprintf(out, left, spec, longval);
+            break;
+        }
+        case BTDEBUG_ARG_LONGLONG: {
+            long long longlongval;
+            memcpy(&longlongval, arg, sizeof(longlongval));
+            arg += sizeof(longlongval);
+            len = snprintf(out, left, spec, longlongval);
+            break;
+        }
+        case BTDEBUG_ARG_DOUBLE: {
+            double doubleval;
+            memcpy(&doubleval, arg, sizeof(doubleval));
+            arg += sizeof(doubleval);
+            len = snprintf(out, left, spec, doubleval);
+            break;
+        }
+        case BTDEBUG_ARG_POINTER: {
+            void *pointerval;
+            memcpy(&pointerval, arg, sizeof(pointerval));
+            arg += sizeof(pointerval);
+            len = snprintf(out, left, spec, pointerval);
+            break;
+        }
+        case BTDEBUG_ARG_STRING:
+            len = snprintf(out, left, spec, (char *) arg);
+            arg += strlen((char *) arg) + 1;
+            break;
+        default:
+            len = -1;
+            break;
+        }
+        if (len < 0)
+            break;
+        expanded_length += (len >= left) ? left-1 : len;
+    }
+
+}
+
+// Get the next byte to be sent, expanding deferred records as they are reached
+static bool btdebug_next_byte(uint8_t *databyte) {
+    while (expanded_next >= expanded_length) {
+        expanded_next = expanded_length = 0;
+        if (output_buffer_used == 0)
+            return false;
+        *databyte = btdebug_get();
+        if (*databyte != BTDEBUG_DEFERRED)
+            return true;
+        btdebug_expand();
+    }
+    *databyte = expanded[expanded_next++];
+    return true;
+}
+
+// Drain until empty, or until the softdevice is out of TX buffers.  Each byte is sent
+// without allowing any output to be appended while we are inside the bluetooth subsystem,
+// and whatever partial notification remains is sent once we've run out of output.
+static void btdebug_drain() {
+    uint8_t databyte;
+    recursion++;
+    while (bluetooth_tx_ready()) {
+        if (!btdebug_next_byte(&databyte)) {
+            bluetooth_flush();
+            break;
+        }
+        if (!send_byte_to_bluetooth(databyte))
+            break;
+    }
+    recursion--;
+}
+
+// Scheduled drain, requested when output is appended or when the softdevice has room for more
+static void btdebug_drain_handler(void *unused1, uint16_t unused2) {
+    drain_scheduled = false;
+    if (timer_interrupt_being_serviced++ == 0)
+        btdebug_drain();
+    --timer_interrupt_being_serviced;
+}
+
+// Resume draining when the softdevice has completed transmitting notifications
+void btdebug_tx_complete() {
+    if (init)
+        btdebug_schedule_drain();
+}
+
 // Timer
 void btdebug_timer_handler(void *p_context) {
 
@@ -124,7 +479,7 @@ void btdebug_timer_handler(void *p_context) {
     }
             
     // If nothing is left after debouncing, shut down the timer
-    if (output_buffer_used == 0) {
+    if (output_buffer_used == 0 && expanded_next >= expanded_length) {
 
         // Exit if we're still debouncing
         if (timer_debounce_count != 0) {
@@ -151,26 +506,8 @@ void btdebug_timer_handler(void *p_context) {
     // Since we've got something to output, reset the debounce timer
     timer_debounce_count = BTDEBUG_TIMER_DEBOUNCE_MILLISECONDS / BTDEBUG_TIMER_MILLISECONDS;
 
-    // Drain until the earlier of empty or asked to pause
-    while (output_buffer_used) {
-
-        // Grab the next byte
-        uint8_t databyte = output_buffer[output_buffer_drain_next++];
-        if (output_buffer_drain_next >= sizeof(output_buffer))
-            output_buffer_drain_next = 0;
-        output_buffer_used--;
-
-        // Send it, but (and this is defensive coding) don't allow any
-        // output to be appended while we are inside the bluetooth subsystem.
-        recursion++;
-        bool fPause = send_byte_to_bluetooth(databyte);
-        recursion--;
-
-        // Force a pause if instructed to do so
-        if (!fPause)
-            break;
-
-    }
+    // Drain what we can
+    btdebug_drain();
 
     // Done
     --timer_interrupt_being_serviced;
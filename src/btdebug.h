@@ -5,8 +5,13 @@
 #ifndef BTDEBUG_H_
 #define BTDEBUG_H_
 
+#include <stdarg.h>
+
+bool btdebug_active(void);
 void btdebug_send_byte(uint8_t databyte);
 void btdebug_send_string(char *str);
+void btdebug_send_deferred(const char *format, va_list args);
 void btdebug_create_timer();
+void btdebug_tx_complete(void);
 
 #endif  // BTDEBUG_H_
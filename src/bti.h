@@ -41,10 +41,18 @@
 // Maximum length of data (in bytes) that can be transmitted to the controller (this is 23-3==20)
 #define BTP_MAX_DATA_LEN (GATT_MTU_SIZE_DEFAULT - 3)
 
+// Maximum length of a notification once a larger ATT MTU has been negotiated.  With S132 v3 the
+// link layer sizes its packets to the configured ATT MTU, negotiating data length extension itself.
+#ifdef NRF_BLE_MAX_MTU_SIZE
+#define BTP_MAX_NOTIFY_LEN (NRF_BLE_MAX_MTU_SIZE - 3)
+#else
+#define BTP_MAX_NOTIFY_LEN BTP_MAX_DATA_LEN
+#endif
+
 // Maximum length of the TX characteristic data, in bytes
 #define BTP_MAX_TX_CHAR_LEN BTP_MAX_DATA_LEN
 // Maximum length of the RX characteristic data, in bytes
-#define BTP_MAX_RX_CHAR_LEN BTP_MAX_DATA_LEN
+#define BTP_MAX_RX_CHAR_LEN BTP_MAX_NOTIFY_LEN
 
 // UUID for the Service (16-byte/128-bit vendor specific)
 // Generated using http://www.itu.int/en/ITU-T/asn1/Pages/UUID/uuids.aspx, then bytes reversed because this is least-significant first
@@ -114,6 +122,8 @@ struct btp_s {
     uint16_t                 conn_handle;
     // Whether or not the peer has enabled notification of the RX characteristic
     bool                     is_notification_enabled;
+    // Largest notification that the negotiated ATT MTU allows
+    uint16_t                 max_data_len;
     // Event handler to be called for handling received data
     btp_data_handler_t       data_handler;
 };
@@ -123,6 +133,7 @@ void btp_init(btp_t *p_btp);
 void btp_on_ble_evt(btp_t *p_btp, ble_evt_t *p_ble_evt);
 uint32_t btp_string_send(btp_t *p_btp, uint8_t *p_string, uint16_t length);
 bool btp_can_send(btp_t *p_btp);
+uint16_t btp_max_data_len(btp_t *p_btp);
 
 // BTC Exports
 void btc_init(btc_t *p_btc);
@@ -137,6 +137,19 @@ uint32_t tx_char_add(btp_t *p_btp) {
 }
 
 
+// Note the ATT MTU that has been negotiated with the peer
+#if (NRF_SD_BLE_API_VERSION >= 3)
+void btp_mtu_set(btp_t *p_btp, uint16_t mtu) {
+    if (mtu > NRF_BLE_MAX_MTU_SIZE)
+        mtu = NRF_BLE_MAX_MTU_SIZE;
+    if (mtu < GATT_MTU_SIZE_DEFAULT)
+        mtu = GATT_MTU_SIZE_DEFAULT;
+    p_btp->max_data_len = mtu - 3;
+    if (debug(DBG_BT))
+        DEBUG_PRINTF("ATT MTU %d, notifications up to %d bytes\n", mtu, p_btp->max_data_len);
+}
+#endif
+
 // BTP BLE event handler, called from the main ble_evt_dispatch
 void btp_on_ble_evt(btp_t *p_btp, ble_evt_t *p_ble_evt) {
 
@@ -146,10 +159,28 @@ void btp_on_ble_evt(btp_t *p_btp, ble_evt_t *p_ble_evt) {
 
     switch (p_ble_evt->header.evt_id) {
 
+    case BLE_GAP_EVT_CONNECTED:
+    case BLE_GAP_EVT_DISCONNECTED:
+        p_btp->max_data_len = BTP_MAX_DATA_LEN;
+        break;
+
     case BLE_GATTS_EVT_WRITE:
         on_write(p_btp, p_ble_evt);
         break;
 
+#if (NRF_SD_BLE_API_VERSION >= 3)
+
+    // Whichever side initiates the exchange, the MTU in effect is the smaller of the two
+    case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+        btp_mtu_set(p_btp, p_ble_evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu);
+        break;
+
+    case BLE_GATTC_EVT_EXCHANGE_MTU_RSP:
+        btp_mtu_set(p_btp, p_ble_evt->evt.gattc_evt.params.exchange_mtu_rsp.server_rx_mtu);
+        break;
+
+#endif
+
     }
 }
 
@@ -166,6 +197,7 @@ void btp_init(btp_t *p_btp) {
     p_btp->conn_handle             = BLE_CONN_HANDLE_INVALID;
     p_btp->data_handler            = btp_data_handler;
     p_btp->is_notification_enabled = false;
+    p_btp->max_data_len            = BTP_MAX_DATA_LEN;
 
     /* [Adding proprietary Service to S110 SoftDevice] */
     // Add our custom base 128-bit UUID to the internal table.
@@ -223,6 +255,13 @@ bool btp_can_send(btp_t *p_btp) {
 
 }
 
+// The largest packet that can be sent to the host on the current connection
+uint16_t btp_max_data_len(btp_t *p_btp) {
+    if (p_btp == NULL || p_btp->max_data_len == 0)
+        return BTP_MAX_DATA_LEN;
+    return p_btp->max_data_len;
+}
+
 // Send a single packet to host by generating an HVX notification on the rx characteristic
 uint32_t btp_string_send(btp_t *p_btp, uint8_t *p_string, uint16_t length) {
     ble_gatts_hvx_params_t hvx_params;
@@ -230,7 +269,7 @@ uint32_t btp_string_send(btp_t *p_btp, uint8_t *p_string, uint16_t length) {
 
     if (!btp_can_send(p_btp))
         return NRF_ERROR_INVALID_STATE;
-    if (length > BTP_MAX_DATA_LEN)
+    if (length > btp_max_data_len(p_btp))
         return NRF_ERROR_INVALID_PARAM;
 
     memset(&hvx_params, 0, sizeof(hvx_params));
@@ -243,7 +282,9 @@ uint32_t btp_string_send(btp_t *p_btp, uint8_t *p_string, uint16_t length) {
     status = sd_ble_gatts_hvx(p_btp->conn_handle, &hvx_params);
 
 #ifdef DEBUG_USES_UART
-    if (status == 0x3401) {
+    if (status == NRF_SUCCESS || status == BLE_ERROR_NO_TX_PACKETS) {
+        // The caller retries once the softdevice has freed TX buffers
+    } else if (status == 0x3401) {
         // Handy debugging note because of the bizarre error code:
         // https://devzone.nordicsemi.com/question/6085/strange-error-code-13313-0x3401-returned-by-sd_ble_gatts_hvx
         if (debug(DBG_BT))
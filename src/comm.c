@@ -20,6 +20,7 @@
 #include "misc.h"
 #include "send.h"
 #include "stats.h"
+#include "evlog.h"
 #include "timer.h"
 #include "gpio.h"
 #include "pms.h"
@@ -30,11 +31,14 @@
 #include "sensor.h"
 #include "twi.h"
 #include "storage.h"
+#include "recv.h"
 #include "tt.pb.h"
 #include "pb_encode.h"
 #include "pb_decode.h"
 #include "app_scheduler.h"
 #include "battery.h"
+#include "prof.h"
+#include "energy.h"
 
 // Initialization-related
 static bool commWaitingForFirstSelect = false;
@@ -48,6 +52,7 @@ static bool fFlushBuffers = false;
 static uint16_t mode_request = COMM_NONE;
 static uint16_t connect_state = CONNECT_STATE_UNKNOWN;
 static char last_select_reason[64] = "";
+static uint64_t connect_state_entered = 0L;
 
 // Burn & stats stuff
 static bool burn_toggle_mode_request = false;
@@ -84,6 +89,42 @@ static uint32_t lastServiceUpdateTime = 0L;
 // App scheduler
 static uint16_t pending_completions = 0;
 
+// Sequenced batches in flash that have been sent via UDP, from the next to be uploaded
+// onward, and whether or not the service has acknowledged them.
+#define ACK_WINDOW              4
+#define ACK_TIMEOUT_SECONDS     30
+#define ACK_MAX_RETRIES         5
+typedef struct {
+    bool valid;
+    bool acked;
+    uint16_t seq;
+    uint16_t retries;
+    uint32_t sent;
+} ackslot_t;
+static ackslot_t ackslot[ACK_WINDOW];
+
+// Rolling per-WAN estimates used by WAN_AUTO to choose the cheapest link that can
+// carry what's pending.  Each new sample is weighted 1/WAN_COST_WEIGHT, and estimates
+// are capped so that weighting, margins and scaling can never overflow 32 bits.
+#define WAN_COST_WEIGHT         4
+#define WAN_COST_LINKS          2
+#define WAN_COST_MAX            (0xffffffffUL / 1000)
+typedef struct {
+    uint16_t mode;
+    uint16_t active_ma;
+    uint32_t connect_seconds;
+    uint32_t delivery_percent;
+    uint32_t mas_per_kb;
+    uint32_t sample_seconds;
+    uint32_t sample_transmitted;
+} wancost_t;
+static wancost_t wancost[WAN_COST_LINKS] = {
+    {COMM_LORA, WAN_COST_LORA_MA, 30, 100, 0, 0, 0},
+    {COMM_FONA, WAN_COST_FONA_MA, 120, 100, 0, 0, 0},
+};
+static uint32_t lastWanCostCheckTime = 0L;
+static uint32_t lastWanSwitchTime = 0L;
+
 // Timer for comm select, for stats purposes
 #define COMM_SELECT_TRACK_TIMES 10
 static uint16_t worstCommSelectTimes[COMM_SELECT_TRACK_TIMES];
@@ -372,6 +413,12 @@ void comm_watchdog_reset() {
     }
 }
 
+// Something significant has been measured, so upload at the next opportunity rather
+// than waiting out the rest of the oneshot interval
+void comm_oneshot_now() {
+    lastOneshotTime = 0;
+}
+
 // Force a call now, for debugging
 void comm_call_now() {
     commCallNow = true;
@@ -425,6 +472,12 @@ void comm_reset(bool fForce) {
 
 // Request state, for debugging
 void comm_request_state() {
+    char latency[128];
+
+    comm_latency_summary(latency, sizeof(latency));
+    if (latency[0] != '\0')
+        DEBUG_PRINTF("Latency ms p50/p95/p99 %s\n", latency);
+
     switch (comm_mode()) {
 #ifdef LORA
     case COMM_LORA:
@@ -455,6 +508,7 @@ void comm_force_cell() {
     // If we have something to fail over to, do it
 #ifdef CELLX
     commForceCell = true;
+    comm_cost_link_failed(COMM_LORA);
     DEBUG_PRINTF("*** Network down - forcing cellular comms ***\n");
 #endif
 
@@ -568,7 +622,8 @@ uint32_t get_oneshot_interval() {
     }
     }
 
-    return(suppressionSeconds);
+    // Stretch or shrink the interval according to the power budget
+    return(battery_plan_interval(suppressionSeconds));
 
 }
 
@@ -583,8 +638,8 @@ uint32_t get_oneshot_cell_interval() {
     if (sensor_op_mode() == OPMODE_TEST_FAST || sensor_op_mode() == OPMODE_TEST_BURN)
         return (10 * 60);
 
-    // Return what's configured
-    return(storage()->oneshot_cell_minutes * 60);
+    // Stretch or shrink what's configured according to the power budget, as cellular is our biggest draw
+    return(battery_plan_interval(storage()->oneshot_cell_minutes * 60));
 
 }
 
@@ -612,6 +667,9 @@ uint32_t get_service_update_interval_minutes() {
 // Display current comm state
 void comm_show_state() {
     uint32_t seconds_since_boot = get_seconds_since_boot();
+    float dawn_soc;
+    if (battery_forecast_dawn_soc(&dawn_soc))
+        DEBUG_PRINTF("Power plan: %.0f%% at dawn, intervals at %d%%\n", dawn_soc, battery_plan_percent());
     if (!comm_oneshot_currently_enabled())
         DEBUG_PRINTF("Oneshot disabled\n");
     else {
@@ -676,6 +734,155 @@ void comm_show_state() {
 
 }
 
+// Find the cost estimates for a comms mode
+wancost_t *comm_cost_link(uint16_t mode) {
+    int i;
+    for (i=0; i<WAN_COST_LINKS; i++)
+        if (wancost[i].mode == mode)
+            return &wancost[i];
+    return NULL;
+}
+
+// Fold a new sample into a rolling estimate
+uint32_t comm_cost_rolling(uint32_t estimate, uint32_t sample) {
+    return ((estimate * (WAN_COST_WEIGHT-1)) + sample) / WAN_COST_WEIGHT;
+}
+
+// Record the outcome of a select, and how long it took to be able to send
+void comm_cost_connected(uint16_t mode, bool fSuccess, uint32_t seconds) {
+    wancost_t *link = comm_cost_link(mode);
+    if (link == NULL)
+        return;
+    link->delivery_percent = comm_cost_rolling(link->delivery_percent, fSuccess ? 100 : 0);
+    if (fSuccess)
+        link->connect_seconds = comm_cost_rolling(link->connect_seconds, seconds);
+}
+
+// The service has told us that this link isn't getting through
+void comm_cost_link_failed(uint16_t mode) {
+    wancost_t *link = comm_cost_link(mode);
+    if (link != NULL)
+        link->delivery_percent = 0;
+}
+
+// Record the outcome of a transmission that can be confirmed
+void comm_cost_delivered(uint16_t mode, bool fSuccess) {
+    wancost_t *link = comm_cost_link(mode);
+    if (link != NULL)
+        link->delivery_percent = comm_cost_rolling(link->delivery_percent, fSuccess ? 100 : 0);
+}
+
+// Charge the energy used while the active link has been powered against what it transmitted
+void comm_cost_sample() {
+    uint32_t seconds, transmitted;
+    wancost_t *link = comm_cost_link(active_comm_mode);
+    if (link == NULL || currently_deselected || comm_powered_up == 0)
+        return;
+    seconds = get_seconds_since_boot() - (link->sample_seconds > comm_powered_up ? link->sample_seconds : comm_powered_up);
+    transmitted = stats()->transmitted - link->sample_transmitted;
+    link->sample_seconds = get_seconds_since_boot();
+    link->sample_transmitted = stats()->transmitted;
+    if (transmitted == 0)
+        return;
+    // mA*s per KB, computed in whichever order keeps it within 32 bits
+    uint32_t sample = WAN_COST_MAX;
+    if (seconds <= WAN_COST_MAX / link->active_ma) {
+        uint32_t mas = link->active_ma * seconds;
+        if (mas <= WAN_COST_MAX / 1024)
+            sample = (mas * 1024) / transmitted;
+        else if ((mas / transmitted) <= WAN_COST_MAX / 1024)
+            sample = (mas / transmitted) * 1024;
+    }
+    link->mas_per_kb = comm_cost_rolling(link->mas_per_kb, sample);
+}
+
+// Begin a new energy sample when a link is powered up
+void comm_cost_sample_begin(uint16_t mode) {
+    wancost_t *link = comm_cost_link(mode);
+    if (link == NULL)
+        return;
+    link->sample_seconds = get_seconds_since_boot();
+    link->sample_transmitted = stats()->transmitted;
+}
+
+// Estimate the mA*s needed to deliver this many bytes over a link, returning 0 if the
+// link can't carry its largest frame or can't be expected to connect within the deadline.
+uint32_t comm_cost_estimate(wancost_t *link, uint16_t bytes, uint16_t largest, uint32_t deadline_seconds) {
+    uint16_t mtu = 0;
+    uint32_t cost;
+
+    switch (link->mode) {
+#ifdef LORA
+    case COMM_LORA:
+        mtu = lora_get_mtu();
+        break;
+#endif
+#ifdef FONA
+    case COMM_FONA:
+        mtu = fona_get_mtu();
+        break;
+#endif
+    }
+    if (mtu == 0 || largest > mtu || link->delivery_percent == 0)
+        return 0;
+    if (deadline_seconds != 0 && link->connect_seconds > deadline_seconds)
+        return 0;
+
+    // Cost of connecting plus the cost of the bytes, scaled up by the chance of having to repeat it
+    if (link->connect_seconds > WAN_COST_MAX / link->active_ma)
+        return WAN_COST_MAX;
+    cost = link->active_ma * link->connect_seconds;
+    cost += ((link->mas_per_kb / 1024) * bytes) + (((link->mas_per_kb % 1024) * bytes) / 1024);
+    if (cost > WAN_COST_MAX / 100)
+        return WAN_COST_MAX;
+    return ((cost * 100) / link->delivery_percent) + 1;
+
+}
+
+// Choose the cheapest link that can deliver what's pending within the deadline,
+// staying on the current link unless another is cheaper by a margin.
+uint16_t comm_cost_select(uint16_t bytes, uint16_t largest, uint32_t deadline_seconds) {
+    int i;
+    uint16_t best_mode = active_comm_mode;
+    uint32_t cost, best_cost = 0;
+    wancost_t *current = comm_cost_link(active_comm_mode);
+
+    if (current != NULL)
+        best_cost = comm_cost_estimate(current, bytes, largest, deadline_seconds);
+
+    for (i=0; i<WAN_COST_LINKS; i++) {
+        if (&wancost[i] == current)
+            continue;
+        cost = comm_cost_estimate(&wancost[i], bytes, largest, deadline_seconds);
+        if (cost == 0)
+            continue;
+        if (best_cost == 0 || ((cost * (100 + WAN_COST_MARGIN_PERCENT)) / 100) < best_cost) {
+            best_cost = cost;
+            best_mode = wancost[i].mode;
+        }
+    }
+
+    if (debug(DBG_COMM_MAX))
+        for (i=0; i<WAN_COST_LINKS; i++)
+            DEBUG_PRINTF("%s cost %lu (%lus connect, %lu%% delivered, %lumAs/KB)\n",
+                         comm_mode_name(wancost[i].mode), comm_cost_estimate(&wancost[i], bytes, largest, deadline_seconds),
+                         wancost[i].connect_seconds, wancost[i].delivery_percent, wancost[i].mas_per_kb);
+
+    return best_mode;
+
+}
+
+// Find a link other than the active one that has failed and so needs a probe before its
+// estimate can be trusted again.  A link's estimate only recovers from what the probe
+// itself achieves, so that it isn't chosen again simply because time has passed.
+uint16_t comm_cost_probe() {
+    int i;
+    for (i=0; i<WAN_COST_LINKS; i++)
+        if (wancost[i].mode != active_comm_mode && wancost[i].delivery_percent == 0)
+            return wancost[i].mode;
+    return COMM_NONE;
+}
+
 void select_lora_if_available() {
 #ifdef LORA
     comm_select(COMM_LORA, "lora desired");
@@ -805,21 +1012,41 @@ void comm_poll() {
 
     // Handle failover mode
 #if defined(CELLX)
-    static bool restartAfterFailover = false;
-    static uint32_t failoverTime;
 
-    // If we've entered failover mode but we're not yet in cell mode, perform the switch
-    if (comm_autowan_mode() == AUTOWAN_FAILOVER && comm_mode() != COMM_FONA) {
-        failoverTime = get_seconds_since_boot();
-        restartAfterFailover = true;
+    // If we've entered failover mode but we're not yet in cell mode, perform the switch,
+    // waiting if a sensor has borrowed the UART until it has been handed back.
+    if (comm_autowan_mode() == AUTOWAN_FAILOVER && comm_mode() != COMM_FONA && !gpio_uart_lent()) {
+        lastWanCostCheckTime = lastWanSwitchTime = get_seconds_since_boot();
         comm_select(COMM_FONA, "failover");
         return;
     }
 
-    // If we've performed the switch, periodically restart the device in case the network has returned
-    if (restartAfterFailover && !ShouldSuppress(&failoverTime, FAILOVER_RESTART_MINUTES * 60L)) {
-        io_request_restart();
-        return;
+    // In auto mode, periodically move to whichever link is currently cheapest for what we have
+    // to send.  Once we've dwelled long enough on a link we probe any link that had failed,
+    // which is how we eventually return to Lora after a failover.  Before then we only move
+    // if the current link can't carry what we have at all.
+    if (storage()->wan == WAN_AUTO && comm_gps_completed() && !comm_is_busy()
+        && !ShouldSuppress(&lastWanCostCheckTime, WAN_COST_CHECK_MINUTES * 60L)) {
+        bool dwelling = (get_seconds_since_boot() - lastWanSwitchTime) < (WAN_COST_DWELL_MINUTES * 60L);
+        uint16_t best_mode;
+        comm_cost_sample();
+        if (!dwelling && (best_mode = comm_cost_probe()) != COMM_NONE) {
+            lastWanSwitchTime = get_seconds_since_boot();
+            commForceCell = (best_mode == COMM_FONA);
+            comm_select(best_mode, "probe");
+            return;
+        }
+        best_mode = comm_cost_select(send_length_buffered(), send_largest_buffered(), get_oneshot_interval());
+        wancost_t *current = comm_cost_link(comm_mode());
+        if (dwelling && current != NULL
+            && comm_cost_estimate(current, send_length_buffered(), send_largest_buffered(), get_oneshot_interval()) != 0)
+            best_mode = comm_mode();
+        if (best_mode != comm_mode()) {
+            lastWanSwitchTime = get_seconds_since_boot();
+            commForceCell = (best_mode == COMM_FONA);
+            comm_select(best_mode, "lower cost");
+            return;
+        }
     }
 
 #endif
@@ -863,6 +1090,14 @@ void comm_poll() {
         // If comms is active
         if (!currently_deselected) {
 
+            // Wait while a sensor has borrowed the UART, because we can't send until it's returned
+            // and we mustn't deselect the module out from under the sensor using it.
+            if (gpio_uart_lent()) {
+                if (debug(DBG_COMM_MAX))
+                    DEBUG_PRINTF("Oneshot waiting for UART to be returned...\n");
+                return;
+            }
+
             // If we're hung in init, presumably waiting for service, abort after a while
             // because aborting is preferable to hanging here forever and draining the battery.
             if (!comm_can_send_to_service() && comm_powered_up != 0) {
@@ -881,6 +1116,11 @@ void comm_poll() {
             if (oneshotCompleted && !comm_is_busy()) {
                 oneshotCompleted = false;
                 if (!comm_update_service()) {
+                    // Let the module close anything it kept open, and come back here once it has
+                    if (comm_close_session()) {
+                        oneshotCompleted = true;
+                        return;
+                    }
                     comm_deselect("no work");
                     if (debug(DBG_COMM_MAX))
                         DEBUG_PRINTF("Deselecting comms (no work)\n");
@@ -896,6 +1136,10 @@ void comm_poll() {
                 && !comm_is_busy()
                 && !ShouldSuppress(&comm_powered_up, ONESHOT_UPDATE_SECONDS)) {
                 if (!comm_update_service()) {
+                    if (comm_close_session()) {
+                        oneshotCompleted = true;
+                        return;
+                    }
                     comm_deselect("oneshot idle");
                     if (debug(DBG_COMM_MAX))
                         DEBUG_PRINTF("Deselecting comms (oneshot)\n");
@@ -961,6 +1205,12 @@ void comm_poll() {
     if (!comm_would_be_buffered(false))
         comm_update_service();
 
+    // If we're powered down between oneshots with nothing to upload, there's nothing for us to do
+    // until a sensor completes, so let the timer sleep for as long as it likes.
+    if (comm_oneshot_currently_enabled() && currently_deselected && !commCallNow
+        && !comm_is_busy() && !sensor_any_upload_needed())
+        timer_deadline(TIMER_DEADLINE_COMM, TT_TICKLESS_MAX_SECONDS);
+
     // Update our uptime stats
     stats_update();
 
@@ -982,6 +1232,112 @@ void comm_initiate_service_update(bool fFull) {
     comm_flush_buffers();
 }
 
+// Process an ack received from the service for sequenced batches in flash
+void comm_ack_received(uint8_t *ack, uint16_t length) {
+    uint16_t i, seq, diff;
+
+    if (length < BUFF_ACK_LENGTH || ack[0] != BUFF_FORMAT_ACK)
+        return;
+    seq = ack[1] | (ack[2] << 8);
+
+    // Mark each slot that is acknowledged either by number or by the bitmap
+    for (i=0; i<ACK_WINDOW; i++) {
+        if (!ackslot[i].valid || ackslot[i].acked)
+            continue;
+        diff = (uint16_t) (ackslot[i].seq - seq);
+        if (diff == 0 || (diff <= 8 && (ack[3] & (1 << (diff-1))) != 0)) {
+            ackslot[i].acked = true;
+            stats()->acked_batches++;
+        }
+    }
+
+    if (debug(DBG_COMM_MAX))
+        DEBUG_PRINTF("ACK %u/%02x\n", seq, ack[3]);
+
+}
+
+// Send the sequenced batches in flash that are as yet unacknowledged, one per call,
+// releasing those at the head of the buffer as they are acknowledged.  Returns true
+// if something was sent or if we are still waiting for acks.
+bool comm_update_acked() {
+    uint8_t entry[DB_ENTRY_BYTES];
+    uint16_t i, messages, entry_length, entry_request_type, seq;
+    bool fWaiting = false;
+
+    // Only cellular can receive the service's acks, and elsewhere they are sent unacked
+    if (comm_mode() != COMM_FONA)
+        return false;
+
+    // Release what is acknowledged, or what we've given up on, at the head of the buffer
+    while (db_get(entry, &entry_length, &entry_request_type) != 0) {
+        if (entry[0] != BUFF_FORMAT_PB_ARRAY_SEQ)
+            break;
+        seq = entry[1] | (entry[2] << 8);
+        if (!ackslot[0].valid || ackslot[0].seq != seq)
+            break;
+        if (!ackslot[0].acked) {
+            if (ackslot[0].retries < ACK_MAX_RETRIES || (get_seconds_since_boot() - ackslot[0].sent) < ACK_TIMEOUT_SECONDS)
+                break;
+            stats()->acked_abandoned++;
+            DEBUG_PRINTF("Abandoning unacked batch %u\n", seq);
+        }
+        db_get_release();
+        for (i=0; i<ACK_WINDOW-1; i++)
+            ackslot[i] = ackslot[i+1];
+        ackslot[ACK_WINDOW-1].valid = false;
+    }
+
+    // Send the first in the window that has never been sent, or whose ack has timed out
+    for (i=0; i<ACK_WINDOW; i++) {
+        messages = db_get_nth(i, entry, &entry_length, &entry_request_type);
+        if (i >= messages || entry[0] != BUFF_FORMAT_PB_ARRAY_SEQ)
+            break;
+        seq = entry[1] | (entry[2] << 8);
+
+        // Resynchronize if the flash buffer changed beneath us
+        if (!ackslot[i].valid || ackslot[i].seq != seq) {
+            ackslot[i].valid = true;
+            ackslot[i].acked = false;
+            ackslot[i].seq = seq;
+            ackslot[i].retries = 0;
+            ackslot[i].sent = 0;
+        }
+        if (ackslot[i].acked)
+            continue;
+        if (ackslot[i].sent != 0 && (get_seconds_since_boot() - ackslot[i].sent) < ACK_TIMEOUT_SECONDS) {
+            fWaiting = true;
+            continue;
+        }
+        if (ackslot[i].retries >= ACK_MAX_RETRIES) {
+            fWaiting = true;
+            continue;
+        }
+        // Abandon what can never fit, rather than letting it block everything behind it
+        if (entry_length > comm_get_mtu()) {
+            stats()->acked_abandoned++;
+            DEBUG_PRINTF("Abandoning oversized batch %u\n", seq);
+            ackslot[i].acked = true;
+            continue;
+        }
+
+        DEBUG_PRINTF("SEND %db seq %u from flash%s\n", entry_length, seq, ackslot[i].sent == 0 ? "" : " (retransmit)");
+        if (!comm_send_to_service(entry, entry_length, REPLY_NONE))
+            return false;
+        if (ackslot[i].sent != 0) {
+            ackslot[i].retries++;
+            stats()->acked_retransmits++;
+        }
+        ackslot[i].sent = get_seconds_since_boot();
+        return true;
+    }
+
+    // If we're waiting for acks, come back on the next poll rather than powering down
+    if (fWaiting)
+        comm_oneshot_completed();
+    return fWaiting;
+
+}
+
 // If it's time, do a single transaction with the service to keep it up-to-date
 bool comm_update_service() {
 
@@ -994,7 +1350,12 @@ bool comm_update_service() {
         uint8_t entry[DB_ENTRY_BYTES];
         uint16_t entry_length, entry_request_type;
         uint16_t messages = db_get(entry, &entry_length, &entry_request_type);
-        if (messages != 0) {
+        // Sequenced batches are only held for acks where acks can come back; elsewhere
+        // they are sent just like any other batch, so that they can't block the buffer.
+        if (messages != 0 && entry[0] == BUFF_FORMAT_PB_ARRAY_SEQ && comm_mode() == COMM_FONA) {
+            if (comm_update_acked())
+                return true;
+        } else if (messages != 0) {
             // Only attempt to send it if there's some possibility that we CAN.
             // This happens frequently because we may have buffered data while in
             // mobile mode, but then later we're on Lora which can't send out
@@ -1026,7 +1387,9 @@ bool comm_update_service() {
         static bool fSentDFU = true;
         static bool fSentCell1 = true;
         static bool fSentCell2 = true;
+        static bool fSentDelta = false;
         bool fMobile = sensor_op_mode() == OPMODE_MOBILE;
+        bool fBinaryConfig = comm_get_mtu() < 128;
         bool fSentStats = false;
         bool fSentSomething = false;
         // On first iteration, initialize statics based on whether strings are non-null
@@ -1063,7 +1426,14 @@ bool comm_update_service() {
             fSentSomething = fSentFullStats = fMobile || send_update_to_service(UPDATE_STATS_VERSION);
         else if (!fSentConfigLAB)
             fSentSomething = fSentConfigLAB = fMobile || send_update_to_service(UPDATE_STATS_LABEL);
-        else if (!fSentConfigDEV)
+        else if (fBinaryConfig && (!fSentConfigDEV || !fSentConfigGPS || !fSentConfigSVC || !fSentConfigTTN || !fSentConfigSEN)) {
+            // One uplink may not hold every changed key, so keep sending until none remain
+            if (fMobile || storage_get_config_as_binary(NULL, 0, true) == 0) {
+                fSentSomething = true;
+                fSentConfigDEV = fSentConfigGPS = fSentConfigSVC = fSentConfigTTN = fSentConfigSEN = true;
+            } else
+                fSentSomething = send_update_to_service(UPDATE_STATS_CONFIG_BIN);
+        } else if (!fSentConfigDEV)
             fSentSomething = fSentConfigDEV = fMobile || send_update_to_service(UPDATE_STATS_CONFIG_DEV);
         else if (!fSentConfigGPS)
             fSentSomething = fSentConfigGPS = fMobile || send_update_to_service(UPDATE_STATS_CONFIG_GPS);
@@ -1077,7 +1447,7 @@ bool comm_update_service() {
             fSentSomething = fSentConfigBAT = fMobile || send_update_to_service(UPDATE_STATS_BATTERY);
         else if (!fSentConfigMOD)
             fSentSomething = fSentConfigMOD = fMobile || send_update_to_service(UPDATE_STATS_MODULES);
-        else if (!fSentConfigERR)
+        else if (!fSentConfigERR && !fBinaryConfig)
             fSentSomething = fSentConfigERR = fMobile || send_update_to_service(UPDATE_STATS_ERRORS);
         else if (!fSentDFU)
             fSentSomething = fSentDFU = fMobile || send_update_to_service(UPDATE_STATS_DFU);
@@ -1085,8 +1455,18 @@ bool comm_update_service() {
             fSentSomething = fSentCell1 = fMobile || send_update_to_service(UPDATE_STATS_CELL1);
         else if (!fSentCell2)
             fSentSomething = fSentCell2 = fMobile || send_update_to_service(UPDATE_STATS_CELL2);
-        else {
+        else if (!fMobile && evlog_upload_pending()) {
+            // Event log pages requested by the service go up a segment at a time
+            fSentSomething = evlog_get_upload(NULL, 0) == 0 || send_update_to_service(UPDATE_STATS_EVLOG);
+        } else if (fBinaryConfig && !fSentDelta) {
+            // Where the MTU is limited, counters (including errors) only go up as changes
+            fSentSomething = fSentDelta = fMobile || stats_delta_pending() || stats_get_delta_as_binary(NULL, 0) == 0 || send_update_to_service(UPDATE_STATS_DELTA);
+            if (fSentDelta)
+                fSentConfigERR = true;
+        } else {
             fSentSomething = fSentStats = send_update_to_service(UPDATE_STATS);
+            if (fSentStats)
+                fSentDelta = false;
         }
         // Come back here immediately if the message couldn't make it out or we have stuff left to do
         if (!fSentFullStats
@@ -1102,6 +1482,7 @@ bool comm_update_service() {
             || !fSentDFU
             || !fSentCell1
             || !fSentCell2
+            || (!fMobile && evlog_upload_pending())
             || !fSentStats) {
             lastServiceUpdateTime = 0L;
             // When we come back, let's make sure that we are NOT using buffered I/O
@@ -1272,6 +1653,10 @@ bool comm_can_send_to_service() {
     if (get_seconds_since_boot() < FAST_DEVICE_UPDATE_BEGIN)
         return false;
 
+    // Exit if the module's UART hasn't yet been switched in, or if it has been lent out
+    if (gpio_uart_switching() || gpio_uart_lent())
+        return false;
+
     // Let the individual transport decide
     switch (comm_mode()) {
 #ifdef LORA
@@ -1297,6 +1682,10 @@ bool comm_is_busy() {
     if (!comm_can_send_to_service())
         return true;
 #endif
+    // We're busy until the module's UART has been switched in and it has been initialized,
+    // and while it is lent out to a sensor
+    if (!currently_deselected && (gpio_uart_switching() || gpio_uart_lent()))
+        return true;
     switch (comm_mode()) {
 #ifdef LORA
     case COMM_LORA:
@@ -1519,13 +1908,10 @@ uint16_t comm_gps_get_value(float *pLat, float *pLon, float *pAlt) {
 
 // Decode a hex-encoded received message, then unmarshal and process what's inside
 uint16_t comm_decode_received_message(char *msg, void *ttmessage, uint8_t *buffer, uint16_t buffer_length, uint16_t *bytesDecoded) {
-    uint8_t bin[256], *pbin;
+    uint8_t bin[256];
     int length;
     char hiChar, loChar;
     uint8_t databyte;
-    uint16_t status;
-    ttproto_Telecast tmessage;
-    ttproto_Telecast *message = (ttproto_Telecast *) ttmessage;
 
     // Skip leading whitespace and control characters, to get to the hex
     while (*msg != '\0' && *msg <= ' ')
@@ -1544,6 +1930,19 @@ uint16_t comm_decode_received_message(char *msg, void *ttmessage, uint8_t *buffe
     if (bytesDecoded != NULL)
         *bytesDecoded = length;
 
+    // Decode the binary that we've extracted
+    return(comm_decode_received_binary_message(bin, length, ttmessage, buffer, buffer_length));
+
+}
+
+// Decode a binary buffer-formatted message, such as one received without hex encoding
+uint16_t comm_decode_received_binary_message(uint8_t *bin, uint16_t bin_length, void *ttmessage, uint8_t *buffer, uint16_t buffer_length) {
+    uint8_t *pbin;
+    int length;
+    uint16_t status;
+    ttproto_Telecast tmessage;
+    ttproto_Telecast *message = (ttproto_Telecast *) ttmessage;
+
     // Zero out the structure to receive the decoded data
     if (message == NULL)
         message = &tmessage;
@@ -1553,7 +1952,16 @@ uint16_t comm_decode_received_message(char *msg, void *ttmessage, uint8_t *buffe
     // It will be this way if we're relaying a message.
     // If not, just process it as-is under the assumption that it's a single protocol buffer
     pbin = bin;
-    if (bin[0] == BUFF_FORMAT_PB_ARRAY && bin[1] == 1) {
+    if (bin_length > BUFF_CONFIG_HEADER && bin[0] == BUFF_FORMAT_CONFIG) {
+        uint32_t address = bin[1] | (bin[2] << 8) | (bin[3] << 16) | ((uint32_t)bin[4] << 24);
+        buffer[0] = '\0';
+        if (address != io_get_device_address()) {
+            DEBUG_PRINTF("Received config for device %lu\n", address);
+            return MSG_TELECAST;
+        }
+        recv_config_from_service(&bin[BUFF_CONFIG_HEADER], bin_length - BUFF_CONFIG_HEADER);
+        return MSG_REPLY_TTSERVE;
+    } else if (bin_length >= 3 && bin[0] == BUFF_FORMAT_PB_ARRAY && bin[1] == 1 && bin[2] <= (bin_length - 3)) {
 
         // Process the message
         length = bin[2];
@@ -1616,6 +2024,7 @@ uint16_t comm_decode_received_message(char *msg, void *ttmessage, uint8_t *buffe
             // If it's from ttserve and directed at us, then it's a reply to our request
             if (message->has_device_id && message->device_id == io_get_device_address()) {
                 DEBUG_PRINTF("Received TTSERVE message\n");
+                stats_delta_acked();
                 return MSG_REPLY_TTSERVE;
             }
             DEBUG_PRINTF("Received TTServe message not intended for this device\n");
@@ -1638,7 +2047,76 @@ uint16_t comm_decode_received_message(char *msg, void *ttmessage, uint8_t *buffe
 
 // Set the state so that we can understand why connects may have failed
 void comm_set_connect_state(uint16_t state) {
+    uint16_t phase;
+
+    // Record how long we spent in the phase that we're leaving
+    switch (connect_state) {
+    case CONNECT_STATE_LORA_MODULE:
+    case CONNECT_STATE_FONA_MODULE:
+        phase = COMM_PHASE_MODULE;
+        break;
+    case CONNECT_STATE_WIRELESS_SERVICE:
+    case CONNECT_STATE_LORA_GATEWAY:
+    case CONNECT_STATE_LORAWAN_GATEWAY:
+        phase = COMM_PHASE_REGISTER;
+        break;
+    case CONNECT_STATE_DATA_SERVICE:
+        phase = COMM_PHASE_ATTACH;
+        break;
+    default:
+        phase = COMM_PHASES;
+        break;
+    }
+    if (phase != COMM_PHASES && state != connect_state && connect_state_entered != 0)
+        comm_latency_record(phase, (uint32_t) (get_ms_since_boot() - connect_state_entered));
+
     connect_state = state;
+    connect_state_entered = get_ms_since_boot();
+}
+
+// Record a latency, in milliseconds, for a phase of the currently-active link
+void comm_latency_record(uint16_t phase, uint32_t ms) {
+    uint16_t link;
+    switch (active_comm_mode) {
+    case COMM_LORA:
+        link = 0;
+        break;
+    case COMM_FONA:
+        link = 1;
+        break;
+    default:
+        return;
+    }
+    if (phase < COMM_PHASES)
+        histogram_record(&stats()->latency[link][phase], ms);
+}
+
+// Summarize latencies in milliseconds as p50/p95/p99 for each link and phase that has data
+void comm_latency_summary(char *buffer, uint16_t length) {
+    static const char phase_names[COMM_PHASES] = {'c', 'm', 'r', 'a', 's', 'p'};
+    static const char *link_names[COMM_LINKS] = {"lora:", "fona:"};
+    int link, phase;
+    char item[32];
+    histogram_t *h;
+
+    buffer[0] = '\0';
+    for (link=0; link<COMM_LINKS; link++) {
+        bool fFirst = true;
+        for (phase=0; phase<COMM_PHASES; phase++) {
+            h = &stats()->latency[link][phase];
+            if (histogram_count(h) == 0)
+                continue;
+            sprintf(item, "%s%s%c%lu/%lu/%lu",
+                    fFirst ? (buffer[0] == '\0' ? "" : "|") : ",",
+                    fFirst ? link_names[link] : "",
+                    phase_names[phase],
+                    histogram_percentile(h, 50), histogram_percentile(h, 95), histogram_percentile(h, 99));
+            if (strlen(buffer) + strlen(item) >= length)
+                return;
+            strlcat(buffer, item, length);
+            fFirst = false;
+        }
+    }
 }
 
 // Get the connect state
@@ -1679,6 +2157,7 @@ void comm_deselect(char *reason) {
     uint16_t comm_mode = active_comm_mode;
     comm_select(COMM_NONE, reason);
     active_comm_mode = comm_mode;
+    energy_oneshot_end();
 }
 
 // See if we are truly powered off
@@ -1756,7 +2235,8 @@ void comm_reselect() {
 
     if (currently_deselected) {
 
-        // Select the new comms
+        // Select the new comms, accounting for what this session costs
+        energy_oneshot_begin();
         comm_select(active_comm_mode, "reselect");
 
     }
@@ -1796,9 +2276,10 @@ void log_longest_comm_select(uint32_t seconds) {
     int i, count;
     uint32_t sum;
 
-    // Remember the absolute worst
+    // Remember the absolute worst, and the distribution for the link
     if (seconds > absoluteWorst)
         absoluteWorst = seconds;
+    comm_latency_record(COMM_PHASE_CONNECT, seconds * 1000);
 
     // Every day, throw away the worst half of the entries
     if (!ShouldSuppress(&lastCommSelectTimePurgeTime, 24L * 60L * 60L)) {
@@ -1835,12 +2316,67 @@ void log_longest_comm_select(uint32_t seconds) {
 void comm_select_completed() {
     isCommSelectInProgress = false;
     if (lastCommSelectTime != 0) {
-        if (get_seconds_since_boot() > lastCommSelectTime)
+        if (get_seconds_since_boot() > lastCommSelectTime) {
             log_longest_comm_select(get_seconds_since_boot() - lastCommSelectTime);
+            comm_cost_connected(active_comm_mode, true, get_seconds_since_boot() - lastCommSelectTime);
+        }
         lastCommSelectTime = 0;
     }
 }
 
+// Initialize the comms module once the UART switch to it has completed, unless
+// it has been deselected in the meantime
+void comm_uart_ready(uint16_t which) {
+#ifdef LORA
+    if (which == UART_LORA && active_comm_mode == COMM_LORA)
+        lora_init();
+#endif
+#ifdef FONA
+    if (which == UART_FONA && active_comm_mode == COMM_FONA)
+        fona_init();
+#endif
+}
+
+// See if the comms module is between transactions, such that its UART may be lent to a sensor
+bool comm_uart_lendable() {
+    if (currently_deselected || isCommSelectInProgress)
+        return false;
+    switch (comm_mode()) {
+#ifdef LORA
+    case COMM_LORA:
+        return(lora_uart_idle());
+#endif
+#ifdef FONA
+    case COMM_FONA:
+        return(fona_uart_idle());
+#endif
+    }
+    return false;
+}
+
+// Close any session that the comms module kept open between sends, returning true if it's still closing
+bool comm_close_session() {
+    switch (comm_mode()) {
+#ifdef FONA
+    case COMM_FONA:
+        return(fona_close_session());
+#endif
+    }
+    return false;
+}
+
+// Pick up where we left off once a lent UART has been returned to the comms module
+void comm_uart_returned(uint16_t which) {
+#ifdef LORA
+    if (which == UART_LORA && active_comm_mode == COMM_LORA)
+        lora_uart_resync();
+#endif
+#ifdef FONA
+    if (which == UART_FONA && active_comm_mode == COMM_FONA)
+        fona_uart_resync();
+#endif
+}
+
 // Select a specific comms mode
 void comm_select(uint16_t which, char *reason) {
     uint16_t original_which = which;
@@ -1858,11 +2394,14 @@ void comm_select(uint16_t which, char *reason) {
     // Exit if superfluous or inappropriate
     if (sensor_test_mode() && which != COMM_NONE)
         return;
+    evlog1(EV_COMM_SELECT, which);
 
     // Detect if we've failed a previous select
     if (isCommSelectInProgress) {
         isCommSelectInProgress = false;
         failedCommSelects++;
+        evlog1(EV_CONNECT_FAILED, connect_state);
+        comm_cost_connected(active_comm_mode, false, 0);
         switch (connect_state) {
         case CONNECT_STATE_LORA_MODULE:
             DEBUG_PRINTF("Failed to connect: lora module\n");
@@ -1903,6 +2442,7 @@ void comm_select(uint16_t which, char *reason) {
         oneshotCompleted = true;
 
     // Handle deselection of existing mode
+    comm_cost_sample();
     lastCommSelectTime = 0;
     comm_powered_up = 0;
     comm_powered_down = get_seconds_since_boot();
@@ -1946,20 +2486,20 @@ void comm_select(uint16_t which, char *reason) {
     // Initialize the subsystem as appropriate
 #ifdef LORA
     if (which == COMM_LORA) {
-        gpio_uart_select(UART_LORA);
+        gpio_uart_select(UART_LORA, comm_uart_ready);
         comm_last_powered_up = comm_powered_up = get_seconds_since_boot();
         comm_powered_down = 0;
+        comm_cost_sample_begin(COMM_LORA);
         comm_set_connect_state(CONNECT_STATE_LORA_MODULE);
-        lora_init();
     }
 #endif
 #ifdef FONA
     if (which == COMM_FONA) {
-        gpio_uart_select(UART_FONA);
+        gpio_uart_select(UART_FONA, comm_uart_ready);
         comm_last_powered_up = comm_powered_up = get_seconds_since_boot();
         comm_powered_down = 0;
+        comm_cost_sample_begin(COMM_FONA);
         comm_set_connect_state(CONNECT_STATE_FONA_MODULE);
-        fona_init();
     }
 #endif
 
@@ -1968,9 +2508,6 @@ void comm_select(uint16_t which, char *reason) {
 // Initialization of this module and the entire state machine
 void comm_init() {
 
-    // Init statistics
-    memset(stats(), 0, sizeof(stats_t));
-
     // Init state machines
     phone_init();
 #ifdef BGEIGIE
@@ -2013,6 +2550,7 @@ uint16_t comm_mode() {
 // Process a completion event
 void completion_event_handler(void *p_event_data, uint16_t event_size) {
     uint16_t type = * (uint16_t *) p_event_data;
+    uint32_t began = prof_begin();
 
     // One less completion pending to be processed, defensively coded
     if (pending_completions)
@@ -2048,6 +2586,8 @@ void completion_event_handler(void *p_event_data, uint16_t event_size) {
 #endif
     }
 
+    prof_end(PROF_CMDBUF, began);
+
 }
 
 // Enqueue, at an interrupt level, a completion event
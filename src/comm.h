@@ -65,6 +65,8 @@ struct cmdbuf_s {
 #define CONNECT_STATE_LORAWAN_ACTIVE    11
 #define CONNECT_STATE_FONA_ACTIVE       12
 void comm_set_connect_state(uint16_t state);
+void comm_latency_record(uint16_t phase, uint32_t ms);
+void comm_latency_summary(char *buffer, uint16_t length);
 
 // Public
 
@@ -73,6 +75,7 @@ char *comm_connect_state();
 void comm_cmdbuf_init(cmdbuf_t *cmd, uint16_t type);
 void comm_cmdbuf_reset(cmdbuf_t *cmd);
 void comm_call_now(void);
+void comm_oneshot_now(void);
 void comm_request_state();
 void comm_watchdog_reset();
 void comm_reset(bool fForce);
@@ -80,6 +83,7 @@ void comm_force_cell();
 void comm_flush_buffers();
 void comm_initiate_service_update(bool fFull);
 bool comm_update_service();
+void comm_ack_received(uint8_t *ack, uint16_t length);
 void comm_process_message_from_service(char *message);
 void comm_cmdbuf_set(cmdbuf_t *cmd, char *Message);
 void comm_cmdbuf_set_state(cmdbuf_t *cmd, uint16_t newstate);
@@ -126,6 +130,10 @@ bool comm_is_deselected();
 bool comm_db_is_active();
 void comm_show_state();
 void comm_select(uint16_t which, char *reason);
+void comm_uart_ready(uint16_t which);
+bool comm_uart_lendable();
+void comm_uart_returned(uint16_t which);
+bool comm_close_session();
 bool comm_can_send_to_service();
 bool comm_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType);
 
@@ -133,6 +141,10 @@ bool comm_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
 #define AUTOWAN_GPS_WAIT        1
 #define AUTOWAN_FAILOVER        2
 uint16_t comm_autowan_mode();
+uint16_t comm_cost_select(uint16_t bytes, uint16_t largest, uint32_t deadline_seconds);
+void comm_cost_connected(uint16_t mode, bool fSuccess, uint32_t seconds);
+void comm_cost_delivered(uint16_t mode, bool fSuccess);
+void comm_cost_link_failed(uint16_t mode);
 
 #define MSG_NOT_DECODED         0
 #define MSG_TELECAST            1
@@ -140,5 +152,6 @@ uint16_t comm_autowan_mode();
 #define MSG_REPLY_TTGATE        3
 #define MSG_REPLY_TTSERVE       4
 uint16_t comm_decode_received_message(char *msg, void *message, uint8_t *buffer, uint16_t length, uint16_t *decodedBytes);
+uint16_t comm_decode_received_binary_message(uint8_t *bin, uint16_t bin_length, void *message, uint8_t *buffer, uint16_t length);
 
 #endif // COMM_H__
@@ -0,0 +1,211 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Compact fixed-point encoding of a Telecast, for very limited MTU links
+
+#include <string.h>
+#include "debug.h"
+#include "send.h"
+#include "compact.h"
+
+// Protobuf wire types
+#define WT_VARINT           0
+#define WT_LENGTH           2
+
+// Output cursor, which is marked as overflowed rather than ever writing past the end
+typedef struct {
+    uint8_t *buffer;
+    uint16_t length;
+    uint16_t used;
+    bool overflow;
+} compact_t;
+
+// Append a byte
+void compact_byte(compact_t *c, uint8_t databyte) {
+    if (c->used >= c->length) {
+        c->overflow = true;
+        return;
+    }
+    c->buffer[c->used++] = databyte;
+}
+
+// Append an unsigned varint
+void compact_varint(compact_t *c, uint32_t value) {
+    while (value >= 0x80) {
+        compact_byte(c, (uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    compact_byte(c, (uint8_t) value);
+}
+
+// Zigzag-encode a signed value so that small negative numbers stay short
+uint32_t compact_zigzag(int32_t value) {
+    return (((uint32_t) value) << 1) ^ ((uint32_t) (value >> 31));
+}
+
+// Scale a float to a rounded fixed-point integer
+int32_t compact_scale(float value, float scale) {
+    float v = value * scale;
+    return (int32_t) (v >= 0.0 ? v + 0.5 : v - 0.5);
+}
+
+// Append a varint field
+void compact_field(compact_t *c, uint16_t tag, uint32_t value) {
+    compact_varint(c, (tag << 3) | WT_VARINT);
+    compact_varint(c, value);
+}
+
+// Append a sint32 field
+void compact_field_signed(compact_t *c, uint16_t tag, int32_t value) {
+    compact_field(c, tag, compact_zigzag(value));
+}
+
+// Append a packed sint32 field, whose values have already been zigzagged into the scratch buffer
+void compact_field_packed(compact_t *c, uint16_t tag, compact_t *packed) {
+    if (packed->overflow) {
+        c->overflow = true;
+        return;
+    }
+    compact_varint(c, (tag << 3) | WT_LENGTH);
+    compact_varint(c, packed->used);
+    for (uint16_t i=0; i<packed->used; i++)
+        compact_byte(c, packed->buffer[i]);
+}
+
+// Append a packed sensor group, in which bit N of the leading mask says that values[N] is present
+void compact_group(compact_t *c, uint16_t tag, bool *present, int32_t *values, uint16_t count) {
+    uint8_t scratch[80];
+    compact_t packed = {scratch, sizeof(scratch), 0, false};
+    uint32_t mask = 0;
+    for (uint16_t i=0; i<count; i++)
+        if (present[i])
+            mask |= (1 << i);
+    if (mask == 0)
+        return;
+    compact_varint(&packed, compact_zigzag((int32_t) mask));
+    for (uint16_t i=0; i<count; i++)
+        if (present[i])
+            compact_varint(&packed, compact_zigzag(values[i]));
+    compact_field_packed(c, tag, &packed);
+}
+
+// Encode a Telecast into the compact format, returning 0 if it doesn't fit
+uint16_t compact_encode(ttproto_Telecast *message, uint8_t *buffer, uint16_t length) {
+    compact_t c = {buffer, length, 0, false};
+
+    compact_byte(&c, BUFF_FORMAT_COMPACT);
+
+    if (message->has_device_id)
+        compact_field(&c, COMPACT_DEVICE_ID, message->device_id);
+    if (message->has_captured_at_date)
+        compact_field(&c, COMPACT_CAPTURED_DATE, message->captured_at_date);
+    if (message->has_captured_at_time)
+        compact_field(&c, COMPACT_CAPTURED_TIME, message->captured_at_time);
+    if (message->has_captured_at_offset)
+        compact_field(&c, COMPACT_CAPTURED_OFFSET, message->captured_at_offset);
+    if (message->has_latitude)
+        compact_field_signed(&c, COMPACT_LATITUDE, compact_scale(message->latitude, COMPACT_SCALE_DEGREES));
+    if (message->has_longitude)
+        compact_field_signed(&c, COMPACT_LONGITUDE, compact_scale(message->longitude, COMPACT_SCALE_DEGREES));
+    if (message->has_altitude)
+        compact_field_signed(&c, COMPACT_ALTITUDE, message->altitude);
+    if (message->has_stamp)
+        compact_field(&c, COMPACT_STAMP, message->stamp);
+
+    // Geiger tubes, identified by their Telecast field number
+    uint8_t scratch[40];
+    compact_t tubes = {scratch, sizeof(scratch), 0, false};
+    if (message->has_lnd_7318u) {
+        compact_varint(&tubes, ttproto_Telecast_lnd_7318u_tag);
+        compact_varint(&tubes, message->lnd_7318u);
+    }
+    if (message->has_lnd_7318c) {
+        compact_varint(&tubes, ttproto_Telecast_lnd_7318c_tag);
+        compact_varint(&tubes, message->lnd_7318c);
+    }
+    if (message->has_lnd_7128ec) {
+        compact_varint(&tubes, ttproto_Telecast_lnd_7128ec_tag);
+        compact_varint(&tubes, message->lnd_7128ec);
+    }
+    if (message->has_lnd_712u) {
+        compact_varint(&tubes, ttproto_Telecast_lnd_712u_tag);
+        compact_varint(&tubes, message->lnd_712u);
+    }
+    if (message->has_lnd_78017w) {
+        compact_varint(&tubes, ttproto_Telecast_lnd_78017w_tag);
+        compact_varint(&tubes, message->lnd_78017w);
+    }
+    if (tubes.used != 0)
+        compact_field_packed(&c, COMPACT_GEIGER, &tubes);
+
+    // Battery
+    bool bp[] = {message->has_bat_voltage, message->has_bat_soc, message->has_bat_current};
+    int32_t bv[] = {compact_scale(message->bat_voltage, 1000.0),
+                    compact_scale(message->bat_soc, 10.0),
+                    compact_scale(message->bat_current, 100.0)};
+    compact_group(&c, COMPACT_BATTERY, bp, bv, 3);
+
+    // Environment, inside and outside of the enclosure
+    bool ep[] = {message->has_env_temp, message->has_env_humid, message->has_env_pressure};
+    int32_t ev[] = {compact_scale(message->env_temp, 100.0),
+                    compact_scale(message->env_humid, 10.0),
+                    compact_scale(message->env_pressure, 0.1)};
+    compact_group(&c, COMPACT_ENV, ep, ev, 3);
+    bool np[] = {message->has_enc_temp, message->has_enc_humid, message->has_enc_pressure};
+    int32_t nv[] = {compact_scale(message->enc_temp, 100.0),
+                    compact_scale(message->enc_humid, 10.0),
+                    compact_scale(message->enc_pressure, 0.1)};
+    compact_group(&c, COMPACT_ENC, np, nv, 3);
+
+    // Air
+    bool pp[] = {message->has_pms_pm01_0, message->has_pms_pm02_5, message->has_pms_pm10_0,
+                 message->has_pms_std01_0, message->has_pms_std02_5, message->has_pms_std10_0,
+                 message->has_pms_c00_30, message->has_pms_c00_50, message->has_pms_c01_00,
+                 message->has_pms_c02_50, message->has_pms_c05_00, message->has_pms_c10_00,
+                 message->has_pms_csecs};
+    int32_t pv[] = {message->pms_pm01_0, message->pms_pm02_5, message->pms_pm10_0,
+                    compact_scale(message->pms_std01_0, 100.0),
+                    compact_scale(message->pms_std02_5, 100.0),
+                    compact_scale(message->pms_std10_0, 100.0),
+                    message->pms_c00_30, message->pms_c00_50, message->pms_c01_00,
+                    message->pms_c02_50, message->pms_c05_00, message->pms_c10_00,
+                    message->pms_csecs};
+    compact_group(&c, COMPACT_PMS, pp, pv, 13);
+    bool op[] = {message->has_opc_pm01_0, message->has_opc_pm02_5, message->has_opc_pm10_0,
+                 message->has_opc_std01_0, message->has_opc_std02_5, message->has_opc_std10_0,
+                 message->has_opc_c00_38, message->has_opc_c00_54, message->has_opc_c01_00,
+                 message->has_opc_c02_10, message->has_opc_c05_00, message->has_opc_c10_00,
+                 message->has_opc_csecs};
+    int32_t ov[] = {compact_scale(message->opc_pm01_0, 100.0),
+                    compact_scale(message->opc_pm02_5, 100.0),
+                    compact_scale(message->opc_pm10_0, 100.0),
+                    compact_scale(message->opc_std01_0, 100.0),
+                    compact_scale(message->opc_std02_5, 100.0),
+                    compact_scale(message->opc_std10_0, 100.0),
+                    message->opc_c00_38, message->opc_c00_54, message->opc_c01_00,
+                    message->opc_c02_10, message->opc_c05_00, message->opc_c10_00,
+                    message->opc_csecs};
+    compact_group(&c, COMPACT_OPC, op, ov, 13);
+
+    // Flags and trailing rarely-present fields
+    uint32_t flags = 0;
+    if (message->has_motion && message->motion)
+        flags |= COMPACT_FLAG_MOTION;
+    if (message->has_test && message->test)
+        flags |= COMPACT_FLAG_TEST;
+    if (message->has_reply_type && message->reply_type == ttproto_Telecast_replyType_ALLOWED)
+        flags |= COMPACT_FLAG_REPLY;
+    if (flags != 0)
+        compact_field(&c, COMPACT_FLAGS, flags);
+    if (message->has_motion_began_offset)
+        compact_field(&c, COMPACT_MOTION_OFFSET, message->motion_began_offset);
+    if (message->has_stats_seqno)
+        compact_field(&c, COMPACT_SEQNO, message->stats_seqno);
+
+    if (c.overflow)
+        return 0;
+
+    return c.used;
+
+}
@@ -0,0 +1,41 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef COMPACT_H__
+#define COMPACT_H__
+
+#include "tt.pb.h"
+
+// Compact Telecast, for links whose MTU is too small for the floats and long tags of ttproto_Telecast.
+// The message is the BUFF_FORMAT_COMPACT byte followed by protobuf wire-format fields.  Tags 1-15
+// fit in a single byte along with the wire type, so they go to fields sent in every message, while
+// the rare ones (motion offset, and seqno which is only sent when testing) take two.  Floats are sent as zigzag (sint32) varints scaled to fixed point, and
+// sensor groups are packed sint32 arrays whose first element is a bitmask of the members that follow.
+#define COMPACT_DEVICE_ID           1   // varint
+#define COMPACT_CAPTURED_DATE       2   // varint
+#define COMPACT_CAPTURED_TIME       3   // varint
+#define COMPACT_CAPTURED_OFFSET     4   // varint
+#define COMPACT_LATITUDE            5   // sint32, degrees * COMPACT_SCALE_DEGREES
+#define COMPACT_LONGITUDE           6   // sint32, degrees * COMPACT_SCALE_DEGREES
+#define COMPACT_ALTITUDE            7   // sint32, meters
+#define COMPACT_STAMP               8   // varint
+#define COMPACT_GEIGER              9   // packed varint pairs of (ttproto_Telecast tube tag, cpm)
+#define COMPACT_BATTERY             10  // packed sint32: mask, mV, soc*10, mA*100
+#define COMPACT_ENV                 11  // packed sint32: mask, temp*100, humid*10, pressure/10
+#define COMPACT_ENC                 12  // packed sint32: mask, temp*100, humid*10, pressure/10
+#define COMPACT_PMS                 13  // packed sint32: mask, pm*3, std*100 *3, counts*6, csecs
+#define COMPACT_OPC                 14  // packed sint32: mask, pm*100 *3, std*100 *3, counts*6, csecs
+#define COMPACT_FLAGS               15  // varint of COMPACT_FLAG_
+#define COMPACT_MOTION_OFFSET       16  // varint
+#define COMPACT_SEQNO               17  // varint
+
+#define COMPACT_FLAG_MOTION         0x01
+#define COMPACT_FLAG_TEST           0x02
+#define COMPACT_FLAG_REPLY          0x04
+
+#define COMPACT_SCALE_DEGREES       100000.0
+
+uint16_t compact_encode(ttproto_Telecast *message, uint8_t *buffer, uint16_t length);
+
+#endif // COMPACT_H__
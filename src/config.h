@@ -26,9 +26,32 @@
 #define ONESHOT_FAST_MINUTES                10
 #endif
 
+// Power budget planning, in which oneshot and sensor intervals are stretched or shrunk
+// so that the battery is forecast to be at the target SOC when the sun comes up.
+#define BATTERY_CAPACITY_MAH                2000
+#define BATTERY_PLAN_DAWN_HOUR              6
+#define BATTERY_PLAN_TARGET_SOC             60.0
+#define BATTERY_PLAN_MIN_PERCENT            50
+#define BATTERY_PLAN_MAX_PERCENT            400
+
+// Change-triggered uploads.  Dead bands are configured in sensor_params as "db.cpm=10/db.temp=0.5",
+// and a field whose value hasn't moved outside its band is only re-sent at this heartbeat.
+#define DEADBAND_HEARTBEAT_MINUTES          60
+
 // How often we ping the service with stats requests
 #define SERVICE_UPDATE_MINUTES              (12*60)
 
+// How often stats are checkpointed to flash, in addition to just before any restart.  The two
+// slots alternate, so each page is erased every other checkpoint, which at 6h is about 1000
+// erases a year against the 10000 that the flash is rated for.
+#define STATS_CHECKPOINT_HOURS              6
+
+// How long a stats delta may go unacknowledged before we give up on it and send absolute values
+#define STATS_DELTA_ACK_MINUTES             60
+
+// How long logged events may be held in RAM before they're appended to the event log in flash
+#define EVLOG_FLUSH_MINUTES                 15
+
 // How often we upload via cellular
 #ifdef CELL15DEBUG
 #define ONESHOT_CELL_UPLOAD_MINUTES         15
@@ -43,11 +66,20 @@
 // Parameters mapping out gateway robustness
 #define DEFAULT_RESTART_DAYS                7
 #define FAILOVER_CHECK_MINUTES              30
+
+// Parameters of the WAN_AUTO link cost model.  Currents are nominal draw while each module
+// is powered, and an alternative link must be cheaper by the margin before we switch to it.
+// After any switch we dwell on the new link, and only then probe a link that had failed.
 #ifdef FAILOVERDEBUG
-#define FAILOVER_RESTART_MINUTES            60
+#define WAN_COST_CHECK_MINUTES              5
+#define WAN_COST_DWELL_MINUTES              60
 #else
-#define FAILOVER_RESTART_MINUTES            (24 * 60)
+#define WAN_COST_CHECK_MINUTES              FAILOVER_CHECK_MINUTES
+#define WAN_COST_DWELL_MINUTES              (24 * 60)
 #endif
+#define WAN_COST_MARGIN_PERCENT             25
+#define WAN_COST_LORA_MA                    40
+#define WAN_COST_FONA_MA                    250
 
 // The number of minutes that motion must be stable for us to begin measuring
 #ifdef MOTIONDEBUG
@@ -118,10 +150,41 @@
 #define TT_FAST_TIMER_SECONDS               GEIGER_BUCKET_SECONDS
 #define TT_SLOW_TIMER_SECONDS               15
 
+// In tickless mode, the slow timer is stretched to the earliest deadline registered by the
+// subsystems, but never beyond the point where the app timer or RTC wrap would be at risk.
+#define TT_TICKLESS_MAX_SECONDS             240
+
 // Power measurement parameters
 #define PWR_SAMPLE_PERIOD_SECONDS           20
 #define PWR_SAMPLE_SECONDS                  2
 
+// Modelled average draw of each power rail while on, in mA, which the energy ledger scales to
+// match measured battery current, folding in each sample with weight 1/ENERGY_SCALE_WEIGHT
+#define ENERGY_MA_BASE                      0.5
+#define ENERGY_MA_LORA                      12.0
+#define ENERGY_MA_CELL                      90.0
+#define ENERGY_MA_GPS                       25.0
+#define ENERGY_MA_AIR                       100.0
+#define ENERGY_MA_GEIGER                    2.0
+#define ENERGY_MA_TWI                       1.0
+#define ENERGY_MA_ROCK                      0.0
+#define ENERGY_SCALE_MIN                    0.25
+#define ENERGY_SCALE_MAX                    4.0
+#define ENERGY_SCALE_WEIGHT                 8
+
+// UART mux switch delays, for lines to settle after deconfiguring the UART, for serial traffic
+// to stabilize after selecting a speed, and for a module to power up before we transmit to it
+#define UART_SWITCH_SETTLING_MS             500
+#define UART_SWITCH_STABILIZING_MS          1000
+#define UART_SWITCH_POWERING_MS             500
+
+// UART time-slicing between the comms module and UART sensors.  Comms holds the UART for at least
+// its minimum dwell before lending it to a sensor of equal or lower priority.
+#define UART_PRIORITY_SENSOR                1
+#define UART_PRIORITY_COMM                  2
+#define UART_PRIORITY_MOBILE_GPS            3
+#define UART_DWELL_COMM_SECONDS             (60*2)
+
 // Various watchdogs that auto-reset
 #define CELL_WATCHDOG_SECONDS               60
 #define LORA_WATCHDOG_SECONDS               60
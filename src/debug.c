@@ -14,6 +14,7 @@
 #include "debug.h"
 #include "serial.h"
 #include "ssd.h"
+#include "evlog.h"
 
 #if !defined(BOOTLOADERX)
 #include "twi.h"
@@ -101,13 +102,27 @@ void log_rtt_printf(int terminal_index, char *format_msg, ...) {
     log_debug_write_string(buffer);
 }
 
+// See whether debug output would go anywhere, so that DEBUG_PRINTF can skip the work entirely
+bool debug_output_active() {
+#if !defined(DEBUG_USES_UART) && !defined(BOOTLOADERX) && !defined(SSD)
+    return btdebug_active();
+#else
+    return true;
+#endif
+}
+
 void log_debug_printf(char *format_msg, ...) {
-    char buffer[256];
     va_list p_args;
     va_start(p_args, format_msg);
+#if !defined(DEBUG_USES_UART) && !defined(BOOTLOADERX) && !defined(SSD)
+    // Capture the arguments, leaving the formatting to be done as the output is drained
+    btdebug_send_deferred(format_msg, p_args);
+#else
+    char buffer[256];
     vsnprintf(buffer, sizeof(buffer)-1, format_msg, p_args);
-    va_end(p_args);
     log_debug_write_string(buffer);
+#endif
+    va_end(p_args);
 }
 
 __INLINE void log_debug_write_string_many(int num_args, ...) {
@@ -212,5 +227,6 @@ __WEAK void app_error_fault_handler(uint32_t id, uint32_t pc, uint32_t info)
 
 __WEAK void debug_check_handler(uint32_t error_code, uint32_t line_num, uint8_t *p_file_name) {
     DEBUG_PRINTF("DEBUG_CHECK(%04x) %d:%s\n", error_code, line_num, p_file_name);
+    evlog2(EV_ERROR, error_code, line_num);
     /* We can't really halt because UART output is blocked, and we don't want to brick the device */
 }
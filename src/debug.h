@@ -49,9 +49,12 @@ void log_debug_write_string(char *msg);
 void log_debug_write_hex(uint32_t value);
 void log_debug_write_hex_char(uint8_t c);
 
-#define DEBUG_PRINTF(...)           log_debug_printf(__VA_ARGS__)
-#define DEBUG_PRINTF_DEBUG(...)     log_debug_printf(__VA_ARGS__)
-#define DEBUG_PRINTF_ERROR(...)     log_debug_printf(__VA_ARGS__)
+bool debug_output_active(void);
+
+// Neither the arguments nor the format are evaluated unless the output is going somewhere
+#define DEBUG_PRINTF(...)           do { if (debug_output_active()) log_debug_printf(__VA_ARGS__); } while (0)
+#define DEBUG_PRINTF_DEBUG(...)     do { if (debug_output_active()) log_debug_printf(__VA_ARGS__); } while (0)
+#define DEBUG_PRINTF_ERROR(...)     do { if (debug_output_active()) log_debug_printf(__VA_ARGS__); } while (0)
 
 #define DEBUG_STR(...)              log_debug_write_string_many(DBG_NUM_VA_ARGS(__VA_ARGS__), ##__VA_ARGS__)
 #define DEBUG_DEBUG(...)            log_debug_write_string_many(DBG_NUM_VA_ARGS(__VA_ARGS__), ##__VA_ARGS__)
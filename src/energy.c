@@ -0,0 +1,196 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Energy ledger, attributing battery consumption to the power rails that were on at the time
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "config.h"
+#include "custom_board.h"
+#include "timer.h"
+#include "energy.h"
+
+// Accumulators are in microamp-milliseconds, so that a day of a 100mA rail is nowhere near overflow
+#define UAMS_PER_MAH        (1000.0 * 60.0 * 60.0 * 1000.0)
+
+typedef struct {
+    uint64_t boot;
+    uint64_t today;
+    uint64_t fullday;
+    uint64_t oneshot_began;
+    uint64_t oneshot;
+    uint32_t transitions;
+    uint64_t on_since_ms;
+} energy_rail_t;
+
+static energy_rail_t rail[ENERGY_RAILS];
+static uint32_t rails_on = (1 << ENERGY_RAIL_BASE);
+static uint64_t last_update_ms = 0;
+static float scale = 1.0;
+static bool fOneshot = false;
+static uint64_t oneshot_began_ms = 0;
+static uint32_t oneshot_ms = 0;
+
+static const float rail_ma[ENERGY_RAILS] = {ENERGY_MA_BASE, ENERGY_MA_LORA, ENERGY_MA_CELL, ENERGY_MA_GPS,
+                                            ENERGY_MA_AIR, ENERGY_MA_GEIGER, ENERGY_MA_TWI, ENERGY_MA_ROCK};
+static const char *rail_names[ENERGY_RAILS] = {"base", "lora", "cell", "gps", "air", "geig", "twi", "rock"};
+
+// Map a power pin to the rail that it switches
+uint16_t energy_rail_of_pin(uint16_t pin) {
+#ifdef POWER_PIN_LORA
+    if (pin == POWER_PIN_LORA)
+        return ENERGY_RAIL_LORA;
+#endif
+#ifdef POWER_PIN_CELL
+    if (pin == POWER_PIN_CELL)
+        return ENERGY_RAIL_CELL;
+#endif
+#ifdef POWER_PIN_GPS
+    if (pin == POWER_PIN_GPS)
+        return ENERGY_RAIL_GPS;
+#endif
+#ifdef POWER_PIN_AIR
+    if (pin == POWER_PIN_AIR)
+        return ENERGY_RAIL_AIR;
+#endif
+#ifdef POWER_PIN_GEIGER
+    if (pin == POWER_PIN_GEIGER)
+        return ENERGY_RAIL_GEIGER;
+#endif
+#ifdef POWER_PIN_TWI
+    if (pin == POWER_PIN_TWI)
+        return ENERGY_RAIL_TWI;
+#endif
+#ifdef POWER_PIN_ROCK
+    if (pin == POWER_PIN_ROCK)
+        return ENERGY_RAIL_ROCK;
+#endif
+    return ENERGY_RAIL_BASE;
+}
+
+// Charge each rail that is on for the time since the last update
+void energy_update() {
+    int i;
+    uint64_t now = get_ms_since_boot();
+    uint32_t elapsed_ms = (last_update_ms == 0) ? 0 : (uint32_t) (now - last_update_ms);
+    last_update_ms = now;
+    for (i=0; i<ENERGY_RAILS; i++) {
+        if ((rails_on & (1 << i)) == 0)
+            continue;
+        uint64_t uams = (uint64_t) (rail_ma[i] * scale * 1000.0) * elapsed_ms;
+        rail[i].boot += uams;
+        rail[i].today += uams;
+    }
+}
+
+// Note a rail transition, which is called whenever a power pin is set
+void energy_rail_set(uint16_t pin, bool fOn) {
+    uint16_t r = energy_rail_of_pin(pin);
+    if (r == ENERGY_RAIL_BASE)
+        return;
+    if (((rails_on & (1 << r)) != 0) == fOn)
+        return;
+    energy_update();
+    rail[r].transitions++;
+    if (fOn) {
+        rails_on |= (1 << r);
+        rail[r].on_since_ms = last_update_ms;
+    } else
+        rails_on &= ~(1 << r);
+}
+
+// Calibrate the model against a single sample of the current drawn from the battery, taken
+// with the rails that are on right now, including those for cellular and the UART.  A sample
+// that isn't positive means that the battery is being charged, which masks the draw.
+void energy_measured(float mA) {
+    int i;
+    float modelled = 0.0, sample;
+    energy_update();
+    for (i=0; i<ENERGY_RAILS; i++)
+        if ((rails_on & (1 << i)) != 0)
+            modelled += rail_ma[i];
+    if (mA <= 0.0 || modelled <= 0.0)
+        return;
+    sample = mA / modelled;
+    if (sample < ENERGY_SCALE_MIN)
+        sample = ENERGY_SCALE_MIN;
+    if (sample > ENERGY_SCALE_MAX)
+        sample = ENERGY_SCALE_MAX;
+    scale = ((scale * (ENERGY_SCALE_WEIGHT-1)) + sample) / ENERGY_SCALE_WEIGHT;
+}
+
+// Roll the daily counters over
+void energy_day() {
+    int i;
+    energy_update();
+    for (i=0; i<ENERGY_RAILS; i++) {
+        rail[i].fullday = rail[i].today;
+        rail[i].today = 0;
+    }
+}
+
+// Begin accounting for a oneshot comms session
+void energy_oneshot_begin() {
+    int i;
+    if (fOneshot)
+        return;
+    energy_update();
+    for (i=0; i<ENERGY_RAILS; i++)
+        rail[i].oneshot_began = rail[i].boot;
+    oneshot_began_ms = last_update_ms;
+    fOneshot = true;
+}
+
+// Record what the oneshot comms session just completed has cost
+void energy_oneshot_end() {
+    int i;
+    if (!fOneshot)
+        return;
+    energy_update();
+    for (i=0; i<ENERGY_RAILS; i++)
+        rail[i].oneshot = rail[i].boot - rail[i].oneshot_began;
+    oneshot_ms = (uint32_t) (last_update_ms - oneshot_began_ms);
+    fOneshot = false;
+}
+
+// Display the ledger on the console
+void energy_show() {
+    int i;
+    energy_update();
+    DEBUG_PRINTF("mAh boot/today/fullday/oneshot (%lus), scale %.2f\n", oneshot_ms/1000, scale);
+    for (i=0; i<ENERGY_RAILS; i++) {
+        if (rail[i].boot == 0)
+            continue;
+        DEBUG_PRINTF("%s: %.2f/%.2f/%.2f/%.3f n=%lu\n", rail_names[i],
+                     rail[i].boot / UAMS_PER_MAH, rail[i].today / UAMS_PER_MAH,
+                     rail[i].fullday / UAMS_PER_MAH, rail[i].oneshot / UAMS_PER_MAH, rail[i].transitions);
+        if (i != ENERGY_RAIL_BASE && (rails_on & (1 << i)) != 0)
+            DEBUG_PRINTF("%s: on for %lus\n", rail_names[i], (uint32_t) ((last_update_ms - rail[i].on_since_ms) / 1000));
+    }
+}
+
+// Summarize the ledger as mAh per rail since boot, then today, then for the last oneshot
+void energy_summary(char *buffer, uint16_t length) {
+    int i, set;
+    char item[32];
+    static const char *set_names[] = {"b:", "|d:", "|o:"};
+
+    energy_update();
+    buffer[0] = '\0';
+    for (set=0; set<3; set++) {
+        bool fFirst = true;
+        for (i=0; i<ENERGY_RAILS; i++) {
+            uint64_t uams = (set == 0) ? rail[i].boot : ((set == 1) ? rail[i].today : rail[i].oneshot);
+            if (uams == 0)
+                continue;
+            sprintf(item, "%s%s%.2f", fFirst ? set_names[set] : ",", rail_names[i], uams / UAMS_PER_MAH);
+            if (strlen(buffer) + strlen(item) >= length)
+                return;
+            strlcat(buffer, item, length);
+            fFirst = false;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef ENERGY_H__
+#define ENERGY_H__
+
+// Rails whose consumption is accounted for.  The base rail is everything that isn't switched,
+// such as the MCU and bluetooth, and is always on.
+#define ENERGY_RAIL_BASE    0
+#define ENERGY_RAIL_LORA    1
+#define ENERGY_RAIL_CELL    2
+#define ENERGY_RAIL_GPS     3
+#define ENERGY_RAIL_AIR     4
+#define ENERGY_RAIL_GEIGER  5
+#define ENERGY_RAIL_TWI     6
+#define ENERGY_RAIL_ROCK    7
+#define ENERGY_RAILS        8
+
+#ifdef BOOTLOADERX
+#define energy_rail_set(pin, fOn)
+#else
+void energy_rail_set(uint16_t pin, bool fOn);
+void energy_measured(float mA);
+void energy_update(void);
+void energy_day(void);
+void energy_oneshot_begin(void);
+void energy_oneshot_end(void);
+void energy_show(void);
+void energy_summary(char *buffer, uint16_t length);
+#endif
+
+#endif // ENERGY_H__
@@ -0,0 +1,228 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Binary event log, accumulated in RAM and appended a chunk at a time to a ring of flash pages
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "nrf_soc.h"
+#include "app_util_platform.h"
+#include "debug.h"
+#include "config.h"
+#include "timer.h"
+#include "storage.h"
+#include "misc.h"
+#include "evlog.h"
+
+// The chunk being accumulated, whose header is only filled in when it is flushed
+static uint32_t evlog_chunk[EVLOG_CHUNK_WORDS];
+static uint16_t evlog_used = 0;
+static uint32_t evlog_last_ms = 0;
+static uint32_t evlog_dropped = 0;
+
+// Upload in progress, from the page being sent through the page that was newest when requested
+static uint32_t evlog_upload_seq = 0;
+static uint32_t evlog_upload_last_seq = 0;
+static uint16_t evlog_upload_offset = 0;
+static uint16_t evlog_upload_sending = 0;
+
+// Log an event.  This only encodes into RAM, and so is cheap enough to be called from anywhere.
+void evlog(uint16_t id, uint16_t args, uint32_t a, uint32_t b, uint32_t c) {
+    uint8_t event[5*5];
+    uint8_t *data = (uint8_t *) &evlog_chunk[EVLOG_CHUNK_HEADER];
+    uint32_t now = (uint32_t) get_ms_since_boot();
+    uint32_t elapsed;
+    uint16_t len;
+
+    CRITICAL_REGION_ENTER();
+    if (evlog_used == 0) {
+        evlog_chunk[EVLOG_CHUNK_MS] = now;
+        evlog_last_ms = now;
+    }
+    elapsed = now - evlog_last_ms;
+    if (elapsed > 0x3fffffff)
+        elapsed = 0x3fffffff;
+    len = VarintEncode(event, id);
+    len += VarintEncode(&event[len], (elapsed << 2) | args);
+    if (args > 0)
+        len += VarintEncode(&event[len], a);
+    if (args > 1)
+        len += VarintEncode(&event[len], b);
+    if (args > 2)
+        len += VarintEncode(&event[len], c);
+    if ((evlog_used + len) > EVLOG_CHUNK_BYTES)
+        evlog_dropped++;
+    else {
+        memcpy(&data[evlog_used], event, len);
+        evlog_used += len;
+        evlog_last_ms = now;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+// Note the boot, and why it happened
+void evlog_init() {
+    uint32_t reason = 0;
+    sd_power_reset_reason_get(&reason);
+    sd_power_reset_reason_clr(reason);
+    evlog1(EV_BOOT, reason);
+}
+
+// Append what has accumulated to the log in flash, if it can take it right now
+void evlog_flush() {
+    uint32_t chunk[EVLOG_CHUNK_WORDS];
+    uint16_t words;
+    uint32_t dropped;
+
+    if (evlog_used == 0 || !storage_evlog_ready())
+        return;
+
+    CRITICAL_REGION_ENTER();
+    words = EVLOG_CHUNK_HEADER + ((evlog_used + PHY_WORD_SIZE - 1) / PHY_WORD_SIZE);
+    evlog_chunk[EVLOG_CHUNK_LENGTH] = evlog_used;
+    memset((uint8_t *) &evlog_chunk[EVLOG_CHUNK_HEADER] + evlog_used, 0xff, (words * PHY_WORD_SIZE) - (EVLOG_CHUNK_HEADER * PHY_WORD_SIZE) - evlog_used);
+    memcpy(chunk, evlog_chunk, words * PHY_WORD_SIZE);
+    evlog_used = 0;
+    dropped = evlog_dropped;
+    evlog_dropped = 0;
+    CRITICAL_REGION_EXIT();
+
+    storage_evlog_put(chunk, words);
+    if (dropped != 0)
+        evlog1(EV_DROPPED, dropped);
+}
+
+// See if there are events that have not yet been handed to flash
+bool evlog_pending() {
+    return (evlog_used != 0);
+}
+
+// Flush when the chunk is nearly full, or when its oldest event has been held long enough
+void evlog_checkpoint() {
+    if (evlog_used == 0)
+        return;
+    if (evlog_used < ((EVLOG_CHUNK_BYTES * 3) / 4)
+        && ((uint32_t) get_ms_since_boot() - evlog_chunk[EVLOG_CHUNK_MS]) < (EVLOG_FLUSH_MINUTES * 60 * 1000L))
+        return;
+    evlog_flush();
+}
+
+// Decode the events of a chunk onto the console
+void evlog_show_chunk(uint32_t seq, const uint32_t *chunk) {
+    uint8_t *data = (uint8_t *) &chunk[EVLOG_CHUNK_HEADER];
+    uint16_t length = chunk[EVLOG_CHUNK_LENGTH] > EVLOG_CHUNK_BYTES ? EVLOG_CHUNK_BYTES : chunk[EVLOG_CHUNK_LENGTH];
+    uint32_t ms = chunk[EVLOG_CHUNK_MS];
+    uint16_t used = 0;
+    while (used < length) {
+        uint32_t id, timing, arg[3] = {0, 0, 0};
+        uint16_t i, len;
+        len = VarintDecode(&data[used], length - used, &id);
+        if (len == 0)
+            return;
+        used += len;
+        len = VarintDecode(&data[used], length - used, &timing);
+        if (len == 0)
+            return;
+        used += len;
+        for (i=0; i<(timing & 3); i++) {
+            len = VarintDecode(&data[used], length - used, &arg[i]);
+            if (len == 0)
+                return;
+            used += len;
+        }
+        ms += timing >> 2;
+        DEBUG_PRINTF("%lu %lu.%03lus ev%lu %lu %lu %lu\n", seq, ms / 1000, ms % 1000, id, arg[0], arg[1], arg[2]);
+    }
+}
+
+// Display the newest pages of the log, followed by what hasn't yet been flushed
+void evlog_show(uint16_t pages) {
+    uint32_t seq, newest = storage_evlog_seq();
+    if (pages == 0)
+        pages = 1;
+    if (pages > EVLOG_PAGES)
+        pages = EVLOG_PAGES;
+    for (seq = (newest >= pages) ? newest - pages + 1 : 1; newest != 0 && seq <= newest; seq++) {
+        const uint32_t *page = storage_evlog_page(seq);
+        if (page == NULL)
+            continue;
+        uint16_t used = storage_evlog_page_used(page);
+        uint16_t offset = EVLOG_PAGE_FIRST;
+        while (offset < used) {
+            evlog_show_chunk(seq, &page[offset]);
+            offset += EVLOG_CHUNK_HEADER + ((page[offset+EVLOG_CHUNK_LENGTH] + PHY_WORD_SIZE - 1) / PHY_WORD_SIZE);
+        }
+    }
+    if (evlog_used != 0) {
+        evlog_chunk[EVLOG_CHUNK_LENGTH] = evlog_used;
+        evlog_show_chunk(0, evlog_chunk);
+    }
+    if (evlog_dropped != 0)
+        DEBUG_PRINTF("%lu events dropped\n", evlog_dropped);
+}
+
+// Begin uploading the newest pages of the log to the service
+void evlog_upload_request(uint16_t pages) {
+    evlog_flush();
+    evlog_upload_last_seq = storage_evlog_seq();
+    if (evlog_upload_last_seq == 0)
+        return;
+    if (pages == 0)
+        pages = 1;
+    if (pages > EVLOG_PAGES)
+        pages = EVLOG_PAGES;
+    evlog_upload_seq = (evlog_upload_last_seq >= pages) ? evlog_upload_last_seq - pages + 1 : 1;
+    evlog_upload_offset = 0;
+}
+
+// See if there's an upload in progress
+bool evlog_upload_pending() {
+    return (evlog_upload_seq != 0);
+}
+
+// Get the next segment to upload, returning its length or 0 if the upload is complete.
+// A NULL buffer just determines whether there is anything left.
+uint16_t evlog_get_upload(uint8_t *buffer, uint16_t length) {
+    const uint32_t *page = NULL;
+    uint16_t used = 0, words;
+
+    // Skip whatever has been sent, along with pages that have been erased since the request
+    evlog_upload_sending = 0;
+    while (evlog_upload_seq != 0) {
+        page = storage_evlog_page(evlog_upload_seq);
+        if (page != NULL) {
+            used = storage_evlog_page_used(page);
+            if (evlog_upload_offset < used)
+                break;
+        }
+        evlog_upload_seq = (evlog_upload_seq == evlog_upload_last_seq) ? 0 : evlog_upload_seq + 1;
+        evlog_upload_offset = 0;
+    }
+    if (evlog_upload_seq == 0)
+        return 0;
+    if (buffer == NULL)
+        return used - evlog_upload_offset;
+    if (length < EVLOG_UPLOAD_HEADER + PHY_WORD_SIZE)
+        return 0;
+
+    words = (length - EVLOG_UPLOAD_HEADER) / PHY_WORD_SIZE;
+    if (words > used - evlog_upload_offset)
+        words = used - evlog_upload_offset;
+    buffer[0] = (uint8_t) evlog_upload_seq;
+    buffer[1] = (uint8_t) (evlog_upload_seq >> 8);
+    buffer[2] = (uint8_t) (evlog_upload_seq >> 16);
+    buffer[3] = (uint8_t) (evlog_upload_seq >> 24);
+    buffer[4] = (uint8_t) evlog_upload_offset;
+    buffer[5] = (uint8_t) (evlog_upload_offset >> 8);
+    memcpy(&buffer[EVLOG_UPLOAD_HEADER], &page[evlog_upload_offset], words * PHY_WORD_SIZE);
+    evlog_upload_sending = words;
+    return EVLOG_UPLOAD_HEADER + (words * PHY_WORD_SIZE);
+}
+
+// Move past the segment most recently gotten, once it's been sent
+void evlog_upload_sent() {
+    evlog_upload_offset += evlog_upload_sending;
+    evlog_upload_sending = 0;
+}
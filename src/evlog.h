@@ -0,0 +1,49 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef EVLOG_H__
+#define EVLOG_H__
+
+// Binary event log, kept in flash for post-mortem debugging.  Each event is a varint event id,
+// then a varint of the ms since the previous event in its chunk shifted left by two with the
+// number of arguments in the low two bits, then up to three varint arguments.  See storage.h for
+// how chunks are laid out in flash.  The format strings here are only for decoding off-device.
+#define EV_BOOT             1   // "boot, reset reason 0x%x"
+#define EV_RESTART          2   // "restart requested"
+#define EV_CLOCK            3   // "clock set to %06d %06d" (ddmmyy, hhmmss)
+#define EV_COMM_SELECT      4   // "comm select %d"
+#define EV_CONNECT_FAILED   5   // "connect failed in state %d"
+#define EV_SEND             6   // "send type %d of %d bytes, %d" (1 sent, 2 buffered, 3 over MTU)
+#define EV_FLASH_ERROR      7   // "flash job %d error 0x%x"
+#define EV_ERROR            8   // "error 0x%x at line %d"
+#define EV_OVERCURRENT      9   // "overcurrent"
+#define EV_DROPPED          10  // "%d events dropped"
+
+// Uploads of the log carry a segment of a page at a time, as a 4-byte little-endian page
+// sequence number, a 2-byte little-endian word offset within the page, and then the words.
+#define EVLOG_UPLOAD_HEADER 6
+
+#ifdef BOOTLOADERX
+#define evlog0(id)
+#define evlog1(id, a)
+#define evlog2(id, a, b)
+#define evlog3(id, a, b, c)
+#else
+void evlog(uint16_t id, uint16_t args, uint32_t a, uint32_t b, uint32_t c);
+#define evlog0(id)          evlog(id, 0, 0, 0, 0)
+#define evlog1(id, a)       evlog(id, 1, a, 0, 0)
+#define evlog2(id, a, b)    evlog(id, 2, a, b, 0)
+#define evlog3(id, a, b, c) evlog(id, 3, a, b, c)
+void evlog_init(void);
+void evlog_flush(void);
+bool evlog_pending(void);
+void evlog_checkpoint(void);
+void evlog_show(uint16_t pages);
+void evlog_upload_request(uint16_t pages);
+bool evlog_upload_pending(void);
+uint16_t evlog_get_upload(uint8_t *buffer, uint16_t length);
+void evlog_upload_sent(void);
+#endif
+
+#endif // EVLOG_H__
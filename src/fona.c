@@ -31,10 +31,24 @@
 #include "custom_board.h"
 #include "pb_encode.h"
 #include "pb_decode.h"
+#include "prof.h"
 
 // Use TCP instead of HTTP for confirmed transactions
 #define USETCP true
 
+// Keep the TCP session open so that all sends within a oneshot share one open/close
+#define REUSETCP true
+
+// The service drops sessions that have been idle for a while, so don't bother reusing them after this
+#define REUSETCP_IDLE_SECONDS   30
+
+// How long to wait for the modem to confirm that a session has closed before giving up on it
+#define CLOSETCP_SECONDS        10
+
+// Offer the service binary HTTP bodies, switching to them once it has replied in binary.
+// TCP and UDP always carry binary, which the modem hands to us as hex.
+#define HTTPBINARY true
+
 // Hard-wired file names
 #define DFU_INFO_PACKET "dfu.dat"
 #define DFU_FIRMWARE    "dfu.bin"
@@ -97,6 +111,7 @@
 #define COMM_FONA_CIPTIMEOUTRPL         COMM_STATE_DEVICE_START+54
 #define COMM_FONA_CIPSENDRPL            COMM_STATE_DEVICE_START+55
 #define COMM_FONA_CIPCLOSERPL           COMM_STATE_DEVICE_START+56
+#define COMM_FONA_CIPCLOSERPL2          COMM_STATE_DEVICE_START+57
 
 // Command buffer
 static cmdbuf_t fromFona;
@@ -110,9 +125,36 @@ static uint8_t deferred_iobuf[FONA_MTU+256];
 static uint16_t deferred_iobuf_length;
 static uint16_t deferred_request_type;
 static uint32_t deferred_active = 0;
+static uint64_t deferred_active_ms = 0;
+static uint64_t send_started_ms = 0;
 static bool deferred_done_after_callback = false;
 static bool deferred_callback_requested = false;
 
+// Whether what was received into the deferred iobuf is binary, which is known from the
+// transport it came in on or, for HTTP, from what the service says in its reply header
+static bool deferred_iobuf_binary = false;
+
+// HTTP header that is streamed ahead of the deferred iobuf, and binary receive state
+#if !USETCP
+static char http_header[200];
+static uint16_t http_header_length = 0;
+static bool http_body_hex = false;
+static bool http_service_binary = false;
+static bool http_recv_armed = false;
+static uint16_t http_recv_matched;
+static uint16_t http_recv_chunk_length;
+static uint16_t http_recv_remaining;
+#endif
+
+// Per-upload session accounting.  Bytes billed are estimated by adding
+// the IP/UDP/TCP framing that the carrier sees to what we actually sent.
+#define FONA_UDP_OVERHEAD_BYTES     28      // IPv4 + UDP headers
+#define FONA_TCP_OVERHEAD_BYTES     40      // IPv4 + TCP headers, per segment
+#define FONA_TCP_SESSION_SEGMENTS   7       // SYN, SYN-ACK, ACK, and the FIN/ACK pairs on close
+static uint32_t session_began = 0L;
+static uint16_t session_commands;
+static uint32_t session_billed_bytes;
+
 // APN
 static char apn[64] = "";
 
@@ -123,6 +165,14 @@ static char service_tcp_ipv4[32] = "";
 
 // IP
 static uint16_t ip_open_retries;
+static bool tcp_session_open = false;
+static uint32_t tcp_session_last_used = 0L;
+static uint32_t tcp_session_closing = 0L;
+static bool tcp_session_reopen = false;
+
+// True when a sequenced UDP batch has been sent and its ack will arrive on the UDP link
+static bool awaiting_udp_ack = false;
+static bool tcp_session_reused = false;
 
 // GPS context
 #ifdef FONAGPS
@@ -165,6 +215,28 @@ uint16_t fona_get_mtu() {
     return FONA_MTU;
 }
 
+// Begin accounting for an upload session
+void fona_session_begin(uint32_t billed_bytes) {
+    session_began = get_seconds_since_boot();
+    session_commands = 0;
+    session_billed_bytes = billed_bytes;
+}
+
+// Complete accounting for an upload session, whether or not it succeeded
+void fona_session_end() {
+    if (session_began == 0)
+        return;
+    uint32_t now = get_seconds_since_boot();
+    uint32_t seconds = (now >= session_began) ? (now - session_began) : 0;
+    stats()->fona_sessions++;
+    stats()->fona_session_seconds += seconds;
+    stats()->fona_session_commands += session_commands;
+    stats()->fona_billed_bytes += session_billed_bytes;
+    if (debug(DBG_COMM_MAX))
+        DEBUG_PRINTF("CELL session: %lus %d cmds %lu bytes\n", seconds, session_commands, session_billed_bytes);
+    session_began = 0L;
+}
+
 // Transmit the command to the cellular modem
 void fona_send(char *msg) {
 
@@ -178,6 +250,10 @@ void fona_send(char *msg) {
     if (debug(DBG_TX))
         DEBUG_PRINTF("> %s\n", msg);
 
+    // Account for round trips made on behalf of an upload
+    if (session_began != 0)
+        session_commands++;
+
     // Send it
     while (*msg != '\0')
         serial_send_byte(*msg++);
@@ -227,6 +303,18 @@ void processstateF(uint16_t newstate) {
     fona_process();
 }
 
+// Read data that has arrived on a link, in hex
+void fona_receive(int link, int len) {
+    char command[64];
+    if (len > CMD_MAX_LINELENGTH)
+        len = CMD_MAX_LINELENGTH;
+    deferred_iobuf_length = 0;
+    deferred_iobuf_binary = false;
+    sprintf(command, "at+ciprxget=3,%d,%d", link, len);
+    fona_send(command);
+    setstateF(COMM_FONA_CIPRXGETRPL2);
+}
+
 // Check to see if we received what we regard as a bad reply universally
 bool commonreplyF() {
 
@@ -256,18 +344,32 @@ bool commonreplyF() {
         return(true);
     }
 
-    // Process incoming TCP/IP data
+    // The modem confirms each cipsend once its data has gone out, completing the send's round trip
+    if (thisargisF("+cipsend:")) {
+        if (send_started_ms != 0)
+            comm_latency_record(COMM_PHASE_SEND, (uint32_t) (get_ms_since_boot() - send_started_ms));
+        send_started_ms = 0;
+        return(true);
+    }
+
+    // Process incoming TCP/IP data, which the modem tells us is waiting on a specific link.
+    // Link 0 is UDP and link 1 is TCP, and both can be open at once when a sequenced batch
+    // is awaiting its ack while the TCP session is being kept open.
+    if (thisargisF("+ciprxget: 1")) {
+        nextargF();
+        thisargisF("*");
+        int link = atoi(nextargF());
+        fona_receive(link, CMD_MAX_LINELENGTH);
+        return(true);
+    }
+
+    // Older firmware announces the length but not the link, so read from whichever one we're
+    // awaiting a reply on.  A TTSERVE reply only ever arrives on the TCP link.
     if (thisargisF("+ipd*")) {
-        char command[64];
         nextargF();
         thisargisF("*");
         int len = atoi(nextargF());
-        if (len > CMD_MAX_LINELENGTH)
-            len = CMD_MAX_LINELENGTH;;
-        deferred_iobuf_length = 0;
-        sprintf(command, "at+ciprxget=3,1,%d", len);
-        fona_send(command);
-        setstateF(COMM_FONA_CIPRXGETRPL2);
+        fona_receive((awaiting_udp_ack && !awaitingTTServeReply) ? 0 : 1, len);
         return(true);
     }
 
@@ -424,6 +526,17 @@ bool fona_can_send_to_service() {
     return(fonaInitCompleted);
 }
 
+// See if the module is between transactions, with no reply, ack or TCP session outstanding
+bool fona_uart_idle() {
+    return (fromFona.state == COMM_STATE_IDLE && deferred_active == 0 && !awaitingTTServeReply
+            && !awaiting_udp_ack && !tcp_session_open);
+}
+
+// Discard anything partially received before the UART was lent out, so we resync on the next line
+void fona_uart_resync() {
+    comm_cmdbuf_reset(&fromFona);
+}
+
 // Return true if transmitting would be pointless
 bool fona_is_busy() {
 
@@ -479,6 +592,68 @@ bool fona_is_busy() {
     return false;
 }
 
+// Open the TCP session to the service
+#if USETCP
+void fona_tcp_open() {
+    char command[64];
+    ip_open_retries = 8;
+    tcp_session_open = false;
+    tcp_session_reused = false;
+    comm_set_connect_state(CONNECT_STATE_APP_SERVICE);
+    sprintf(command, "at+cipopen=1,\"TCP\",\"%s\",%u", service_tcp_ipv4, SERVICE_TCP_PORT);
+    fona_send(command);
+    setstateF(COMM_FONA_CIPOPENRPL2);
+}
+#endif // USETCP
+
+// Close the TCP session, optionally opening a fresh one once it has closed
+#if USETCP
+void fona_tcp_close(bool fReopen) {
+    tcp_session_open = false;
+    tcp_session_reopen = fReopen;
+    tcp_session_closing = get_seconds_since_boot();
+    fona_send("at+cipclose=1");
+    setstateF(COMM_FONA_CIPCLOSERPL2);
+}
+#endif // USETCP
+
+// Carry on once the TCP session has closed, or once we've given up waiting for it to
+#if USETCP
+void fona_tcp_closed() {
+    tcp_session_closing = 0;
+    if (tcp_session_reopen)
+        fona_tcp_open();
+    else
+        setidlestateF();
+}
+#endif // USETCP
+
+// Close any TCP session left open, returning true if we need to wait for the close to complete
+bool fona_close_session() {
+#if USETCP
+    if (tcp_session_open && fromFona.state == COMM_STATE_IDLE && deferred_active == 0) {
+        fona_tcp_close(false);
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Send the deferred iobuf on the open TCP session
+#if USETCP
+void fona_tcp_start_send() {
+    char command[64];
+    // Our deferred handler will finish this command
+    deferred_callback_requested = true;
+    deferred_done_after_callback = true;
+    watchdog_extend = true;
+    sprintf(command, "at+cipsend=1,%u", deferred_iobuf_length);
+    send_started_ms = get_ms_since_boot();
+    fona_send(command);
+    setstateF(COMM_FONA_CIPSENDRPL);
+}
+#endif // USETCP
+
 // Transmit a well-formed protocol buffer to the LPWAN as a message
 bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType) {
     char command[64];
@@ -504,6 +679,7 @@ bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
 
     // Set up the deferred data
     deferred_active = get_seconds_since_boot();
+    deferred_active_ms = get_ms_since_boot();
     deferred_iobuf_length = length;
     memcpy(deferred_iobuf, buffer, length);
     deferred_request_type = RequestType;
@@ -517,11 +693,15 @@ bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
 
         // Bump stats about what we've transmitted
         stats_io(length, 0);
+        fona_session_begin(length + FONA_UDP_OVERHEAD_BYTES);
+        if (buffer[0] == BUFF_FORMAT_PB_ARRAY_SEQ)
+            awaiting_udp_ack = true;
 
         // Transmit it, expecting the deferred handler to finish this.
         deferred_callback_requested = true;
         deferred_done_after_callback = true;
         sprintf(command, "at+cipsend=0,%u,\"%s\",%u", deferred_iobuf_length, service_udp_ipv4, SERVICE_UDP_PORT);
+        send_started_ms = get_ms_since_boot();
         fona_send(command);
         setstateF(COMM_FONA_MISCRPL);
 
@@ -536,12 +716,25 @@ bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
         // Bump stats about what we've transmitted
         stats_io(length, 0);
 
+        // If the session from a previous send is still open, just send on it
+        tcp_session_reused = tcp_session_open && WouldSuppress(&tcp_session_last_used, REUSETCP_IDLE_SECONDS);
+        if (tcp_session_reused) {
+            fona_session_begin(length + (2 * FONA_TCP_OVERHEAD_BYTES));
+            fona_tcp_start_send();
+            return true;
+        }
+
+        // If it has sat idle for long enough that the service has likely dropped it, replace it
+        if (tcp_session_open) {
+            DEBUG_PRINTF("TCP session idle, reopening\n");
+            fona_session_begin(length + ((FONA_TCP_SESSION_SEGMENTS + 2) * FONA_TCP_OVERHEAD_BYTES));
+            fona_tcp_close(true);
+            return true;
+        }
+
         // Transmit it, after which the "cipsend" will process the deferred iobuf
-        ip_open_retries = 8;
-        comm_set_connect_state(CONNECT_STATE_APP_SERVICE);
-        sprintf(command, "at+cipopen=1,\"TCP\",\"%s\",%u", service_tcp_ipv4, SERVICE_TCP_PORT);
-        fona_send(command);
-        setstateF(COMM_FONA_CIPOPENRPL2);
+        fona_session_begin(length + ((FONA_TCP_SESSION_SEGMENTS + 2) * FONA_TCP_OVERHEAD_BYTES));
+        fona_tcp_open();
 
 #else
 
@@ -549,6 +742,9 @@ bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
         DEBUG_PRINTF("HTTP send: %d\n", length);
 #endif
 
+        // The HTTP header and body are added when the session is open
+        fona_session_begin((FONA_TCP_SESSION_SEGMENTS + 2) * FONA_TCP_OVERHEAD_BYTES);
+
         // Transmit it, expecting to receive a callback at fona_http_start_send() after
         // the session is open.
         sprintf(command, "at+chttpsopse=\"%s\",%u,1", SERVICE_HTTP_ADDRESS, SERVICE_HTTP_PORT);
@@ -563,45 +759,32 @@ bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
     return true;
 }
 
-// Initiate the HTTP send now that the session is open.
-// Note that this REPLACES the contents of deferred_iobuf with a hexified version of same.
+// Initiate the HTTP send now that the session is open.  The header is streamed
+// ahead of the body by fona_process_deferred(), so no intermediate body buffer is needed.
 #if !USETCP
 void fona_http_start_send() {
     char command[64];
-    char hiChar, loChar, body[sizeof(deferred_iobuf)*2+50+1];
-    uint16_t i, header_length, hexified_length, total_length;
-
-    // The hexified data length will be the original data * 2 (because of hexification)
-    hexified_length = deferred_iobuf_length * 2;
-
-    // Put together a minimalist HTTP header and command to transmit it
-    sprintf(body, "POST %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: TTNODE\r\nContent-Length: %d\r\n\r\n",
-            SERVICE_HTTP_TOPIC, SERVICE_HTTP_ADDRESS, SERVICE_HTTP_PORT, hexified_length);
+    uint16_t body_length;
 
-    // Compute the remaining lengths
-    header_length = strlen(body);
+    // Until the service has said that it understands binary, the body is hexified as it is sent
+    http_body_hex = !http_service_binary;
+    body_length = http_body_hex ? (deferred_iobuf_length * 2) : deferred_iobuf_length;
 
-    // Hexify into the body, and add trailing \r\n, and a null term which is useful for %s printing when debugging
-    total_length = header_length;
-    for (i=0; i<deferred_iobuf_length; i++) {
-        if ( (i + header_length) >= (sizeof(deferred_iobuf) - sizeof("00\r\n")) )
-            break;
-        HexChars(deferred_iobuf[i], &hiChar, &loChar);
-        body[total_length++] = hiChar;
-        body[total_length++] = loChar;
-    }
-    body[total_length] = '\0';
+    // Put together a minimalist HTTP header, offering the service the binary format
+    sprintf(http_header, "POST %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: TTNODE\r\n%s%sContent-Length: %d\r\n\r\n",
+            SERVICE_HTTP_TOPIC, SERVICE_HTTP_ADDRESS, SERVICE_HTTP_PORT,
+            HTTPBINARY ? "Accept: application/octet-stream\r\n" : "",
+            http_body_hex ? "" : "Content-Type: application/octet-stream\r\n",
+            body_length);
+    http_header_length = strlen(http_header);
 
     // Bump stats about what we've transmitted
-    stats_io(total_length, 0);
-
-    // Move it back into the iobuf
-    deferred_iobuf_length = total_length;
-    memcpy(deferred_iobuf, body, deferred_iobuf_length);
+    stats_io(http_header_length + body_length, 0);
+    session_billed_bytes += http_header_length + body_length;
 
     // Generate a command
     deferred_callback_requested = true;
-    sprintf(command, "at+chttpssend=%u", deferred_iobuf_length);
+    sprintf(command, "at+chttpssend=%u", http_header_length + body_length);
     fona_send(command);
 
 }
@@ -612,11 +795,113 @@ void fona_http_start_send() {
 void fona_http_start_receive() {
     char command[64];
     deferred_iobuf_length = 0;
+    deferred_iobuf_binary = false;
+    http_recv_armed = HTTPBINARY;
+    http_recv_matched = 0;
+    http_recv_remaining = 0;
     sprintf(command, "at+chttpsrecv=%u", sizeof(deferred_iobuf));
     fona_send(command);
 }
 #endif // !USETCP
 
+// Watch the modem's output for the line that precedes each chunk of received HTTP
+// data, and capture that chunk as raw binary.  This is done as bytes arrive because
+// the data may contain anything, including line terminators.  Returns true if the
+// byte was consumed as data.
+#if !USETCP
+bool fona_http_received_byte(uint8_t databyte) {
+    static const char prefix[] = "+chttpsrecv: data,";
+    char ch = (char) databyte;
+
+    // Capture data
+    if (http_recv_remaining != 0) {
+        if (deferred_iobuf_length < sizeof(deferred_iobuf))
+            deferred_iobuf[deferred_iobuf_length++] = databyte;
+        http_recv_remaining--;
+        return true;
+    }
+
+    // Match the prefix
+    if (http_recv_matched < (sizeof(prefix) - 1)) {
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        if (ch == prefix[http_recv_matched]) {
+            http_recv_matched++;
+            http_recv_chunk_length = 0;
+        } else
+            http_recv_matched = (ch == prefix[0]) ? 1 : 0;
+        return false;
+    }
+
+    // Parse the chunk length, with data beginning after the end of the line
+    if (ch >= '0' && ch <= '9')
+        http_recv_chunk_length = (http_recv_chunk_length * 10) + (ch - '0');
+    else if (ch == '\n') {
+        http_recv_remaining = http_recv_chunk_length;
+        http_recv_matched = 0;
+    }
+    return false;
+
+}
+#endif // !USETCP
+
+// See if a line of the HTTP response header that was received in binary begins with the
+// specified lowercase text
+#if !USETCP
+bool fona_http_header_has(uint16_t header_length, const char *text) {
+    uint16_t i, j;
+    for (i=0; i<header_length; i++) {
+        if (i != 0 && deferred_iobuf[i-1] != '\n')
+            continue;
+        for (j=0; text[j] != '\0' && (i+j) < header_length; j++) {
+            char ch = (char) deferred_iobuf[i+j];
+            if (ch >= 'A' && ch <= 'Z')
+                ch += 'a' - 'A';
+            if (ch != text[j])
+                break;
+        }
+        if (text[j] == '\0')
+            return true;
+    }
+    return false;
+}
+#endif // !USETCP
+
+// Remove the HTTP response header from what was received in binary, leaving just the body,
+// and learn from the header whether the service replied in binary.  If it did, it can also
+// accept binary, so we switch to sending it that way.
+#if !USETCP
+void fona_http_strip_header() {
+    int i;
+    http_recv_armed = false;
+    if (!HTTPBINARY)
+        return;
+    for (i=0; i+3<deferred_iobuf_length; i++)
+        if (memcmp(&deferred_iobuf[i], "\r\n\r\n", 4) == 0) {
+            deferred_iobuf_binary = fona_http_header_has(i, "content-type: application/octet-stream");
+            if (deferred_iobuf_binary && !http_service_binary) {
+                DEBUG_PRINTF("Service accepts binary HTTP\n");
+                http_service_binary = true;
+            }
+            deferred_iobuf_length -= (i + 4);
+            memmove(deferred_iobuf, &deferred_iobuf[i+4], deferred_iobuf_length);
+            return;
+        }
+}
+#endif // !USETCP
+
+// The modem hands us what the service sent on a socket as hex, so convert it back in place
+#if USETCP
+void fona_tcp_received_binary() {
+    uint16_t i;
+    for (i=0; (i*2)+1 < deferred_iobuf_length; i++)
+        if (!HexValue((char) deferred_iobuf[i*2], (char) deferred_iobuf[(i*2)+1], &deferred_iobuf[i]))
+            break;
+    deferred_iobuf_length = i;
+    deferred_iobuf_binary = true;
+}
+#endif // USETCP
+
 // Append the stuff received IF AND ONLY IF it looks like hexadecimal data
 void fona_append_received_hex_data(char *buffer, uint16_t buffer_length) {
     char hiChar, loChar;
@@ -670,8 +955,27 @@ void fona_process_received() {
         // Bump stats about what we've received on the wire
         stats_io(0, deferred_iobuf_length);
 
-        // Decode the message
-        msgtype = comm_decode_received_message((char *)deferred_iobuf, NULL, buffer, sizeof(buffer) - 1, NULL);
+        // Record the round trip, and the end of the send phase of the connection
+        if (deferred_active != 0)
+            comm_latency_record(COMM_PHASE_REPLY, (uint32_t) (get_ms_since_boot() - deferred_active_ms));
+        comm_set_connect_state(CONNECT_STATE_FONA_ACTIVE);
+
+        // Process acks for sequenced batches, which come back via UDP
+        if (deferred_iobuf_binary && deferred_iobuf[0] == BUFF_FORMAT_ACK) {
+            session_billed_bytes += deferred_iobuf_length + FONA_UDP_OVERHEAD_BYTES;
+            awaiting_udp_ack = false;
+            comm_ack_received(deferred_iobuf, deferred_iobuf_length);
+            deferred_active = 0;
+            comm_oneshot_completed();
+            return;
+        }
+        session_billed_bytes += deferred_iobuf_length + (2 * FONA_TCP_OVERHEAD_BYTES);
+
+        // Decode the message in whichever encoding the service used
+        if (deferred_iobuf_binary)
+            msgtype = comm_decode_received_binary_message(deferred_iobuf, deferred_iobuf_length, NULL, buffer, sizeof(buffer) - 1);
+        else
+            msgtype = comm_decode_received_message((char *)deferred_iobuf, NULL, buffer, sizeof(buffer) - 1, NULL);
         if (msgtype != MSG_REPLY_TTSERVE) {
             // This can happen if we get an HTTP error in the body
             deferred_iobuf[deferred_iobuf_length] = '\0';
@@ -699,6 +1003,21 @@ void fona_process_deferred() {
     if (gpio_current_uart() != UART_FONA)
         return;
 
+    // Stream the HTTP header, if any, ahead of the body
+#if !USETCP
+    for (i=0; i<http_header_length; i++)
+        serial_send_byte(http_header[i]);
+    http_header_length = 0;
+    if (http_body_hex) {
+        char hiChar, loChar;
+        for (i=0; i<deferred_iobuf_length; i++) {
+            HexChars(deferred_iobuf[i], &hiChar, &loChar);
+            serial_send_byte(hiChar);
+            serial_send_byte(loChar);
+        }
+        http_body_hex = false;
+    } else
+#endif
     // Transmit deferred stuff
     for (i=0; i<deferred_iobuf_length; i++)
         serial_send_byte(deferred_iobuf[i]);
@@ -745,6 +1064,14 @@ bool fona_needed_to_be_reset() {
     }
 #endif
 
+#if USETCP
+    // Don't wait forever for the modem to confirm that a session has closed
+    if (fromFona.state == COMM_FONA_CIPCLOSERPL2 && !WouldSuppress(&tcp_session_closing, CLOSETCP_SECONDS)) {
+        DEBUG_PRINTF("TCP close not confirmed\n");
+        fona_tcp_closed();
+    }
+#endif
+
     // Check to see if the Fona card is simply missing or powered off
     if (fona_received_since_powerup == 0 && secondsSinceBoot > BOOT_DELAY_UNTIL_INIT) {
         if (!fonaLock && !fonaInitCompleted && fonaInitInProgress ) {
@@ -852,6 +1179,11 @@ void fona_reset(bool force) {
 // Request state for debugging
 void fona_request_state() {
     DEBUG_PRINTF("Fona %s: st=%d cc=%d b=%d,%d,%d '%s'\n", comm_is_deselected() ? "disconnected" : "connected", fromFona.state, fromFona.complete, fromFona.busy_length, fromFona.busy_nextput, fromFona.busy_nextget, fromFona.buffer);
+    uint32_t sessions = stats()->fona_sessions;
+    if (sessions != 0)
+        DEBUG_PRINTF("Fona sessions:%lu avg %lus %lu cmds %lu bytes\n", sessions, stats()->fona_session_seconds / sessions, stats()->fona_session_commands / sessions, stats()->fona_billed_bytes / sessions);
+    if (stats()->acked_batches != 0 || stats()->acked_retransmits != 0)
+        DEBUG_PRINTF("Fona acked:%lu retransmits:%lu abandoned:%lu\n", stats()->acked_batches, stats()->acked_retransmits, stats()->acked_abandoned);
 }
 
 // Request a full hardware reset if there are init issues
@@ -889,9 +1221,17 @@ void fona_init() {
 // Terminate, power down, and set the state of things such that we will look "not busy"
 // when we're in a deselected mode.
 void fona_term(bool fPowerdown) {
+#if USETCP
+    // A session is normally closed by fona_close_session() before we get here, so one that is
+    // still open is from an aborted oneshot and is left for the service to time out.
+    tcp_session_open = false;
+    tcp_session_closing = 0;
+#endif
+    awaiting_udp_ack = false;
     if (fPowerdown)
-        gpio_uart_select(UART_NONE);
+        gpio_uart_release(UART_FONA);
     serial_transmit_enable(true);
+    fona_session_end();
     deferred_active = 0;
     deferred_callback_requested = false;
     deferred_done_after_callback = false;
@@ -914,6 +1254,10 @@ void fona_gps_update() {
 // Process byte received from modem
 void fona_received_byte(uint8_t databyte) {
     fona_received_since_powerup++;
+#if !USETCP
+    if (http_recv_armed && fona_http_received_byte(databyte))
+        return;
+#endif
     if (deferred_callback_requested && databyte == '>')
         comm_enqueue_complete(CMDBUF_TYPE_FONA_DEFERRED);
     else
@@ -1014,6 +1358,13 @@ void fona_process() {
         fonaInitCompleted = false;
         fonaInitInProgress = true;
         fonaInitLastInitiated = get_seconds_since_boot();
+        fona_session_end();
+        tcp_session_open = false;
+        awaiting_udp_ack = false;
+#if !USETCP
+        http_recv_armed = false;
+        http_header_length = 0;
+#endif
         deferred_active = 0;
         deferred_callback_requested = false;
         deferred_done_after_callback = false;
@@ -1077,7 +1428,7 @@ void fona_process() {
         else if (thisargisF("pb done")) {
             // Wait until 1 second after when we think we're done
             // This seems to be necessary else we get a +CME ERROR: SIM busy
-            nrf_delay_ms(1000);
+            prof_delay_ms(1000);
             seenF(0x04);
         } else if (commonreplyF())
             break;
@@ -1187,7 +1538,7 @@ void fona_process() {
         if (allwereseenF(0x01)) {
             // Settle down from reset.  This appears to be necessary, else
             // we see ourselves getting stuck in this state.
-            nrf_delay_ms(750);
+            prof_delay_ms(750);
 
             // If we're debugging, force there to be no cell network connectivity
 #ifdef FONANOSIM
@@ -1460,7 +1811,7 @@ void fona_process() {
             // quickly over and over, and we need to give the
             // modem a chance to get us online.
 #ifdef TRYNODELAY
-            nrf_delay_ms(1500);
+            prof_delay_ms(1500);
 #endif
             comm_set_connect_state(CONNECT_STATE_WIRELESS_SERVICE);
             fona_send("at+cpsi=5");
@@ -1702,6 +2053,8 @@ void fona_process() {
         if (thisargisF("ok")) {
             fona_watchdog_reset();
         } else if (thisargisF("+cipopen: 1,0")) {
+            tcp_session_open = REUSETCP;
+            tcp_session_last_used = get_seconds_since_boot();
             seenF(0x01);
         } else if (thisargisF("+cipopen:")) {
             // Retry
@@ -1720,32 +2073,36 @@ void fona_process() {
                 setstateF(COMM_FONA_CIPOPENRPL2);
             } else {
                 DEBUG_PRINTF("%s is unreachable\n", service_tcp_ipv4);
+                fona_session_end();
                 setidlestateF();
             }
         }
         if (allwereseenF(0x01)) {
-            char command[64];
             comm_set_connect_state(CONNECT_STATE_UNKNOWN);
-            // Our deferred handler will finish this command
-            deferred_callback_requested = true;
-            deferred_done_after_callback = true;
-            watchdog_extend = true;
-            sprintf(command, "at+cipsend=1,%u", deferred_iobuf_length);
-            fona_send(command);
-            setstateF(COMM_FONA_CIPSENDRPL);
+            fona_tcp_start_send();
         }
         break;
     }
 
     case COMM_FONA_CIPSENDRPL: {
-        if (thisargisF("error"))
+        if (thisargisF("error")) {
+            // If the service dropped a session that we were reusing, just open a new one
+            if (tcp_session_reused) {
+                DEBUG_PRINTF("TCP session lost, reopening\n");
+                deferred_callback_requested = false;
+                session_billed_bytes += (FONA_TCP_SESSION_SEGMENTS * FONA_TCP_OVERHEAD_BYTES);
+                fona_tcp_open();
+                break;
+            }
             seenF(0x01);
-        else if (thisargisF("ok"))
+        } else if (thisargisF("ok"))
             seenF(0x01);
         else if (commonreplyF())
             break;
-        else if (thisargisF("+ipclose:"))
+        else if (thisargisF("+ipclose:")) {
+            tcp_session_open = false;
             seenF(0x02);
+        }
         if (allwereseenF(0x03)) {
             watchdog_extend = false;
             fona_send("at+cipclose=1");
@@ -1762,11 +2119,31 @@ void fona_process() {
         else if (commonreplyF())
             break;
         if (allwereseenF(0x01)) {
+            fona_session_end();
             setidlestateF();
         }
         break;
     }
 
+    case COMM_FONA_CIPCLOSERPL2: {
+        // An error means there was nothing left to close
+        if (thisargisF("error"))
+            seenF(0x03);
+        else if (thisargisF("close ok"))
+            seenF(0x03);
+        else if (thisargisF("ok"))
+            seenF(0x01);
+        else if (commonreplyF())
+            break;
+        else if (thisargisF("+cipclose:"))
+            seenF(0x02);
+        else if (thisargisF("+ipclose:"))
+            seenF(0x02);
+        if (allwereseenF(0x03))
+            fona_tcp_closed();
+        break;
+    }
+
     case COMM_FONA_CIPRXGETRPL2: {
         if (commonreplyF())
             break;
@@ -1774,11 +2151,17 @@ void fona_process() {
             break;
         else if (thisargisF("+ciprxget:"))
             break;
-        else if (thisargisF("+ipclose:"))
+        else if (thisargisF("+ipclose:")) {
+            tcp_session_open = false;
             break;
-        else {
+        } else {
             fona_append_received_hex_data((char *)fromFona.buffer, fromFona.length);
+            fona_tcp_received_binary();
             fona_process_received();
+            // The reply completes the transaction; the session stays open for the next send
+            tcp_session_last_used = get_seconds_since_boot();
+            watchdog_extend = false;
+            fona_session_end();
             setidlestateF();
         }
         break;
@@ -1835,12 +2218,13 @@ void fona_process() {
         if (thisargisF("ok"))
             break;
         if (thisargisF("+chttpsrecv: 0")) {
+            fona_http_strip_header();
             fona_process_received();
             fona_send("at+chttpsclse");
             setstateF(COMM_FONA_CHTTPSCLSERPL);
         } else if (thisargisF("+chttpsrecv: data")) {
             break;
-        } else {
+        } else if (!HTTPBINARY) {
             fona_append_received_hex_data((char *)fromFona.buffer, fromFona.length);
         }
         break;
@@ -1852,6 +2236,7 @@ void fona_process() {
         if (thisargisF("ok"))
             seenF(0x01);
         if (allwereseenF(0x01)) {
+            fona_session_end();
             setidlestateF();
         }
         break;
@@ -1984,7 +2369,7 @@ void fona_process() {
                 // Sometimes the first download fails because there is no FTP session yet established
                 if (++getfile_retries <= 10) {
                     char command[64];
-                    nrf_delay_ms(500);
+                    prof_delay_ms(500);
                     DEBUG_PRINTF("Retrying DFU download of %s (%s)\n", DFU_FIRMWARE, &fromFona.buffer[fromFona.args]);
                     sprintf(command, "at+cftpgetfile=\"/%s/%s\",0", storage()->dfu_filename, DFU_FIRMWARE);
                     fona_send(command);
@@ -2141,6 +2526,7 @@ void fona_process() {
         if (thisargisF("ok"))
             seenF(0x01);
         if (allwereseenF(0x01)) {
+            fona_session_end();
             setidlestateF();
         }
         break;
@@ -2150,6 +2536,11 @@ void fona_process() {
     case COMM_STATE_COMPLETE: {
         if (commonreplyF())
             break;
+#if USETCP
+        // The service closed the session that we had been keeping open
+        if (thisargisF("+ipclose:"))
+            tcp_session_open = false;
+#endif
         setidlestateF();
         break;
 
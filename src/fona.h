@@ -8,12 +8,15 @@
 
 bool fona_can_send_to_service();
 bool fona_is_busy();
+bool fona_uart_idle();
+void fona_uart_resync();
 void fona_watchdog_reset();
 void fona_gps_update();
 void fona_gps_shutdown();
 uint16_t fona_gps_get_value(float *lat, float *lon, float *alt);
 bool fona_needed_to_be_reset();
 bool fona_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType);
+bool fona_close_session();
 void fona_request_full_reset();
 void fona_init();
 void fona_term(bool fPowerdown);
@@ -64,6 +64,8 @@ static uint32_t geigerSensorMeasurementBegan = 0;
 static uint16_t currentBucket = 0;
 static uint32_t bucket0[GEIGER_INTEGRATION_BUCKETS];
 static uint32_t bucket1[GEIGER_INTEGRATION_BUCKETS];
+static uint32_t bucketMs[GEIGER_INTEGRATION_BUCKETS];
+static uint64_t lastBucketUpdateMs = 0;
 
 // Forwards
 void geiger_power_on();
@@ -219,6 +221,13 @@ void geiger_bucket_update() {
     interruptCount1 = geiger1InterruptCount;
     geiger1InterruptCount = 0;
 
+    // Measure how long the counters actually accumulated, because polls may be late
+    uint64_t nowMs = get_ms_since_boot();
+    uint32_t elapsedMs = (uint32_t) (nowMs - lastBucketUpdateMs);
+    lastBucketUpdateMs = nowMs;
+    if (elapsedMs == 0)
+        elapsedMs = GEIGER_BUCKET_SECONDS * 1000;
+
     // Take note of when the geigers become available
 #define PULSE_DEBOUNCE 5
     geiger0InterruptCount_total += interruptCount0;
@@ -259,10 +268,12 @@ void geiger_bucket_update() {
         currentBucket = 0;
     bucket0[currentBucket] = interruptCount0;
     bucket1[currentBucket] = interruptCount1;
+    bucketMs[currentBucket] = elapsedMs;
 
     // Sum up the bucket contents
     uint32_t cpm0 = 0;
     uint32_t cpm0buckets = 0;
+    uint32_t cpm0ms = 0;
     if (geiger0IsAvailable) {
         value0IsReportable = true;
         for (i = 0; i < GEIGER_INTEGRATION_BUCKETS; i++) {
@@ -271,6 +282,7 @@ void geiger_bucket_update() {
             else {
                 cpm0 += bucket0[i];
                 cpm0buckets++;
+                cpm0ms += bucketMs[i];
             }
         }
         if (value0IsReportable)
@@ -278,6 +290,7 @@ void geiger_bucket_update() {
     }
     uint32_t cpm1 = 0;
     uint32_t cpm1buckets = 0;
+    uint32_t cpm1ms = 0;
     if (geiger1IsAvailable) {
         value1IsReportable = true;
         for (i = 0; i < GEIGER_INTEGRATION_BUCKETS; i++) {
@@ -286,19 +299,19 @@ void geiger_bucket_update() {
             else {
                 cpm1 += bucket1[i];
                 cpm1buckets++;
+                cpm1ms += bucketMs[i];
             }
         }
         if (value1IsReportable)
             value1EverReportable = true;
     }
 
-    // Compute compensated means
-    float bucketsPerMinute = (float) 60 / GEIGER_BUCKET_SECONDS;
-    float mean, compensated, divisor, secondsPerBucketPerMinute;
+    // Compute compensated means over the time that the buckets actually covered
+    float mean, compensated, divisor, minutes;
     lastValue0 = 0;
     if (cpm0buckets) {
-        secondsPerBucketPerMinute  = ((float) cpm0buckets) / bucketsPerMinute;
-        mean = (float) cpm0 / secondsPerBucketPerMinute;
+        minutes = ((float) cpm0ms) / 60000.0;
+        mean = (float) cpm0 / minutes;
         divisor = 1 - (mean * 1.8833e-6);
         if (divisor)
             compensated = mean / divisor;
@@ -312,8 +325,8 @@ void geiger_bucket_update() {
     }
     lastValue1 = 0;
     if (cpm1buckets) {
-        secondsPerBucketPerMinute  = ((float) cpm1buckets) / bucketsPerMinute;
-        mean = (float) cpm1 / secondsPerBucketPerMinute;
+        minutes = ((float) cpm1ms) / 60000.0;
+        mean = (float) cpm1 / minutes;
         divisor = 1 - (mean * 1.8833e-6);
         if (divisor)
             compensated = mean / divisor;
@@ -397,7 +410,9 @@ void geiger_power_on() {
         for (i = 0; i < GEIGER_INTEGRATION_BUCKETS; i++) {
             bucket0[i] = INVALID_COUNT;
             bucket1[i] = INVALID_COUNT;
+            bucketMs[i] = 0;
         }
+        lastBucketUpdateMs = get_ms_since_boot();
 
         // After powering on, allow settling for stabilization.  When we're in mobile mode,
         // power-on only happens up-front and the geiger stays running continuously.
@@ -24,7 +24,10 @@
 #include "stats.h"
 #include "io.h"
 #include "gpio.h"
+#include "comm.h"
 #include "ssd.h"
+#include "prof.h"
+#include "energy.h"
 
 #ifdef ENABLE_GPIOTE
 #include "nrf_gpiote.h"
@@ -32,10 +35,6 @@
 #include "app_gpiote.h"
 #endif
 
-#ifdef MOTIONX
-#include "comm.h"
-#endif
-
 #ifdef GEIGERX
 #include "geiger.h"
 #endif
@@ -98,8 +97,40 @@ static bool lastYel;
 // Motion
 static uint32_t MotionDetectedTime = 0L;
 
+// UART mux switch, sequenced by timer
+#define UART_SWITCH_IDLE            0
+#define UART_SWITCH_SETTLING        1
+#define UART_SWITCH_STABILIZING     2
+#define UART_SWITCH_POWERING        3
+#define UART_SWITCH_READY           4
+APP_TIMER_DEF(uart_switch_timer);
+static bool uart_switch_timer_started = false;
+static uint32_t uart_switch_step_id = 0;
+static uint16_t uart_switch_state = UART_SWITCH_IDLE;
+static uint16_t uart_switch_prev = UART_NONE;
+static gpio_uart_ready_handler_t uart_switch_ready = NULL;
+void gpio_uart_switch_step(uint16_t state, uint32_t milliseconds);
+void gpio_uart_switch_timer_handler(void *p_context);
+
 // UART-related
 static uint16_t last_uart_selected = UART_NONE;
+static uint32_t last_uart_selected_time = 0;
+
+// UART arbitration.  The comms module owns the UART while it is selected, but between transactions it
+// may lend the UART to a sensor after having held it for its minimum dwell, or immediately if the sensor
+// has higher priority.  The module stays powered while its UART is lent, and gets it back on release.
+typedef struct {
+    uint16_t which;
+    uint16_t priority;
+    uint16_t min_dwell_seconds;
+} uart_client_t;
+static const uart_client_t uart_clients[] = {
+    {UART_LORA, UART_PRIORITY_COMM, UART_DWELL_COMM_SECONDS},
+    {UART_FONA, UART_PRIORITY_COMM, UART_DWELL_COMM_SECONDS},
+    {UART_PMS, UART_PRIORITY_SENSOR, 0},
+    {UART_GPS, UART_PRIORITY_SENSOR, 0},
+};
+static uint16_t uart_lent_from = UART_NONE;
 
 // Configure a pin for input, explicitly with no pull-up or pulldown
 void gpio_cfg_input(uint16_t pin) {
@@ -204,7 +235,8 @@ void gpio_power_set (uint16_t pin, bool fOn) {
 
 #endif // scv1
 
-    // Turn the actual power pin on or off
+    // Account for the rail transition, and turn the actual power pin on or off
+    energy_rail_set(pin, fOn);
     gpio_pin_set(pin, fOn);
 
 }
@@ -322,6 +354,7 @@ bool gpio_in_motion() {
 // Process a data-received event for motion
 #ifdef MOTIONX
 void motion_event_handler(void *unused1, uint16_t unused2) {
+    uint32_t began = prof_begin();
 
     // Update the contents of the screen if there's motion.  Note that this
     // interrupt comes in spuriously sometimes when TWI power is removed,
@@ -341,6 +374,8 @@ void motion_event_handler(void *unused1, uint16_t unused2) {
     // Reset the pin ASAP so that the user can tap the unit to refresh the screen
     sensor_group_schedule_now("g-motion");
 
+    prof_end(PROF_MOTION, began);
+
 }
 #endif
 
@@ -357,6 +392,7 @@ void motion_event() {
 #if defined(NSDKV10) || defined(NSDKV11) || defined(NSDKV121)
 
 void gpiote_event_handler (uint32_t event_pins_low_to_high, uint32_t event_pins_high_to_low) {
+    uint32_t began = prof_begin();
 #ifdef GEIGERX
     if ((event_pins_low_to_high & m_geiger0_low_to_high_mask) != 0)
         geiger0_event();
@@ -367,11 +403,13 @@ void gpiote_event_handler (uint32_t event_pins_low_to_high, uint32_t event_pins_
     if ((event_pins_low_to_high & m_motion_low_to_high_mask) != 0)
         motion_event();
 #endif
+    prof_end(PROF_ISR_GPIO, began);
 }
 
 #else
 
 void gpiote_event_handler (uint32_t const *event_pins_low_to_high, uint32_t const *event_pins_high_to_low) {
+    uint32_t began = prof_begin();
 #ifdef GEIGERX
     if ((event_pins_low_to_high[0] & m_geiger0_low_to_high_mask[0]) != 0)
         geiger0_event();
@@ -382,6 +420,7 @@ void gpiote_event_handler (uint32_t const *event_pins_low_to_high, uint32_t cons
     if ((event_pins_low_to_high[0] & m_motion_low_to_high_mask[0]) != 0)
         motion_event();
 #endif
+    prof_end(PROF_ISR_GPIO, began);
 }
 
 #endif  // SDK version
@@ -544,12 +583,15 @@ char *gpio_uart_name(uint16_t which) {
     return "?";
 }
 
-// UART Selector
-void gpio_uart_select(uint16_t which) {
-    uint32_t speed = UART_BAUDRATE_BAUDRATE_Baud57600;
-    bool hwfc = HWFC;
-    uint16_t prev_uart_selected = last_uart_selected;
+// UART Selector, which steps through the settling delays of the mux switch on a timer rather than
+// by spinning, so that the rest of the system keeps running while the switch is in progress.
+// A new request supersedes one in progress by restarting the sequence, which is always safe because
+// the first step deconfigures the UART.
+void gpio_uart_select(uint16_t which, gpio_uart_ready_handler_t ready) {
+    uart_switch_prev = last_uart_selected;
+    uart_switch_ready = ready;
     last_uart_selected = which;
+    last_uart_selected_time = get_seconds_since_boot();
 
 #ifdef DEBUGSELECT
     DEBUG_PRINTF("UART SELECT %s\n", gpio_uart_name(which));
@@ -559,113 +601,274 @@ void gpio_uart_select(uint16_t which) {
     serial_init(0, false);
 
     // Allow settling
-    nrf_delay_ms(500);
+    gpio_uart_switch_step(UART_SWITCH_SETTLING, UART_SWITCH_SETTLING_MS);
+
+}
+
+// Move the mux switch to the next step, either after a delay or immediately
+void gpio_uart_switch_step(uint16_t state, uint32_t milliseconds) {
+    uart_switch_state = state;
+    if (uart_switch_timer_started)
+        app_timer_stop(uart_switch_timer);
+    uart_switch_timer_started = false;
+    // Tag the step so that an expiry already queued to the scheduler for a superseded step is ignored
+    uart_switch_step_id++;
+    if (milliseconds == 0) {
+        gpio_uart_switch_timer_handler((void *) uart_switch_step_id);
+        return;
+    }
+    if (app_timer_start(uart_switch_timer, APP_TIMER_TICKS(milliseconds, APP_TIMER_PRESCALER), (void *) uart_switch_step_id) == NRF_SUCCESS)
+        uart_switch_timer_started = true;
+    else {
+        // If no timer is available, fall back to waiting in place
+        prof_delay_ms(milliseconds);
+        gpio_uart_switch_timer_handler((void *) uart_switch_step_id);
+    }
+}
+
+// Advance the mux switch state machine, called when the current step's delay has elapsed
+void gpio_uart_switch_timer_handler(void *p_context) {
+    uint16_t which = last_uart_selected;
+    uint32_t speed = UART_BAUDRATE_BAUDRATE_Baud57600;
+    bool hwfc = HWFC;
+
+    if ((uint32_t) p_context != uart_switch_step_id)
+        return;
+    uart_switch_timer_started = false;
+    uint32_t began = prof_begin();
+
+    switch (uart_switch_state) {
 
-    // Power-off modules as appropriate
+    case UART_SWITCH_SETTLING:
+
+        // Power-off modules as appropriate
 #if defined(LORA) && defined(POWER_PIN_LORA)
-    if (which != UART_LORA)
-        gpio_power_set(POWER_PIN_LORA, false);
+        if (which != UART_LORA && uart_lent_from != UART_LORA)
+            gpio_power_set(POWER_PIN_LORA, false);
 #endif
 #ifdef CELLX
-    if (which != UART_FONA)
-        gpio_power_set(POWER_PIN_CELL, false);
+        if (which != UART_FONA && uart_lent_from != UART_FONA)
+            gpio_power_set(POWER_PIN_CELL, false);
 #endif
 #ifdef UGPS
-    if (which != UART_GPS) {
-        // Note that we NEVER turn off the GPS while in mobile mode,
-        // so we don't lose our fix.
-        if (sensor_op_mode() != OPMODE_MOBILE)
-            gpio_power_set(POWER_PIN_GPS, false);
-    }
+        if (which != UART_GPS) {
+            // Note that we NEVER turn off the GPS while in mobile mode,
+            // so we don't lose our fix.
+            if (sensor_op_mode() != OPMODE_MOBILE)
+                gpio_power_set(POWER_PIN_GPS, false);
+        }
 #endif
 
-    // Disable all serial input coming through the mux
+        // Disable all serial input coming through the mux
 #ifdef USX
-    gpio_pin_set(UART_DESELECT, true);
+        gpio_pin_set(UART_DESELECT, true);
 #endif
 
-    // Select the appropriate port on the (still-disabled) uart mux
+        // Select the appropriate port on the (still-disabled) uart mux
 #ifdef LORA
-    if (which == UART_LORA) {
-        hwfc = HWFC;
-        speed = UART_BAUDRATE_BAUDRATE_Baud57600;
+        if (which == UART_LORA) {
+            hwfc = HWFC;
+            speed = UART_BAUDRATE_BAUDRATE_Baud57600;
 #if defined(USX) && defined(USLORA)
-        gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USLORA) != 0);
-        gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USLORA) != 0);
+            gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USLORA) != 0);
+            gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USLORA) != 0);
 #endif
-    }
+        }
 #endif
 #ifdef CELLX
-    if (which == UART_FONA) {
-        hwfc = HWFC;
-        speed = UART_BAUDRATE_BAUDRATE_Baud9600;
+        if (which == UART_FONA) {
+            hwfc = HWFC;
+            speed = UART_BAUDRATE_BAUDRATE_Baud9600;
 #if defined(USX) && defined(USFONA)
-        gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USFONA) != 0);
-        gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USFONA) != 0);
+            gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USFONA) != 0);
+            gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USFONA) != 0);
 #endif
-    }
+        }
 #endif
 #if defined(PMSX) && PMSX==IOUART
-    if (which == UART_PMS) {
-        speed = UART_BAUDRATE_BAUDRATE_Baud9600;
-        hwfc = false;
+        if (which == UART_PMS) {
+            speed = UART_BAUDRATE_BAUDRATE_Baud9600;
+            hwfc = false;
 #if defined(USX) && defined(USPMS)
-        gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USPMS) != 0);
-        gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USPMS) != 0);
+            gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USPMS) != 0);
+            gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USPMS) != 0);
 #endif
-    }
+        }
 #endif
 #ifdef UGPS
-    if (which == UART_GPS) {
-        speed = UART_BAUDRATE_BAUDRATE_Baud9600;
-        hwfc = false;
+        if (which == UART_GPS) {
+            speed = UART_BAUDRATE_BAUDRATE_Baud9600;
+            hwfc = false;
 #if defined(USX) && defined(USGPS)
-        gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USGPS) != 0);
-        gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USGPS) != 0);
+            gpio_pin_set(UART_SELECT_A, (UART_SELECT_PIN_A & USGPS) != 0);
+            gpio_pin_set(UART_SELECT_B, (UART_SELECT_PIN_B & USGPS) != 0);
 #endif
-    }
+        }
 #endif
 
-    // Re-enable comms
-    if (which != UART_NONE) {
+        // If nothing is being selected, there's nothing to stabilize
+        if (which == UART_NONE) {
+            gpio_uart_switch_step(UART_SWITCH_POWERING, 0);
+            break;
+        }
 
-        // Initialize the UART
+        // Initialize the UART, and allow serial traffic to stabilize after selecting speed
         serial_init(speed, hwfc);
+        gpio_uart_switch_step(UART_SWITCH_STABILIZING, UART_SWITCH_STABILIZING_MS);
+        break;
 
-        // Allow serial traffic to stabilize after selecting speed
-        nrf_delay_ms(1000);
+    case UART_SWITCH_STABILIZING:
 
         // Enable the uart mux, which starts data flowing
 #ifdef USX
         gpio_pin_set(UART_DESELECT, false);
 #endif
+        gpio_uart_switch_step(UART_SWITCH_POWERING, 0);
+        break;
 
-    }
+    case UART_SWITCH_POWERING:
 
-    // Power-on modules as appropriate
+        // Power-on modules as appropriate
 #if defined(LORA) && defined(POWER_PIN_LORA)
-    if (which == UART_LORA)
-        gpio_power_set(POWER_PIN_LORA, true);
+        if (which == UART_LORA)
+            gpio_power_set(POWER_PIN_LORA, true);
 #endif
 #ifdef CELLX
-    if (which == UART_FONA)
-        gpio_power_set(POWER_PIN_CELL, true);
+        if (which == UART_FONA)
+            gpio_power_set(POWER_PIN_CELL, true);
 #endif
 #ifdef UGPS
-    if (which == UART_GPS)
-        gpio_power_set(POWER_PIN_GPS, true);
+        if (which == UART_GPS)
+            gpio_power_set(POWER_PIN_GPS, true);
+#endif
+
+        // Allow a stabilization period before we start transmitting to it
+        gpio_uart_switch_step(UART_SWITCH_READY, UART_SWITCH_POWERING_MS);
+        break;
+
+    case UART_SWITCH_READY: {
+        gpio_uart_ready_handler_t ready = uart_switch_ready;
+
+        uart_switch_state = UART_SWITCH_IDLE;
+        uart_switch_ready = NULL;
+
+        // Clear UART error count
+        serial_uart_error_check(true);
+
+        // Indicate what we just selected
+        if (uart_switch_prev != UART_NONE || which != UART_NONE)
+            DEBUG_PRINTF("UART %s to %s\n", gpio_uart_name(uart_switch_prev), gpio_uart_name(which));
+
+        // Let the requestor proceed
+        if (ready != NULL)
+            ready(which);
+        break;
+    }
+
+    }
+
+    prof_end(PROF_UART_SWITCH, began);
+
+}
+
+// See if a UART switch is still in progress
+bool gpio_uart_switching() {
+    return (uart_switch_state != UART_SWITCH_IDLE);
+}
+
+// Get the arbitration priority of a UART client
+uint16_t gpio_uart_priority(uint16_t which, uint16_t *min_dwell_seconds) {
+    for (int i=0; i<sizeof(uart_clients)/sizeof(uart_clients[0]); i++) {
+        if (uart_clients[i].which != which)
+            continue;
+        if (min_dwell_seconds != NULL)
+            *min_dwell_seconds = uart_clients[i].min_dwell_seconds;
+        // In mobile mode, a fresh GPS fix matters more than prompt uploads
+        if (which == UART_GPS && sensor_op_mode() == OPMODE_MOBILE)
+            return UART_PRIORITY_MOBILE_GPS;
+        return uart_clients[i].priority;
+    }
+    if (min_dwell_seconds != NULL)
+        *min_dwell_seconds = 0;
+    return 0;
+}
+
+// See if the UART could be granted to this client right now
+bool gpio_uart_available(uint16_t which) {
+    uint16_t min_dwell_seconds;
+
+    // If nobody has it, it's available
+    if (last_uart_selected == UART_NONE)
+        return true;
+
+    // Only the comms module's UART may be lent, and only to one client at a time
+    if (uart_lent_from != UART_NONE)
+        return false;
+    if (last_uart_selected != UART_LORA && last_uart_selected != UART_FONA)
+        return false;
+    if (gpio_uart_switching() || !comm_uart_lendable())
+        return false;
+
+    // Lend it if the client outranks the owner, or once the owner has had its minimum dwell
+    uint16_t owner_priority = gpio_uart_priority(last_uart_selected, &min_dwell_seconds);
+    if (gpio_uart_priority(which, NULL) > owner_priority)
+        return true;
+    return ((get_seconds_since_boot() - last_uart_selected_time) >= min_dwell_seconds);
+
+}
+
+// Request the UART on behalf of a client, borrowing it from comms if need be
+bool gpio_uart_request(uint16_t which, gpio_uart_ready_handler_t ready) {
+
+    if (!gpio_uart_available(which))
+        return false;
+
+    if (last_uart_selected != UART_NONE) {
+        uart_lent_from = last_uart_selected;
+        DEBUG_PRINTF("UART %s lent to %s\n", gpio_uart_name(uart_lent_from), gpio_uart_name(which));
+    }
+
+    gpio_uart_select(which, ready);
+    return true;
+
+}
+
+// Release the UART on behalf of a client, returning it to comms if it had been lent
+void gpio_uart_release(uint16_t which) {
+
+    // If the owner is going away while its UART is lent, the borrower keeps the UART
+    // and the owner's module is powered off now rather than on return.
+    if (which == uart_lent_from && which != last_uart_selected) {
+        uart_lent_from = UART_NONE;
+#if defined(LORA) && defined(POWER_PIN_LORA)
+        if (which == UART_LORA)
+            gpio_power_set(POWER_PIN_LORA, false);
 #endif
+#ifdef CELLX
+        if (which == UART_FONA)
+            gpio_power_set(POWER_PIN_CELL, false);
+#endif
+        return;
+    }
 
-    // Allow a stabilization period before we start transmitting to it
-    nrf_delay_ms(500);
+    // Ignore releases by clients that don't hold the UART
+    if (which != last_uart_selected)
+        return;
 
-    // Clear UART error count
-    serial_uart_error_check(true);
+    // Return it to its owner, or deselect it
+    if (uart_lent_from != UART_NONE) {
+        uint16_t owner = uart_lent_from;
+        uart_lent_from = UART_NONE;
+        gpio_uart_select(owner, comm_uart_returned);
+        return;
+    }
+    gpio_uart_select(UART_NONE, NULL);
 
-    // Indicate what we just selected
-    if (prev_uart_selected != UART_NONE || last_uart_selected != UART_NONE)
-        DEBUG_PRINTF("UART %s to %s\n", gpio_uart_name(prev_uart_selected), gpio_uart_name(last_uart_selected));
+}
 
+// See if the comms module's UART is currently lent out
+bool gpio_uart_lent() {
+    return (uart_lent_from != UART_NONE);
 }
 
 // Initialize everything related to GPIO
@@ -800,6 +1003,7 @@ void gpio_init() {
 #ifdef UART_SELECT_B
     gpio_cfg_output(UART_SELECT_B);
 #endif
-    gpio_uart_select(UART_NONE);
+    app_timer_create(&uart_switch_timer, APP_TIMER_MODE_SINGLE_SHOT, gpio_uart_switch_timer_handler);
+    gpio_uart_select(UART_NONE, NULL);
 
 }
@@ -36,7 +36,13 @@ bool gpio_in_motion();
 #define UART_FONA   2   // Adafruit Fona 3G
 #define UART_PMS    3   // Plantower PMS3003
 #define UART_GPS    4   // Adafruit Ultimate GPS
-void gpio_uart_select(uint16_t which_comm);
+typedef void (*gpio_uart_ready_handler_t) (uint16_t which);
+void gpio_uart_select(uint16_t which_comm, gpio_uart_ready_handler_t ready);
+bool gpio_uart_switching();
+bool gpio_uart_available(uint16_t which);
+bool gpio_uart_request(uint16_t which, gpio_uart_ready_handler_t ready);
+void gpio_uart_release(uint16_t which);
+bool gpio_uart_lent();
 uint16_t gpio_current_uart();
 char *gpio_uart_name(uint16_t which);
 
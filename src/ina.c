@@ -26,6 +26,7 @@
 #include "ina.h"
 #include "io.h"
 #include "battery.h"
+#include "energy.h"
 
 #define CONFIG_MODE_TRIGGERED   0
 #define CONFIG_MODE_CONTINUOUS  1
@@ -147,6 +148,7 @@ static float sampled_shunt_voltage;
 static float sampled_bus_voltage;
 static float sampled_load_voltage;
 static float sampled_current;
+static float sampled_total_current;
 
 static uint16_t ina219_cfgValue;
 static uint32_t ina219_calValue;
@@ -466,11 +468,14 @@ void ina_callback(ret_code_t result, twi_context_t *t) {
     if (current > TWI_CURRENT_FUDGE)
         current -= TWI_CURRENT_FUDGE;
 
-    // Store it into the bin IF AND ONLY IF nobody is currently sucking power on the UART if in oneshot mode
+    // Store it into the bin IF AND ONLY IF nobody is currently sucking power on the UART if in oneshot mode,
+    // but keep a total including those samples because the power plan must account for what comms draws
     if (num_samples < PWR_SAMPLE_BINS) {
         sampled_shunt_voltage += shunt_voltage;
         sampled_load_voltage += load_voltage;
         sampled_bus_voltage += bus_voltage;
+        sampled_total_current += current;
+        energy_measured(current);
         if (!comm_oneshot_currently_enabled() || gpio_current_uart() == UART_NONE) {
             sampled_current += current;
             num_current_samples++;
@@ -518,6 +523,7 @@ void ina_callback(ret_code_t result, twi_context_t *t) {
 
         // Tell the sensor package that we retrieved an SOC value, and what it is
         battery_set_soc(reported_soc);
+        battery_set_current(sampled_total_current / num_samples);
 
         // Flag that this I/O has been completed.
         sensor_measurement_completed(t->sensor);
@@ -615,7 +621,7 @@ void s_ina_clear_measurement() {
     num_samples = 0;
     num_current_samples = 0;
     first_sample = true;
-    sampled_shunt_voltage = sampled_bus_voltage = sampled_load_voltage = sampled_current = 0.0;
+    sampled_shunt_voltage = sampled_bus_voltage = sampled_load_voltage = sampled_current = sampled_total_current = 0.0;
 }
 
 // Init sensor
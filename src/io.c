@@ -13,6 +13,7 @@
 #include "nrf_nvic.h"
 #include "softdevice_handler.h"
 #include "storage.h"
+#include "evlog.h"
 #include "serial.h"
 #include "config.h"
 #include "timer.h"
@@ -139,8 +140,16 @@ void io_restart_if_requested() {
 
     DEBUG_PRINTF("*** ABOUT TO RESTART ***\n");
     
-    // Wait several iterations of being called for things to settle down
-    if (++RestartPending > 1) {
+    // Wait several iterations of being called for things to settle down, and for flash writes to complete
+    if (++RestartPending > 1 && !storage_flash_busy()) {
+
+        // The log may have still been writing when the restart was requested, so flush it now that
+        // it can take what's left, and wait for that to be written too.  A job held after repeated
+        // failures isn't ready, and isn't waited for.
+        if (evlog_pending() && storage_evlog_ready()) {
+            evlog_flush();
+            return;
+        }
 
         // This is the proper way of doing it, assuming that the softdevice is active.
         sd_nvic_SystemReset();
@@ -154,6 +163,9 @@ void io_restart_if_requested() {
 
 // Request a soft reset
 void io_request_restart() {
+    evlog0(EV_RESTART);
+    evlog_flush();
+    storage_save_stats();
     storage_checkpoint();
     DEBUG_PRINTF("*** REQUESTING RESTART ***\n");
     RestartPending = 1;
@@ -31,6 +31,7 @@
 #include "tt.pb.h"
 #include "pb_encode.h"
 #include "pb_decode.h"
+#include "prof.h"
 
 // Device states
 #define COMM_LORA_SYSRESETRPL           COMM_STATE_DEVICE_START+0
@@ -106,6 +107,11 @@ static bool loraInitInProgress = false;
 static uint32_t loraInitLastInitiated = 0L;
 static uint16_t lorafpRegionCommandNumber;
 
+// Radio-on accounting, so that we can see what each delivered message costs
+static uint32_t loraPoweredOnTime = 0L;
+static uint32_t loraSentTime = 0L;
+static uint64_t loraSentMs = 0L;
+
 // Relay state
 static uint8_t toRelayBuffer[CMD_MAX_LINELENGTH];
 static uint16_t toRelayBufferLength;
@@ -262,6 +268,10 @@ void process_rx(char *in) {
     // Bump stats about what we've received on the wire
     stats_io(0, decodedBytes);
 
+    // Record the round trip
+    if (loraSentTime != 0)
+        comm_latency_record(COMM_PHASE_REPLY, (uint32_t) (get_ms_since_boot() - loraSentMs));
+
     // A reply from an "are you there?" ping we sent to TTGATE?
     if (msgtype == MSG_REPLY_TTGATE) {
         awaitingTTGateReply = false;
@@ -454,6 +464,16 @@ bool lora_is_busy() {
     return false;
 }
 
+// See if the module is between transactions, with nothing that it could send us unprompted
+bool lora_uart_idle() {
+    return (fromLora.state == COMM_STATE_IDLE && !deferred_transmit);
+}
+
+// Discard anything partially received before the UART was lent out, so we resync on the next line
+void lora_uart_resync() {
+    comm_cmdbuf_reset(&fromLora);
+}
+
 // Transmit a well-formed protocol buffer to the LPWAN as a message
 bool lora_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType) {
     char *command;
@@ -485,6 +505,8 @@ bool lora_send_to_service(uint8_t *buffer, uint16_t length, uint16_t RequestType
     // If we're busy doing something else, drop this
     if (lora_is_busy())
         return false;
+    loraSentTime = get_seconds_since_boot();
+    loraSentMs = get_ms_since_boot();
 
     // Do different types of transmit, based on mode.  Start by assuming no retries.
     xmitReplyRetriesLeft = 0;
@@ -604,6 +626,18 @@ void lora_reset(bool force) {
 // Request state for debugging
 void lora_request_state() {
     DEBUG_PRINTF("Lora %s: st=%d cc=%d b=%d,%d,%d '%s'\n", comm_is_deselected() ? "disconnected" : "connected", fromLora.state, fromLora.complete, fromLora.busy_length, fromLora.busy_nextput, fromLora.busy_nextget, fromLora.buffer);
+    lora_radio_time_update();
+    uint32_t hours = (get_seconds_since_boot() / (60*60)) + 1;
+    DEBUG_PRINTF("Lora ok:%lu (%lu/hr) busy:%lu nofreech:%lu err:%lu on:%lus\n", stats()->lora_delivered, stats()->lora_delivered / hours, stats()->lora_busy, stats()->lora_no_free_ch, stats()->errors_lora, stats()->lora_radio_seconds);
+}
+
+// Accumulate the time that the module has been powered since we last looked
+void lora_radio_time_update() {
+    uint32_t now = get_seconds_since_boot();
+    if (loraPoweredOnTime != 0 && now >= loraPoweredOnTime) {
+        stats()->lora_radio_seconds += (now - loraPoweredOnTime);
+        loraPoweredOnTime = now;
+    }
 }
 
 // One-time or per-oneshot init
@@ -618,6 +652,7 @@ void lora_init() {
     loraInitCompleted = false;
     loraFirstResetAfterInit = true;
     fTermAfterSleep = false;
+    loraPoweredOnTime = get_seconds_since_boot();
 
     // Kick the module into doing something, else it will just be idle
     lora_send("sys get ver");
@@ -627,7 +662,9 @@ void lora_init() {
 // Terminate, power down, and set the state of things such that we will look "not busy"
 // when we're in a deselected mode.
 void lora_do_term() {
-    gpio_uart_select(UART_NONE);
+    lora_radio_time_update();
+    loraPoweredOnTime = 0L;
+    gpio_uart_release(UART_LORA);
     deferred_transmit = false;
     serial_transmit_enable(true);
     setstateL(COMM_STATE_IDLE);
@@ -708,7 +745,7 @@ void lora_process() {
     case COMM_LORA_GETVERRPL: {
         STORAGE *s = storage();
         // Delay after any get ver.  This matters for Microchip timing reasons.
-        nrf_delay_ms(MICROCHIP_LONG_DELAY_MS);
+        prof_delay_ms(MICROCHIP_LONG_DELAY_MS);
         // There may be garbage, so retry until we get in sync
         if (!loraInitEverCompleted)
             DEBUG_PRINTF("%s\n", &fromLora.buffer[fromLora.args]);
@@ -755,7 +792,7 @@ void lora_process() {
 
     case COMM_LORA_SYSRESETRPL: {
         // Let things settle down after the sys reset
-        nrf_delay_ms(MICROCHIP_LONG_DELAY_MS);
+        prof_delay_ms(MICROCHIP_LONG_DELAY_MS);
         if (loraInitEverCompleted) {
             processstateL(COMM_LORA_HWEUIDONE);
             break;
@@ -772,7 +809,7 @@ void lora_process() {
             strlcpy(storage()->ttn_dev_eui, devEui, sizeof(storage()->ttn_dev_eui));
             DEBUG_PRINTF("Saving DevEUI: %s\n", devEui);
             storage_save(false);
-            nrf_delay_ms(MICROCHIP_LONG_DELAY_MS);
+            prof_delay_ms(MICROCHIP_LONG_DELAY_MS);
         } else if (!loraInitEverCompleted) {
             DEBUG_PRINTF("DevEui: %s\n", devEui);
         }
@@ -818,7 +855,7 @@ void lora_process() {
         // down the device's throat after successful initialization.  We've
         // seen cases where just after a reset the lpwan chip goes into a
         // state in which it just does nothing but say "busy"
-        nrf_delay_ms(250);
+        prof_delay_ms(250);
         setidlestateL();
         // Initiate a service upload if one is pending
         comm_update_service();
@@ -1011,7 +1048,7 @@ void lora_process() {
             fRetry = true;
         } else {
             DEBUG_PRINTF("Unknown join response.\n");
-            nrf_delay_ms(MICROCHIP_LONG_DELAY_MS);
+            prof_delay_ms(MICROCHIP_LONG_DELAY_MS);
             setstateL(COMM_LORA_JOINRPL);
         }
 
@@ -1084,7 +1121,7 @@ void lora_process() {
         ms = 5000 + io_get_random(5000);
 #define delay_interval_ms 100
         for (i=0; i<ms; i+=delay_interval_ms)
-            nrf_delay_ms(delay_interval_ms);
+            prof_delay_ms(delay_interval_ms);
         // Set idle (else the send_to_service will be blocked) and transmit it
         comm_cmdbuf_set_state(&fromLora, COMM_STATE_IDLE);
         if (send_to_service(toRelayBuffer, toRelayBufferLength, REPLY_NONE, SEND_1))
@@ -1099,15 +1136,29 @@ void lora_process() {
     case  COMM_LORA_TXRPL1: {
         if (thisargisL("ok"))
             setstateL(COMM_LORA_TXRPL2);
-        else
+        else {
+            // The module refused the transmit, most commonly because of duty cycle limits
+            if (thisargisL("no_free_ch"))
+                stats()->lora_no_free_ch++;
+            else if (thisargisL("busy"))
+                stats()->lora_busy++;
+            else
+                DEBUG_PRINTF("tx1 reply ?? %s\n", &fromLora.buffer[fromLora.args]);
+            comm_cost_delivered(COMM_LORA, false);
             setidlestateL();
+        }
         break;
     }
 
     case  COMM_LORA_TXRPL2: {
         if (thisargisL("radio_tx_ok") || thisargisL("mac_tx_ok")) {
+            stats()->lora_delivered++;
+            comm_cost_delivered(COMM_LORA, true);
+            comm_latency_record(COMM_PHASE_SEND, (uint32_t) (get_ms_since_boot() - loraSentMs));
             setidlestateL();
         } else if (thisargisL("mac_rx")) {
+            stats()->lora_delivered++;
+            comm_cost_delivered(COMM_LORA, true);
             comm_cmdbuf_next_arg(&fromLora);
             // skip mac_rx
             thisargisL("*");
@@ -1136,6 +1187,7 @@ void lora_process() {
             // Record this as an error because it means that something the caller
             // thought was transmitted silently got dropped.
             stats()->errors_lora++;
+            comm_cost_delivered(COMM_LORA, false);
             setidlestateL();
         }
         if (loraInitEverCompleted && !awaitingTTServeReply)
@@ -1188,7 +1240,7 @@ void lora_process() {
             serial_transmit_enable(true);
             // This is not at all expected, but it means that we're
             // moving too quickly and we should try again.
-            nrf_delay_ms(MICROCHIP_LONG_DELAY_MS);
+            prof_delay_ms(MICROCHIP_LONG_DELAY_MS);
             restart_receive();
         } else if (thisargisL("radio_rx")) {
             // Re-enable serial output now that it's safe to do so
@@ -11,9 +11,12 @@ void lora_term(bool fPowerdown);
 void lora_process();
 void lora_reset(bool Force);
 void lora_request_state();
+void lora_radio_time_update();
 void lora_watchdog_reset();
 bool lora_needed_to_be_reset();
 bool lora_is_busy();
+bool lora_uart_idle();
+void lora_uart_resync();
 void lora_send(char *msg);
 void lora_enter_command_mode();
 bool lora_can_send_to_service();
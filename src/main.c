@@ -13,6 +13,9 @@
 #include "gpio.h"
 #include "serial.h"
 #include "storage.h"
+#include "stats.h"
+#include "evlog.h"
+#include "prof.h"
 #include "softdevice_handler.h"
 #include "app_scheduler.h"
 
@@ -53,7 +56,9 @@ void power_manage(void) {
 #endif
 #endif
 
+    prof_sleep_begin();
     sd_app_evt_wait();
+    prof_sleep_end();
 
 #if defined(SCHEDDEBUG)
 #ifdef LED_PIN_YEL
@@ -65,7 +70,9 @@ void power_manage(void) {
 #endif
 
     // Do work enqueued during interrupt service routines
+    uint32_t began = prof_begin();
     app_sched_execute();
+    prof_end(PROF_SCHED, began);
 
 #if defined(SCHEDDEBUG)
 #ifdef LED_PIN_RED
@@ -83,6 +90,9 @@ int main(void) {
 
     // Init debug flags
     debug_init();
+
+    // Start counting cycles for the profiler
+    prof_init();
     
     // Init app timers & scheduler, which must be done before other things
     // which use app sched or timers such as serial
@@ -108,6 +118,12 @@ int main(void) {
     // io and timer init because they rely upon config values
     storage_init();
 
+    // Restore the stats that were checkpointed before the last restart
+    stats_init();
+
+    // Note the boot in the event log
+    evlog_init();
+
     // Init misc I/O
     io_init();
 
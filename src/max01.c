@@ -29,6 +29,7 @@
 #include "io.h"
 #include "stats.h"
 #include "battery.h"
+#include "energy.h"
 
 #define CONFIG_MODE_TRIGGERED   0
 #define CONFIG_MODE_CONTINUOUS  1
@@ -76,6 +77,7 @@ static float reported_current = 0.0;
 static float sampled_voltage;
 static float sampled_soc;
 static float sampled_current;
+static float sampled_total_drawn;
 
 #define PWR_SAMPLE_BINS (PWR_SAMPLE_PERIOD_SECONDS/PWR_SAMPLE_SECONDS)
 static bool first_sample;
@@ -111,6 +113,10 @@ void max01_callback(ret_code_t result, twi_context_t *t) {
 #ifdef scv1
     current = -current;
 #endif
+    // The MAX17201 reports charge current as positive, but the battery plan and energy model
+    // want current drawn from the battery as positive, as the INA219 reports it.  What we upload
+    // keeps the convention that boards in the field already use.
+    float drawn = -((float) icombined * (0.0015625/0.01));
     // Compute SOC as %
     ucombined = regREPSOC[1] | (regREPSOC[2] << 8);
     float soc = (float) ucombined / 256;
@@ -140,10 +146,13 @@ void max01_callback(ret_code_t result, twi_context_t *t) {
             voltage, current, soc, temp, cap, tte, ttf, status, age, capacity, avcell, agef, vbat);
     strlcpy(stats()->battery, buffer, sizeof(stats()->battery)-1);
 
-    // Store it into the bin IF AND ONLY IF nobody is currently sucking power on the UART if in oneshot mode
+    // Store it into the bin IF AND ONLY IF nobody is currently sucking power on the UART if in oneshot mode,
+    // but keep a total including those samples because the power plan must account for what comms draws
     if (num_samples < PWR_SAMPLE_BINS) {
         sampled_voltage += voltage;
         sampled_soc += soc;
+        sampled_total_drawn += drawn;
+        energy_measured(drawn);
         if (!comm_oneshot_currently_enabled() || gpio_current_uart() == UART_NONE) {
             sampled_current += current;
             num_current_samples++;
@@ -208,6 +217,7 @@ void max01_callback(ret_code_t result, twi_context_t *t) {
 #else
         battery_set_soc(battery_soc_from_voltage(reported_voltage));
 #endif
+        battery_set_current(sampled_total_drawn / num_samples);
 
         // Flag that this I/O has been completed.
         sensor_measurement_completed(t->sensor);
@@ -316,7 +326,7 @@ void s_max01_clear_measurement() {
     num_samples = 0;
     num_current_samples = 0;
     first_sample = true;
-    sampled_soc = sampled_voltage = sampled_current = 0.0;
+    sampled_soc = sampled_voltage = sampled_current = sampled_total_drawn = 0.0;
 }
 
 // Init sensor
@@ -124,6 +124,29 @@ void HexCommand(char *buffer, uint16_t bufflen, char *prefix, uint8_t *bytes, ui
     *buffer++ = '\0';
 }
 
+// Append an unsigned LEB128 varint, returning its length of at most 5 bytes
+uint16_t VarintEncode(uint8_t *buffer, uint32_t value) {
+    uint16_t len = 0;
+    while (value >= 0x80) {
+        buffer[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    buffer[len++] = (uint8_t) value;
+    return len;
+}
+
+// Parse an unsigned LEB128 varint, returning its length or 0 if it runs past the end of the buffer
+uint16_t VarintDecode(uint8_t *buffer, uint16_t length, uint32_t *value) {
+    uint16_t len = 0;
+    *value = 0;
+    while (len < length && len < 5) {
+        *value |= ((uint32_t) (buffer[len] & 0x7f)) << (7 * len);
+        if ((buffer[len++] & 0x80) == 0)
+            return len;
+    }
+    return 0;
+}
+
 // Utility function to compute a "bracketed" standard deviation from an array of floats,
 // where the bracket is the number of highest and lowest values that will be used to reflect
 // the extremities variance there is within a given sample set.
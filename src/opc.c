@@ -29,6 +29,7 @@
 #include "opc.h"
 #include "io.h"
 #include "stats.h"
+#include "prof.h"
 
 #ifdef SPIOPC
 
@@ -448,7 +449,7 @@ bool spi_cmd(uint8_t *tx, uint16_t txlen, uint16_t rxlen) {
 
     // We've found that we cannot execute commands too quickly else we get garbage,
     // as indicated by the very first byte of the reply not being 0xf3
-    nrf_delay_ms(500);
+    prof_delay_ms(500);
 
     // Do special handling for the commands requiring large receives
     if (tx[0] != 0x3f && tx[0] != 0x30) {
@@ -493,7 +494,7 @@ bool spi_cmd(uint8_t *tx, uint16_t txlen, uint16_t rxlen) {
             // Wait 5ms so that we skip over whatever trash was returned to us immediately
             // following the command.  This ensures that whatever we get afterward, which
             // comes after quite a bit of a delay, will start cleanly.
-            nrf_delay_ms(5);
+            prof_delay_ms(5);
 
             // Receive each of these bytes individually.  We've found that we can't do a single large
             // read because the bytes apparently aren't yet available, and this technique introduces
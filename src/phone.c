@@ -34,6 +34,9 @@
 #include "pb_encode.h"
 #include "pb_decode.h"
 #include "ssd.h"
+#include "prof.h"
+#include "energy.h"
+#include "evlog.h"
 
 // Device states
 #define CMD_STATE_XMIT_PHONE_TEXT       COMM_STATE_DEVICE_START+0
@@ -311,6 +314,45 @@ void phone_complete() {
             break;
         }
 
+        // Show where awake time is going, optionally clearing the profile afterward
+        if (comm_cmdbuf_this_arg_is(&fromPhone, "prof")) {
+            prof_show();
+            comm_cmdbuf_next_arg(&fromPhone);
+            if (comm_cmdbuf_this_arg_is(&fromPhone, "clear")) {
+                prof_clear();
+                DEBUG_PRINTF("Profile cleared.\n");
+            }
+            comm_cmdbuf_set_state(&fromPhone, COMM_STATE_IDLE);
+            break;
+        }
+
+        // Show what each power rail has cost
+        if (comm_cmdbuf_this_arg_is(&fromPhone, "energy") || comm_cmdbuf_this_arg_is(&fromPhone, "mah")) {
+            energy_show();
+            comm_cmdbuf_set_state(&fromPhone, COMM_STATE_IDLE);
+            break;
+        }
+
+        // Show the event log, or send it to the service
+        if (comm_cmdbuf_this_arg_is(&fromPhone, "evlog")) {
+            bool fSend = false;
+            uint16_t pages = 1;
+            comm_cmdbuf_next_arg(&fromPhone);
+            if (comm_cmdbuf_this_arg_is(&fromPhone, "send")) {
+                fSend = true;
+                comm_cmdbuf_next_arg(&fromPhone);
+            }
+            if (fromPhone.buffer[fromPhone.args] != '\0')
+                pages = atoi((char *)&fromPhone.buffer[fromPhone.args]);
+            if (fSend) {
+                evlog_upload_request(pages);
+                comm_initiate_service_update(false);
+            } else
+                evlog_show(pages);
+            comm_cmdbuf_set_state(&fromPhone, COMM_STATE_IDLE);
+            break;
+        }
+
         // Request statistics
         if (comm_cmdbuf_this_arg_is(&fromPhone, "stats")) {
             comm_initiate_service_update(false);
@@ -743,6 +785,7 @@ void phone_complete() {
             } else {
                 storage_set_sensor_params_as_string((char *)&fromPhone.buffer[fromPhone.args]);
                 storage_save(true);
+                send_deadband_params();
                 storage_get_sensor_params_as_string(buffer, sizeof(buffer));
                 DEBUG_PRINTF("Now %s\n", buffer);
             }
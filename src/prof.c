@@ -0,0 +1,162 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Lightweight profiler accounting for where awake time goes, by subsystem and by delay call site
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "nrf.h"
+#include "debug.h"
+#include "config.h"
+#include "timer.h"
+#include "prof.h"
+
+// DWT cycle counter runs at the CPU clock, and only while the CPU is not sleeping
+#define PROF_CYCLES_PER_US  64
+
+// Fixed-size accumulators
+typedef struct {
+    uint32_t count;
+    uint32_t max_cycles;
+    uint64_t cycles;
+} prof_counter_t;
+
+typedef struct {
+    const char *file;
+    uint16_t line;
+    prof_counter_t counter;
+} prof_site_t;
+
+static prof_counter_t prof_slot[PROF_SLOTS];
+static prof_site_t prof_site[PROF_DELAY_SITES];
+static prof_counter_t prof_site_other;
+static uint32_t prof_wakes = 0;
+static uint64_t prof_sleep_ticks = 0;
+static uint64_t prof_sleep_began = 0;
+static uint64_t prof_ticks_cleared = 0;
+
+// Short names used both for the console and for the stats summary
+static const char *prof_names[PROF_SLOTS] = {"sch", "tt", "sen", "com", "stm", "uart", "cmd", "mot", "iu", "ig", "ib", "it", "dly"};
+
+// Enable the cycle counter
+void prof_init() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    prof_clear();
+}
+
+// Clear the counters
+void prof_clear() {
+    memset(prof_slot, 0, sizeof(prof_slot));
+    memset(prof_site, 0, sizeof(prof_site));
+    memset(&prof_site_other, 0, sizeof(prof_site_other));
+    prof_wakes = 0;
+    prof_sleep_ticks = 0;
+    prof_ticks_cleared = get_ticks_since_boot();
+}
+
+// Add an interval to a counter
+void prof_add(prof_counter_t *c, uint32_t cycles) {
+    c->count++;
+    c->cycles += cycles;
+    if (cycles > c->max_cycles)
+        c->max_cycles = cycles;
+}
+
+// Begin timing something, returning the value to pass to prof_end
+uint32_t prof_begin() {
+    return DWT->CYCCNT;
+}
+
+// Account for the time since prof_begin
+void prof_end(uint16_t slot, uint32_t began) {
+    if (slot < PROF_SLOTS)
+        prof_add(&prof_slot[slot], DWT->CYCCNT - began);
+}
+
+// Note that we're about to sleep waiting for an event
+void prof_sleep_begin() {
+    prof_sleep_began = get_ticks_since_boot();
+}
+
+// Note that we've been woken up
+void prof_sleep_end() {
+    prof_sleep_ticks += get_ticks_since_boot() - prof_sleep_began;
+    prof_wakes++;
+}
+
+// Delay, accounting for the time spent against the call site
+void prof_delay(const char *file, uint16_t line, uint32_t ms) {
+    int i;
+    prof_counter_t *c = &prof_site_other;
+    uint32_t began = prof_begin();
+
+    nrf_delay_ms(ms);
+
+    for (i=0; i<PROF_DELAY_SITES; i++) {
+        if (prof_site[i].file == NULL) {
+            prof_site[i].file = file;
+            prof_site[i].line = line;
+        }
+        if (prof_site[i].file == file && prof_site[i].line == line) {
+            c = &prof_site[i].counter;
+            break;
+        }
+    }
+    prof_add(c, DWT->CYCCNT - began);
+    prof_end(PROF_DELAY, began);
+}
+
+// Milliseconds of awake time since the counters were cleared
+uint32_t prof_awake_ms() {
+    uint64_t ticks = get_ticks_since_boot() - prof_ticks_cleared - prof_sleep_ticks;
+    return (uint32_t) ((ticks * 1000) / APP_TIMER_TICKS_PER_SECOND);
+}
+
+// Display a counter on the console
+void prof_show_counter(const char *name, uint16_t line, prof_counter_t *c) {
+    if (c->count == 0)
+        return;
+    if (line == 0)
+        DEBUG_PRINTF("%s: %lums n=%lu max=%luus\n", name, (uint32_t) (c->cycles / (PROF_CYCLES_PER_US*1000)), c->count, c->max_cycles / PROF_CYCLES_PER_US);
+    else
+        DEBUG_PRINTF("%s:%d: %lums n=%lu max=%luus\n", name, line, (uint32_t) (c->cycles / (PROF_CYCLES_PER_US*1000)), c->count, c->max_cycles / PROF_CYCLES_PER_US);
+}
+
+// Display the profile on the console
+void prof_show() {
+    int i;
+    uint32_t elapsed_ms = (uint32_t) (((get_ticks_since_boot() - prof_ticks_cleared) * 1000) / APP_TIMER_TICKS_PER_SECOND);
+    DEBUG_PRINTF("Awake %lums of %lums, %lu wakes\n", prof_awake_ms(), elapsed_ms, prof_wakes);
+    for (i=0; i<PROF_SLOTS; i++)
+        prof_show_counter(prof_names[i], 0, &prof_slot[i]);
+    for (i=0; i<PROF_DELAY_SITES; i++) {
+        if (prof_site[i].file == NULL)
+            break;
+        const char *filename = strrchr(prof_site[i].file, '/');
+        prof_show_counter(filename == NULL ? prof_site[i].file : filename+1, prof_site[i].line, &prof_site[i].counter);
+    }
+    prof_show_counter("other delays", 0, &prof_site_other);
+}
+
+// Summarize as awake ms and wakes, followed by total ms and count for each activity that has data
+void prof_summary(char *buffer, uint16_t length) {
+    int i;
+    char item[32];
+    bool fFirst = true;
+
+    snprintf(buffer, length, "a%lu w%lu", prof_awake_ms(), prof_wakes);
+    for (i=0; i<PROF_SLOTS; i++) {
+        if (prof_slot[i].count == 0)
+            continue;
+        sprintf(item, "%s%s%lu/%lu", fFirst ? "|" : ",", prof_names[i],
+                (uint32_t) (prof_slot[i].cycles / (PROF_CYCLES_PER_US*1000)), prof_slot[i].count);
+        if (strlen(buffer) + strlen(item) >= length)
+            return;
+        strlcat(buffer, item, length);
+        fFirst = false;
+    }
+}
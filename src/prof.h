@@ -0,0 +1,47 @@
+// Copyright 2017 Inca Roads LLC.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef PROF_H__
+#define PROF_H__
+
+#include "nrf_delay.h"
+
+// Profiled activities.  CPU time is measured in DWT cycles, and so handler time is inclusive
+// of any ISRs that happened to preempt the handler while it was running.
+#define PROF_SCHED          0   // app_sched_execute, in total
+#define PROF_TT_TIMER       1   // primary app timer
+#define PROF_SENSOR_POLL    2
+#define PROF_COMM_POLL      3
+#define PROF_SENSOR_TIMER   4   // sensor and group poll timers
+#define PROF_UART_SWITCH    5   // UART mux switch timer
+#define PROF_CMDBUF         6   // scheduled command processing
+#define PROF_MOTION         7   // scheduled motion event
+#define PROF_ISR_UART       8
+#define PROF_ISR_GPIO       9
+#define PROF_ISR_BLE        10
+#define PROF_ISR_TWI        11
+#define PROF_DELAY          12  // all blocking delays, which are also tracked per call site
+#define PROF_SLOTS          13
+
+// Number of distinct nrf_delay_ms call sites tracked, after which they're lumped together
+#define PROF_DELAY_SITES    12
+
+#ifdef BOOTLOADERX
+#define prof_begin() 0
+#define prof_end(slot, began) ((void) (began))
+#define prof_delay_ms(ms) nrf_delay_ms(ms)
+#else
+void prof_init(void);
+uint32_t prof_begin(void);
+void prof_end(uint16_t slot, uint32_t began);
+void prof_sleep_begin(void);
+void prof_sleep_end(void);
+void prof_delay(const char *file, uint16_t line, uint32_t ms);
+#define prof_delay_ms(ms) prof_delay(__FILE__, __LINE__, ms)
+void prof_show(void);
+void prof_clear(void);
+void prof_summary(char *buffer, uint16_t length);
+#endif
+
+#endif // PROF_H__
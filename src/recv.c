@@ -16,6 +16,7 @@
 #include "phone.h"
 #include "misc.h"
 #include "io.h"
+#include "evlog.h"
 
 // Commands
 #define CMD_RESTART "restart"
@@ -33,6 +34,8 @@
 #define CMD_DFU "dfu"
 #define CMD_DFUWITHCFG "dfu "
 #define CMD_DOWN "down"
+#define CMD_EVLOG "evlog"
+#define CMD_EVLOGWITHPAGES "evlog "
 
 // Process a received message from the service
 void recv_message_from_service(char *message) {
@@ -77,6 +80,13 @@ void recv_message_from_service(char *message) {
     } else if (strcmp(message, CMD_HELLO) == 0) {
         comm_initiate_service_update(true);
         return;
+    } else if (memcmp(message, CMD_EVLOG, strlen(CMD_EVLOG)) == 0) {
+        uint16_t pages = 1;
+        if (memcmp(message, CMD_EVLOGWITHPAGES, strlen(CMD_EVLOGWITHPAGES)) == 0)
+            pages = atoi(&message[strlen(CMD_EVLOGWITHPAGES)]);
+        evlog_upload_request(pages);
+        comm_initiate_service_update(false);
+        return;
     } else if (strcmp(message, CMD_DOWN) == 0) {
         comm_force_cell();
         return;
@@ -87,3 +97,13 @@ void recv_message_from_service(char *message) {
     storage_save(true);
     io_request_restart();
 }
+
+// Process a received binary config from the service
+bool recv_config_from_service(uint8_t *config, uint16_t length) {
+    DEBUG_PRINTF("RECEIVED: %d-byte config\n", length);
+    if (!storage_set_config_as_binary(config, length))
+        return false;
+    storage_save(true);
+    io_request_restart();
+    return true;
+}
@@ -6,6 +6,7 @@
 #define RECV_H__
 
 void recv_message_from_service(char *message);
+bool recv_config_from_service(uint8_t *config, uint16_t length);
 
 #endif // RECV_H__
 
@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "debug.h"
 #include "config.h"
 #include "comm.h"
@@ -36,7 +37,11 @@
 #include "pb_decode.h"
 #include "app_scheduler.h"
 #include "stats.h"
+#include "evlog.h"
 #include "battery.h"
+#include "compact.h"
+#include "prof.h"
+#include "energy.h"
 
 #ifndef FONA
 #define TINYBUFFERS
@@ -59,6 +64,7 @@ static uint8_t buff_data[250];
 static uint8_t buff_hdr[250];
 static uint8_t buff_data[2500];
 #endif
+#define BUFF_MAX_MESSAGES (sizeof(buff_hdr) - (sizeof(buff_hdr[0]) + sizeof(buff_hdr[1])))
 static bool buff_initialized = false;
 static uint8_t *buff_pdata;
 static uint16_t buff_hdr_used;
@@ -72,6 +78,28 @@ static uint16_t buff_pop_data_left;
 static uint16_t buff_pop_data_used;
 static uint16_t buff_pop_hdr_used;
 static uint16_t buff_pop_response_type;
+static uint16_t buff_seq;
+static bool buff_seq_initialized = false;
+
+// Change-triggered upload dead bands, by field
+#define DEADBAND_CPM0       0
+#define DEADBAND_CPM1       1
+#define DEADBAND_PMS        2
+#define DEADBAND_OPC        3
+#define DEADBAND_ENV_TEMP   4
+#define DEADBAND_ENV_HUM    5
+#define DEADBAND_ENC_TEMP   6
+#define DEADBAND_BAT        7
+#define DEADBAND_FIELDS     8
+typedef struct {
+    float band;
+    bool percent;
+    bool sent;
+    float last;
+    uint32_t last_time;
+} deadband_t;
+static deadband_t deadband[DEADBAND_FIELDS];
+static uint32_t deadband_heartbeat_seconds = DEADBAND_HEARTBEAT_MINUTES*60;
 
 // MTU-related
 static uint16_t mtu_test = 0;
@@ -79,10 +107,21 @@ static uint32_t mtu_count = 0;
 static uint16_t mtu_max = 0;
 static char mtu_failure[128] = "";
 
-// Stamp-related fields
-static bool stamp_message_valid = false;
+// Stamp-related fields.  We remember several stamps so that a device that alternates between
+// locations, or between stats and readings, can keep applying whichever the service already has.
+#define STAMP_CACHE_ENTRIES 4
+typedef struct {
+    bool valid;
+    uint32_t id;
+    uint32_t last_used;
+    bool has_location;
+    bool has_motion_began_offset;
+    bool has_test;
+} stamp_t;
+static stamp_t stamp_cache[STAMP_CACHE_ENTRIES];
+static stamp_t *stamp_last_created = NULL;
+static uint32_t stamp_use_count = 0;
 static uint32_t stamp_message_id;
-static ttproto_Telecast stamp_message;
 static uint32_t mobile_session_time_offset;     // uses the same base date/time as captured_date
 
 // Stamp version number.  The service needs to provide
@@ -93,7 +132,11 @@ static uint32_t mobile_session_time_offset;     // uses the same base date/time
 // STAMP_VERSION == 1
 //  Required Fields that are always cached: latitude, longitude, captured_at_date, captured_at_time
 //  Optional Fields that are cached if present: altitude
-#define STAMP_VERSION   1
+// STAMP_VERSION == 2
+//  Same fields as version 1, however the stamp ID is a CRC32 of the binary field values rather
+//  than of their text, and the device may have several stamps outstanding at once, so the
+//  service must retain more than just the most recent stamp for each device.
+#define STAMP_VERSION   2
 
 // Is this capable of being stamped?
 bool stampable(ttproto_Telecast *message) {
@@ -108,26 +151,56 @@ bool stampable(ttproto_Telecast *message) {
     return true;
 }
 
+// Append a 32-bit value, little-endian, to a hash buffer
+uint8_t *stamp_hash_u32(uint8_t *p, uint32_t value) {
+    *p++ = (uint8_t) value;
+    *p++ = (uint8_t) (value >> 8);
+    *p++ = (uint8_t) (value >> 16);
+    *p++ = (uint8_t) (value >> 24);
+    return p;
+}
+
 // Get the stamp ID of a message.  Don't call this unless it's stampable.
 uint32_t stamp_id(ttproto_Telecast *message) {
-    char buffer[64];
+    uint8_t buffer[16];
+    uint8_t *p = buffer;
+    uint32_t bits;
+
+    p = stamp_hash_u32(p, message->captured_at_date);
+    p = stamp_hash_u32(p, message->captured_at_time);
 
     // Only include lat/lon when present and NOT in mobile mode
-    if (message->has_latitude && message->has_longitude && sensor_op_mode() != OPMODE_MOBILE)
-        sprintf(buffer, "%f,%f,%lu,%lu",
-                message->latitude,
-                message->longitude,
-                message->captured_at_date,
-                message->captured_at_time);
-    else
-        sprintf(buffer, "%lu,%lu",
-                message->captured_at_date,
-                message->captured_at_time);
+    if (message->has_latitude && message->has_longitude && sensor_op_mode() != OPMODE_MOBILE) {
+        memcpy(&bits, &message->latitude, sizeof(bits));
+        p = stamp_hash_u32(p, bits);
+        memcpy(&bits, &message->longitude, sizeof(bits));
+        p = stamp_hash_u32(p, bits);
+    }
 
-    return(crc32_compute((uint8_t *)buffer, strlen(buffer), NULL));
+    return(crc32_compute(buffer, p - buffer, NULL));
 
 }
 
+// Find a cached stamp by ID
+stamp_t *stamp_find(uint32_t id) {
+    for (int i=0; i<STAMP_CACHE_ENTRIES; i++)
+        if (stamp_cache[i].valid && stamp_cache[i].id == id)
+            return &stamp_cache[i];
+    return NULL;
+}
+
+// Find the cache entry to replace, preferring an unused one and otherwise the least recently used
+stamp_t *stamp_victim() {
+    stamp_t *victim = &stamp_cache[0];
+    for (int i=0; i<STAMP_CACHE_ENTRIES; i++) {
+        if (!stamp_cache[i].valid)
+            return &stamp_cache[i];
+        if (stamp_cache[i].last_used < victim->last_used)
+            victim = &stamp_cache[i];
+    }
+    return victim;
+}
+
 // Create a stamp from the stamp fields
 bool stamp_create(ttproto_Telecast *message) {
     static uint32_t mobile_session_id = 12345;          // init to something unlikely
@@ -155,10 +228,18 @@ bool stamp_create(ttproto_Telecast *message) {
         // cover the (very rare) case where the server admin purges stamps
         uint32_t message_id = stamp_id(message);
 
-        // Save the stamp info locally
+        // Save the stamp info locally, reusing its entry if we already have it
+        stamp_t *stamp = stamp_find(message_id);
+        if (stamp == NULL)
+            stamp = stamp_victim();
+        stamp->valid = true;
+        stamp->id = message_id;
+        stamp->last_used = ++stamp_use_count;
+        stamp->has_location = message->has_latitude || message->has_longitude;
+        stamp->has_motion_began_offset = message->has_motion_began_offset;
+        stamp->has_test = message->has_test;
+        stamp_last_created = stamp;
         stamp_message_id = message_id;
-        stamp_message = *message;
-        stamp_message_valid = true;
 
         // Apply the stamp metadata so that the service stores it
         message->stamp = stamp_message_id;
@@ -171,32 +252,36 @@ bool stamp_create(ttproto_Telecast *message) {
     return false;
 }
 
-// Invalidate the saved stamp
+// Invalidate the stamp that was just created, because it never made it to the service
 void stamp_invalidate() {
-    stamp_message_valid = false;
+    if (stamp_last_created != NULL)
+        stamp_last_created->valid = false;
+    stamp_last_created = NULL;
 }
 
-// Apply a stamp to the current message if its fields matche the last transmitted stamp,
+// Apply a stamp to the current message if its fields match any stamp known to the service
 bool stamp_apply(ttproto_Telecast *message) {
 
-    if (stamp_message_valid && stampable(message)) {
-        if (stamp_id(message) == stamp_message_id) {
+    if (stampable(message)) {
+        stamp_t *stamp = stamp_find(stamp_id(message));
+        if (stamp != NULL) {
 
             // Apply the stamp
-            message->stamp = stamp_message_id;
+            stamp->last_used = ++stamp_use_count;
+            message->stamp = stamp->id;
             message->has_stamp = true;
 
             // Remove the fields that are cached on the service
             message->has_captured_at_date = false;
             message->has_captured_at_time = false;
-            if (stamp_message.has_latitude || stamp_message.has_longitude) {
+            if (stamp->has_location) {
                 message->has_latitude = false;
                 message->has_longitude = false;
                 message->has_altitude = false;
             }
-            if (stamp_message.has_motion_began_offset)
+            if (stamp->has_motion_began_offset)
                 message->has_motion_began_offset = false;
-            if (stamp_message.has_test)
+            if (stamp->has_test)
                 message->has_test = false;
 
             return true;
@@ -220,8 +305,8 @@ void send_buff_reset() {
     // which we will ultimately copy into the buffer before doing
     // the UDP I/O.
     buff_data_used = 0;
-    buff_data_left = sizeof(buff_data) - sizeof(buff_hdr);
-    buff_data_base = buff_data + sizeof(buff_hdr);
+    buff_data_left = sizeof(buff_data) - (sizeof(buff_hdr) + BUFF_SEQ_BYTES);
+    buff_data_base = buff_data + (sizeof(buff_hdr) + BUFF_SEQ_BYTES);
     buff_pdata = buff_data_base;
     buff_response_type = REPLY_NONE;
 
@@ -230,20 +315,20 @@ void send_buff_reset() {
 
 }
 
-// Determine if we should avoid filling any more, out of caution
+// Determine if there's no room for a message of the anticipated length.  Because batches are
+// split into MTU-sized frames when transmitted, the buffer may be filled to its exact capacity.
 bool send_buff_is_full(uint16_t anticipated) {
 
     // Initialize if we've never done so
     if (!buff_initialized)
         send_buff_reset();
 
-    // The "buffer left" is just a bit smaller than the
-    // full buffer, just to be conservative.
-    uint16_t max_buffer_size = sizeof(buff_data) - 250;
+    // Full if the header has no room for another length byte
+    if (buff_hdr[1] >= BUFF_MAX_MESSAGES)
+        return true;
 
-    // If we've already overflowed, indicate so
-    uint16_t hdr_anticipated = buff_hdr_used + (anticipated ? 1 : 0);
-    if ((hdr_anticipated + buff_data_used + anticipated) > max_buffer_size)
+    // Full if the data area has no room for the message itself
+    if (anticipated > buff_data_left)
         return true;
 
     // There's room
@@ -264,20 +349,91 @@ bool send_buff_is_empty() {
 }
 
 
-// Prepare the buff for writing
-uint8_t *send_buff_prepare_for_transmit(uint16_t *lenptr, uint16_t *response_type_ptr) {
+// Determine how many of the oldest buffered messages fit within a frame of at most limit bytes
+uint8_t send_buff_frame_count(uint16_t limit) {
+    uint16_t framed = sizeof(buff_hdr[0]) + sizeof(buff_hdr[1]);
+    uint8_t count;
+    for (count=0; count<buff_hdr[1]; count++) {
+        uint16_t len = buff_hdr[sizeof(buff_hdr[0])+sizeof(buff_hdr[1])+count];
+        if ((framed + 1 + len) > limit)
+            break;
+        framed += 1 + len;
+    }
+    return count;
+}
+
+// Frame the oldest count buffered messages for writing, which is possible in-place because the
+// messages are contiguous and room is always reserved in front of them for the header.
+uint8_t *send_buff_prepare_frame(uint8_t count, uint16_t *lenptr) {
+    uint8_t *lens = &buff_hdr[sizeof(buff_hdr[0])+sizeof(buff_hdr[1])];
+    uint16_t data_size = 0;
+    for (int i=0; i<count; i++)
+        data_size += lens[i];
 
     // Copy the header to be contiguous with the data
-    uint8_t count = buff_hdr[1];
     uint8_t header_size = sizeof(buff_hdr[0]) + sizeof(buff_hdr[1]) + count;
     uint8_t *header = buff_data_base - header_size;
-    memcpy(header, buff_hdr, header_size);
+    header[0] = buff_hdr[0];
+    header[1] = count;
+    memcpy(&header[2], lens, count);
 
     // Return the pointer to the buffer and length to be transmitted
     if (lenptr != NULL)
-        *lenptr = header_size + buff_data_used;
+        *lenptr = header_size + data_size;
+    return header;
+
+}
+
+// Remove the oldest count buffered messages, once they've been transmitted
+void send_buff_consume(uint8_t count) {
+
+    // If that's everything, start afresh
+    if (count >= buff_hdr[1]) {
+        send_buff_reset();
+        return;
+    }
+
+    // Shift the remaining messages and their lengths down
+    uint8_t *lens = &buff_hdr[sizeof(buff_hdr[0])+sizeof(buff_hdr[1])];
+    uint16_t data_size = 0;
+    for (int i=0; i<count; i++)
+        data_size += lens[i];
+    memmove(buff_data_base, buff_data_base + data_size, buff_data_used - data_size);
+    memmove(lens, &lens[count], buff_hdr[1] - count);
+    buff_hdr[1] -= count;
+    buff_hdr_used -= count;
+    buff_pdata -= data_size;
+    buff_data_used -= data_size;
+    buff_data_left += data_size;
+
+}
+
+// Prepare the whole buff for writing
+uint8_t *send_buff_prepare_for_transmit(uint16_t *lenptr, uint16_t *response_type_ptr) {
     if (response_type_ptr != NULL)
         *response_type_ptr = buff_response_type;
+    return send_buff_prepare_frame(buff_hdr[1], lenptr);
+}
+
+// Convert a buffer returned by send_buff_prepare_for_transmit into a sequenced buffer,
+// which is possible in-place because room is always reserved in front of the header.
+uint8_t *send_buff_sequence(uint8_t *header, uint16_t *lenptr) {
+
+    // Start at a random sequence number so that the service won't mistake
+    // batches sent after a restart for duplicates of those sent before it.
+    if (!buff_seq_initialized) {
+        buff_seq = io_get_random(0);
+        buff_seq_initialized = true;
+    }
+
+    // Insert the sequence number between the format byte and the count
+    header -= BUFF_SEQ_BYTES;
+    header[0] = BUFF_FORMAT_PB_ARRAY_SEQ;
+    header[1] = (uint8_t) (buff_seq & 0xff);
+    header[2] = (uint8_t) ((buff_seq >> 8) & 0xff);
+    buff_seq++;
+    if (lenptr != NULL)
+        *lenptr += BUFF_SEQ_BYTES;
     return header;
 
 }
@@ -294,7 +450,7 @@ bool send_buff_append(uint8_t *ptr, uint8_t len, uint16_t response_type) {
         return false;
 
     // Exit if we've appended too many
-    if (buff_hdr[1] >= (sizeof(buff_hdr) - (sizeof(buff_hdr[0]) + sizeof(buff_hdr[1])) ))
+    if (buff_hdr[1] >= BUFF_MAX_MESSAGES)
         return false;
 
     // Exit if the body of the buffer is full
@@ -341,6 +497,19 @@ uint16_t send_length_buffered() {
     return(sizeof(buff_hdr[0]) + sizeof(buff_hdr[1]) + buff_hdr[1] + buff_data_used);
 }
 
+// Length of the largest frame that must go out in one piece, which is the biggest
+// buffered message framed on its own with room for a sequence number
+uint16_t send_largest_buffered() {
+    uint16_t largest = 0;
+    uint8_t *lens = &buff_hdr[sizeof(buff_hdr[0])+sizeof(buff_hdr[1])];
+    for (int i=0; i<buff_hdr[1]; i++)
+        if (lens[i] > largest)
+            largest = lens[i];
+    if (largest == 0)
+        return 0;
+    return(sizeof(buff_hdr[0]) + sizeof(buff_hdr[1]) + 1 + largest + BUFF_SEQ_BYTES);
+}
+
 // Revert the most recent successful append
 void send_buff_append_revert() {
 
@@ -350,7 +519,7 @@ void send_buff_append_revert() {
     buff_data_used = buff_pop_data_used;
     buff_data_left = buff_pop_data_left;
     buff_response_type = buff_pop_response_type;
-    DEBUG_PRINTF("Revert: %sb buffered.\n", send_length_buffered());
+    DEBUG_PRINTF("Revert: %db buffered.\n", send_length_buffered());
 
 }
 
@@ -364,6 +533,209 @@ void send_mtu_test(uint16_t start_length) {
     mtu_test = start_length;
 }
 
+// Load the dead bands from sensor params, in the form "db.cpm=10/db.pm=2/db.temp=0.5/db.hum=2/db.bat=0.05/db.hb=60",
+// where cpm is a percentage, and where fields that aren't mentioned always upload.
+void send_deadband_params() {
+    float cpm, pm, temp, hum, bat, hb;
+    char *psp = storage()->sensor_params;
+    cpm = pm = temp = hum = bat = 0.0;
+    hb = DEADBAND_HEARTBEAT_MINUTES;
+    while (*psp != '\0') {
+#define deadband_prefix "db."
+        if (memcmp(psp, deadband_prefix, sizeof(deadband_prefix)-1) == 0) {
+            psp += sizeof(deadband_prefix)-1;
+            char *name = psp;
+            while (*psp != '\0' && *psp != '=' && *psp != '/')
+                psp++;
+            if (*psp == '=') {
+                uint16_t namelen = psp - name;
+                float v = strtof(psp+1, &psp);
+                if (namelen == 3 && memcmp(name, "cpm", 3) == 0)
+                    cpm = v;
+                else if (namelen == 2 && memcmp(name, "pm", 2) == 0)
+                    pm = v;
+                else if (namelen == 4 && memcmp(name, "temp", 4) == 0)
+                    temp = v;
+                else if (namelen == 3 && memcmp(name, "hum", 3) == 0)
+                    hum = v;
+                else if (namelen == 3 && memcmp(name, "bat", 3) == 0)
+                    bat = v;
+                else if (namelen == 2 && memcmp(name, "hb", 2) == 0)
+                    hb = v;
+            }
+        }
+        // Skip to the next parameter
+        while (*psp != '\0')
+            if (*psp++ == '/')
+                break;
+    }
+    deadband[DEADBAND_CPM0].band = deadband[DEADBAND_CPM1].band = cpm;
+    deadband[DEADBAND_CPM0].percent = deadband[DEADBAND_CPM1].percent = true;
+    deadband[DEADBAND_PMS].band = deadband[DEADBAND_OPC].band = pm;
+    deadband[DEADBAND_ENV_TEMP].band = deadband[DEADBAND_ENC_TEMP].band = temp;
+    deadband[DEADBAND_ENV_HUM].band = hum;
+    deadband[DEADBAND_BAT].band = bat;
+    deadband_heartbeat_seconds = (hb < 1.0) ? 60 : (uint32_t) (hb * 60);
+}
+
+// Determine whether a field with a dead band has moved outside of it since it was last sent
+bool send_deadband_moved(uint16_t field, float value) {
+    deadband_t *d = &deadband[field];
+    float delta;
+    if (!d->sent || d->band <= 0.0)
+        return false;
+    delta = (value > d->last) ? (value - d->last) : (d->last - value);
+    if (d->percent) {
+        float base = (d->last > 0.0) ? d->last : 1.0;
+        return ((delta * 100.0 / base) >= d->band);
+    }
+    return (delta >= d->band);
+}
+
+// Determine whether or not a field has moved far enough, or long enough ago, that it should be sent
+bool send_deadband_exceeded(uint16_t field, float value) {
+    deadband_t *d = &deadband[field];
+    if (!d->sent || d->band <= 0.0)
+        return true;
+    if (!WouldSuppress(&d->last_time, deadband_heartbeat_seconds))
+        return true;
+    return send_deadband_moved(field, value);
+}
+
+// Remember the value of a field that has just been sent
+void send_deadband_sent(uint16_t field, float value) {
+    deadband_t *d = &deadband[field];
+    d->sent = true;
+    d->last = value;
+    d->last_time = get_seconds_since_boot();
+}
+
+// Clear sensor measurements that have been consumed, either by sending them or by
+// deciding that they needn't be sent.
+void send_clear_measurements(bool fGeiger, bool fPMS, bool fOPC, bool fEnv, bool fEnc,
+                             bool fBatteryVoltage, bool fBatterySOC, bool fBatteryCurrent) {
+#ifdef GEIGERX
+    if (fGeiger)
+        s_geiger_clear_measurement();
+#endif
+#ifdef PMSX
+    if (fPMS)
+        s_pms_clear_measurement();
+#endif
+#ifdef SPIOPC
+    if (fOPC)
+        s_opc_clear_measurement();
+#endif
+#ifdef TWIHIH6130
+    if (fEnv)
+        s_hih6130_clear_measurement();
+#endif
+#ifdef TWIBME0
+    if (fEnv)
+        s_bme280_0_clear_measurement();
+#endif
+#ifdef TWIBME1
+    if (fEnc)
+        s_bme280_1_clear_measurement();
+#endif
+#ifdef TWIMAX17043
+    if (fBatteryVoltage)
+        s_max43_voltage_clear_measurement();
+    if (fBatterySOC)
+        s_max43_soc_clear_measurement();
+#endif
+#ifdef TWIINA219
+    if (fBatteryCurrent)
+        s_ina_clear_measurement();
+#endif
+#ifdef TWIMAX17201
+    if (fBatteryCurrent)
+        s_max01_clear_measurement();
+#endif
+}
+
+// Apply the dead bands as soon as something has been measured.  Measurements of classes whose
+// fields haven't moved are discarded right away so that they don't wake up comms, and if any
+// field has moved outside of its dead band we ask for it to be uploaded without waiting.
+void send_deadband_measured() {
+    bool fMoved = false;
+    bool fGeiger = false, fPMS = false, fOPC = false, fEnv = false, fEnc = false, fBattery = false;
+
+    if (sensor_op_mode() != OPMODE_NORMAL)
+        return;
+
+#ifdef GEIGERX
+    bool isGeiger0, isGeiger1;
+    uint32_t cpm0, cpm1;
+    s_geiger_get_value(&isGeiger0, &cpm0, &isGeiger1, &cpm1);
+    if (isGeiger0 || isGeiger1) {
+        fGeiger = !(isGeiger0 && send_deadband_exceeded(DEADBAND_CPM0, (float) cpm0))
+            && !(isGeiger1 && send_deadband_exceeded(DEADBAND_CPM1, (float) cpm1));
+        fMoved |= (isGeiger0 && send_deadband_moved(DEADBAND_CPM0, (float) cpm0))
+            || (isGeiger1 && send_deadband_moved(DEADBAND_CPM1, (float) cpm1));
+    }
+#endif
+#ifdef PMSX
+    uint16_t pms_pm02_5;
+#if defined(PMS2003) || defined(PMS3003)
+    if (s_pms_get_value(NULL, &pms_pm02_5, NULL, NULL, NULL, NULL)) {
+#else
+    if (s_pms_get_value(NULL, &pms_pm02_5, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL)) {
+#endif
+        fPMS = !send_deadband_exceeded(DEADBAND_PMS, (float) pms_pm02_5);
+        fMoved |= send_deadband_moved(DEADBAND_PMS, (float) pms_pm02_5);
+    }
+#endif
+#ifdef SPIOPC
+    float opc_pm02_5;
+    if (s_opc_get_value(NULL, &opc_pm02_5, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL)) {
+        fOPC = !send_deadband_exceeded(DEADBAND_OPC, opc_pm02_5);
+        fMoved |= send_deadband_moved(DEADBAND_OPC, opc_pm02_5);
+    }
+#endif
+#if defined(TWIHIH6130) || defined(TWIBME0)
+    float envTempC, envHumRH;
+#ifdef TWIHIH6130
+    if (s_hih6130_get_value(&envTempC, &envHumRH)) {
+#else
+    if (s_bme280_0_get_value(&envTempC, &envHumRH, NULL)) {
+#endif
+        fEnv = !send_deadband_exceeded(DEADBAND_ENV_TEMP, envTempC)
+            && !send_deadband_exceeded(DEADBAND_ENV_HUM, envHumRH);
+        fMoved |= send_deadband_moved(DEADBAND_ENV_TEMP, envTempC)
+            || send_deadband_moved(DEADBAND_ENV_HUM, envHumRH);
+    }
+#endif
+#ifdef TWIBME1
+    float encTempC;
+    if (s_bme280_1_get_value(&encTempC, NULL, NULL)) {
+        fEnc = !send_deadband_exceeded(DEADBAND_ENC_TEMP, encTempC);
+        fMoved |= send_deadband_moved(DEADBAND_ENC_TEMP, encTempC);
+    }
+#endif
+#if defined(TWIMAX17043) || defined(TWIMAX17201) || defined(TWIINA219)
+    float batteryVoltage;
+#if defined(TWIINA219)
+    if (s_ina_get_value(&batteryVoltage, NULL, NULL)) {
+#elif defined(TWIMAX17201)
+    if (s_max01_get_value(&batteryVoltage, NULL, NULL)) {
+#else
+    if (s_max43_voltage_get_value(&batteryVoltage)) {
+#endif
+        fBattery = !send_deadband_exceeded(DEADBAND_BAT, batteryVoltage);
+        fMoved |= send_deadband_moved(DEADBAND_BAT, batteryVoltage);
+    }
+#endif
+
+    if (fGeiger || fPMS || fOPC || fEnv || fEnc || fBattery) {
+        stats()->deadband_suppressed++;
+        send_clear_measurements(fGeiger, fPMS, fOPC, fEnv, fEnc, fBattery, fBattery, fBattery);
+    }
+    if (fMoved)
+        comm_oneshot_now();
+
+}
+
 // Transmit a  message to the service, or suppress it if too often
 bool send_update_to_service(uint16_t UpdateType) {
     char *StatType = "";
@@ -406,8 +778,12 @@ bool send_update_to_service(uint16_t UpdateType) {
     if (sensor_op_mode() == OPMODE_TEST_BURN)
         fUploadParticleCounts = true;
 
+    // Determine whether a single unbuffered update may go out in compact format, in which case
+    // even a super low MTU has room for particle counts.
+    bool fCompact = fLimitedMTU && !fBuffered && !isStatsRequest && ((storage()->flags & FLAG_COMPACT) != 0);
+
     // If we're in a super low MTU mode, don't upload particle counts
-    if (fBadlyLimitedMTU)
+    if (fBadlyLimitedMTU && !fCompact)
         fUploadParticleCounts = false;
 
     // We keep all these outside of conditional compilation purely for code readability
@@ -717,6 +1093,37 @@ bool send_update_to_service(uint16_t UpdateType) {
             StatType = "sensor";
             break;
 
+        case UPDATE_STATS_CONFIG_BIN: {
+            // Only what has changed, and only as much as will fit alongside the header fields
+            uint16_t room = comm_get_mtu() > 32 ? comm_get_mtu() - 32 : 0;
+            if (room > sizeof(message.stats_config.bytes))
+                room = sizeof(message.stats_config.bytes);
+            message.stats_config.size = storage_get_config_as_binary(message.stats_config.bytes, room, true);
+            message.has_stats_config = (message.stats_config.size != 0);
+            StatType = "config";
+            break;
+        }
+
+        case UPDATE_STATS_DELTA: {
+            uint16_t room = comm_get_mtu() > 32 ? comm_get_mtu() - 32 : 0;
+            if (room > sizeof(message.stats_delta.bytes))
+                room = sizeof(message.stats_delta.bytes);
+            message.stats_delta.size = stats_get_delta_as_binary(message.stats_delta.bytes, room);
+            message.has_stats_delta = (message.stats_delta.size != 0);
+            StatType = "delta";
+            break;
+        }
+
+        case UPDATE_STATS_EVLOG: {
+            uint16_t room = comm_get_mtu() > 32 ? comm_get_mtu() - 32 : 0;
+            if (room > sizeof(message.stats_evlog.bytes))
+                room = sizeof(message.stats_evlog.bytes);
+            message.stats_evlog.size = evlog_get_upload(message.stats_evlog.bytes, room);
+            message.has_stats_evlog = (message.stats_evlog.size != 0);
+            StatType = "evlog";
+            break;
+        }
+
         case UPDATE_STATS_LABEL:
             message.has_stats_device_label = storage_get_device_label_as_string(message.stats_device_label, sizeof(message.stats_device_label));
             StatType = "label";
@@ -909,6 +1316,14 @@ bool send_update_to_service(uint16_t UpdateType) {
                     message.stats_motion_events = stp->motion_events;
                     message.has_stats_motion_events = true;
                 }
+                if (!fLimitedMTU) {
+                    comm_latency_summary(message.stats_latency, sizeof(message.stats_latency));
+                    message.has_stats_latency = (message.stats_latency[0] != '\0');
+                    prof_summary(message.stats_profile, sizeof(message.stats_profile));
+                    message.has_stats_profile = true;
+                    energy_summary(message.stats_energy, sizeof(message.stats_energy));
+                    message.has_stats_energy = (message.stats_energy[0] != '\0');
+                }
             }
             StatType = "stats";
             break;
@@ -1195,6 +1610,23 @@ bool send_update_to_service(uint16_t UpdateType) {
 
         if (send_buff_is_empty()) {
 
+            // Substitute the compact encoding if it's enabled and if it is indeed smaller.  It is
+            // encoded into the unused tail of the buffer, which is only worthwhile if it would be
+            // smaller than what's already there, and then moved down over the protocol buffer.
+            uint8_t *xmit_buff = buffer;
+            if (fCompact) {
+                uint16_t room = sizeof(buffer) - bytes_written;
+                if (room > bytes_written - 1)
+                    room = bytes_written - 1;
+                uint16_t compact_length = compact_encode(&message, &buffer[bytes_written], room);
+                if (compact_length != 0) {
+                    if (debug(DBG_COMM_MAX))
+                        DEBUG_PRINTF("Compact: %db instead of %db\n", compact_length, bytes_written);
+                    memmove(buffer, &buffer[bytes_written], compact_length);
+                    bytes_written = compact_length;
+                }
+            }
+
             // If this is larger than allowable MTU, don't bother
             if (bytes_written > comm_get_mtu() && !send_mtu_test_in_progress()) {
 
@@ -1203,7 +1635,7 @@ bool send_update_to_service(uint16_t UpdateType) {
             } else {
 
                 // If the buffer is empty, just send a single PB to the service
-                fSent = send_to_service(buffer, bytes_written, responseType, SEND_1);
+                fSent = send_to_service(xmit_buff, bytes_written, responseType, SEND_1);
 
             }
 
@@ -1213,10 +1645,8 @@ bool send_update_to_service(uint16_t UpdateType) {
             fSent = send_buff_append(buffer, bytes_written, responseType);
 
             // Regardless of whether or not it succeeded, we must transmit what's in the buffer
-            // so that we don't get stuck forever with a full buffer.  Prepare for transmission
-            // by fetching length and the requested response type.
-            uint16_t send_response_type;
-            uint8_t *xmit_buff = send_buff_prepare_for_transmit(&bytes_written, &send_response_type);
+            // so that we don't get stuck forever with a full buffer.
+            uint16_t send_response_type = buff_response_type;
 
             // Determine whether or not we're being instructed to choose "efficient" or "reliable"
             // transport of buffered messages.  Neither is ideal; they both have tradeoffs.
@@ -1225,27 +1655,64 @@ bool send_update_to_service(uint16_t UpdateType) {
             // will be lost  If we sent "reliably" via TCP or HTTP, the bandwidth costs more.
             // By default, we'll send them reliably.  We do so by leveraging the side-effect
             // that we know a reliable transport is used when requesting a reply from the service.
+            // Alternatively, if instructed to do so, we get UDP's efficiency without its risk
+            // by sequencing the batch and holding it in flash until the service acks it.
+            bool fAcked = false;
             if (send_response_type == REPLY_NONE) {
-                if (!(storage()->flags & FLAG_BUFFERED_EFFICIENT))
+                if ((storage()->flags & FLAG_BUFFERED_ACKED) != 0 && db_enabled())
+                    fAcked = true;
+                else if (!(storage()->flags & FLAG_BUFFERED_EFFICIENT))
                     send_response_type = REPLY_TTSERVE;
             }
 
-            // If this is longer than the allowed mtu, don't even bother.
-            if (bytes_written > comm_get_mtu() && !send_mtu_test_in_progress()) {
+            // Frame only as many of the oldest messages as fit within the MTU, leaving the rest
+            // buffered for the next transmission rather than discarding the whole batch.
+            uint16_t frame_limit = send_mtu_test_in_progress() ? 0xffff : comm_get_mtu();
+            if (fAcked) {
+                if (frame_limit > DB_ENTRY_BYTES)
+                    frame_limit = DB_ENTRY_BYTES;
+                frame_limit -= BUFF_SEQ_BYTES;
+            }
+            uint8_t frame_count = send_buff_frame_count(frame_limit);
+
+            // If the oldest message can never fit, discard it alone
+            if (frame_count == 0) {
 
                 fMTUFailure = true;
-                send_buff_reset();
+                send_buff_prepare_frame(1, &bytes_written);
+                send_buff_consume(1);
 
             } else {
 
-                // Transmit the entire batch of buffered samples
-                if (send_to_service(xmit_buff, bytes_written, send_response_type, SEND_N)) {
-                    send_buff_reset();
-                } else {
-                    // If error AND if the append had succeeded, revert it
-                    if (fSent)
+                // Queue a sequenced frame to flash, from which a later comms update will send it once
+                // the write has committed.  Only one entry can be written at a time, so any further frames
+                // stay buffered in RAM until a later update finds the flash free, and we don't burn a
+                // sequence number while it isn't.
+                if (fAcked) {
+                    bool fQueued = false;
+                    if (db_can_put()) {
+                        uint8_t *xmit_buff = send_buff_prepare_frame(frame_count, &bytes_written);
+                        xmit_buff = send_buff_sequence(xmit_buff, &bytes_written);
+                        fQueued = db_put(xmit_buff, bytes_written, REPLY_NONE);
+                        if (fQueued)
+                            send_buff_consume(frame_count);
+                    }
+                    if (!fQueued && fSent)
                         send_buff_append_revert();
                 }
+
+                // Transmit a frame of buffered samples
+                else {
+                    uint8_t *xmit_buff = send_buff_prepare_frame(frame_count, &bytes_written);
+                    if (send_to_service(xmit_buff, bytes_written, send_response_type, SEND_N)) {
+                        send_buff_consume(frame_count);
+                    } else {
+                        // If error AND if the append had succeeded, revert it
+                        if (fSent)
+                            send_buff_append_revert();
+                    }
+                }
+
             }
 
         }
@@ -1320,6 +1787,9 @@ bool send_update_to_service(uint16_t UpdateType) {
         }
     }
 
+    if (fMTUFailure || fSent)
+        evlog3(EV_SEND, UpdateType, bytes_written, fMTUFailure ? 3 : (fBuffered ? 2 : 1));
+
     if (fMTUFailure || fSent || debug(DBG_COMM_MAX))
         DEBUG_PRINTF("%s %s\n", fMTUFailure ? "FAIL" : (fSent ? (fBuffered ? "BUFF" : "SENT") : "WAIT"), sent_msg);
 
@@ -1335,45 +1805,53 @@ bool send_update_to_service(uint16_t UpdateType) {
         return false;
     }
 
-    // Clear them once transmitted successfully
+    // Remember what was sent, so that we can tell when it next changes
+    if (!fMTUFailure) {
 #ifdef GEIGERX
-    if (isGeiger0DataAvailable || isGeiger1DataAvailable)
-        s_geiger_clear_measurement();
+        if (isGeiger0DataAvailable)
+            send_deadband_sent(DEADBAND_CPM0, (float) cpm0);
+        if (isGeiger1DataAvailable)
+            send_deadband_sent(DEADBAND_CPM1, (float) cpm1);
 #endif
 #ifdef PMSX
-    if (isPMSDataAvailable)
-        s_pms_clear_measurement();
+        if (isPMSDataAvailable)
+            send_deadband_sent(DEADBAND_PMS, (float) pms_pm02_5);
 #endif
 #ifdef SPIOPC
-    if (isOPCDataAvailable)
-        s_opc_clear_measurement();
+        if (isOPCDataAvailable)
+            send_deadband_sent(DEADBAND_OPC, opc_pm02_5);
 #endif
-#ifdef TWIHIH6130
-    if (isEnvDataAvailable)
-        s_hih6130_clear_measurement();
-#endif
-#ifdef TWIBME0
-    if (isEnvDataAvailable)
-        s_bme280_0_clear_measurement();
+#if defined(TWIHIH6130) || defined(TWIBME0)
+        if (isEnvDataAvailable) {
+            send_deadband_sent(DEADBAND_ENV_TEMP, envTempC);
+            send_deadband_sent(DEADBAND_ENV_HUM, envHumRH);
+        }
 #endif
 #ifdef TWIBME1
-    if (isEncDataAvailable)
-        s_bme280_1_clear_measurement();
-#endif
-#ifdef TWIMAX17043
-    if (isBatteryVoltageDataAvailable)
-        s_max43_voltage_clear_measurement();
-    if (isBatterySOCDataAvailable)
-        s_max43_soc_clear_measurement();
+        if (isEncDataAvailable)
+            send_deadband_sent(DEADBAND_ENC_TEMP, encTempC);
 #endif
-#ifdef TWIINA219
-    if (isBatteryCurrentDataAvailable)
-        s_ina_clear_measurement();
-#endif
-#ifdef TWIMAX17201
-    if (isBatteryCurrentDataAvailable)
-        s_max01_clear_measurement();
+#if defined(TWIMAX17043) || defined(TWIMAX17201) || defined(TWIINA219)
+        if (isBatteryVoltageDataAvailable)
+            send_deadband_sent(DEADBAND_BAT, batteryVoltage);
 #endif
+        if (UpdateType == UPDATE_STATS_CONFIG_BIN)
+            storage_config_binary_sent();
+        if (message.has_stats_delta)
+            stats_delta_sent();
+        if (message.has_stats_evlog)
+            evlog_upload_sent();
+    }
+
+    // Clear them once transmitted successfully
+    send_clear_measurements(isGeiger0DataAvailable || isGeiger1DataAvailable,
+                            isPMSDataAvailable,
+                            isOPCDataAvailable,
+                            isEnvDataAvailable,
+                            isEncDataAvailable,
+                            isBatteryVoltageDataAvailable,
+                            isBatterySOCDataAvailable,
+                            isBatteryCurrentDataAvailable);
 
     return true;
 
@@ -1386,6 +1864,8 @@ void mtu_status_check(bool fVerbose) {
     if (stats()->mtu_failures) {
         DEBUG_PRINTF("** %ld MTU fails: %s\n", stats()->mtu_failures, mtu_failure);
     }
+    if (fVerbose && stats()->deadband_suppressed)
+        DEBUG_PRINTF("Dead band suppressed %ld updates\n", stats()->deadband_suppressed);
 }
 
 // Transmit a binary message to the service on the currently-active transport, even
@@ -1406,7 +1886,10 @@ bool send_to_service_unconditionally(uint8_t *buffer, uint16_t length, uint16_t
 
     // If the request format is to "send 1", we need to reformat it to be a "batch send" request because
     // that's the only format that we support as of March 2017.  We do this by using the send buffer, which
-    // we know isn't in use.
+    // we know isn't in use.  A compact Telecast identifies itself by its own format byte, and so
+    // it is sent as-is.
+    if (RequestFormat == SEND_1 && buffer[0] == BUFF_FORMAT_COMPACT)
+        RequestFormat = SEND_N;
     if (RequestFormat == SEND_1) {
         send_buff_reset();
         send_buff_append(buffer, length, RequestType);
@@ -11,6 +11,25 @@
 #define BUFF_FORMAT_PB_ARRAY        0
 #define BUFF_FORMAT_SINGLE_PB       8
 
+// Sequenced PB array, sent via UDP and held in flash until acknowledged.  The header
+// is the same as BUFF_FORMAT_PB_ARRAY except that a 16-bit little-endian sequence number
+// follows the format byte.  The service acknowledges with BUFF_FORMAT_ACK, followed by
+// the sequence number being acknowledged and a bitmap byte in which bit N acknowledges
+// sequence number + 1 + N, so that one ack can cover a window of batches.
+#define BUFF_FORMAT_PB_ARRAY_SEQ    1
+#define BUFF_FORMAT_ACK             2
+#define BUFF_SEQ_BYTES              2
+#define BUFF_ACK_LENGTH             4
+
+// A single compact fixed-point Telecast (see compact.h), sent unbuffered on very limited MTU links
+#define BUFF_FORMAT_COMPACT         3
+
+// Binary config sent by the service in place of the text cfgXXX commands.  The format byte is
+// followed by the 32-bit little-endian address of the target device, and then by the binary
+// config as described in storage.h.
+#define BUFF_FORMAT_CONFIG          4
+#define BUFF_CONFIG_HEADER          5
+
 // Statistic upload modes
 #define UPDATE_NORMAL           0
 #define UPDATE_STATS            1
@@ -28,7 +47,18 @@
 #define UPDATE_STATS_BATTERY    13
 #define UPDATE_STATS_MODULES    14
 #define UPDATE_STATS_ERRORS     15
+#define UPDATE_STATS_CONFIG_BIN 16
+#define UPDATE_STATS_DELTA      17
+#define UPDATE_STATS_EVLOG      18
 bool send_update_to_service(uint16_t UpdateType);
+void send_clear_measurements(bool fGeiger, bool fPMS, bool fOPC, bool fEnv, bool fEnc,
+                             bool fBatteryVoltage, bool fBatterySOC, bool fBatteryCurrent);
+
+// Change-triggered uploads
+void send_deadband_params();
+bool send_deadband_exceeded(uint16_t field, float value);
+void send_deadband_measured();
+void send_deadband_sent(uint16_t field, float value);
 
 // Send modes
 #define SEND_1             0
@@ -46,5 +76,8 @@ void send_mtu_test(uint16_t start_length);
 void mtu_status_check(bool fForce);
 bool send_buff_is_full(uint16_t anticipated);
 bool send_buff_is_empty();
+uint16_t send_length_buffered();
+uint16_t send_largest_buffered();
+uint8_t *send_buff_sequence(uint8_t *header, uint16_t *lenptr);
 
 #endif // SEND_H__
@@ -32,6 +32,7 @@
 #include "nrf_delay.h"
 #include "custom_board.h"
 #include "battery.h"
+#include "prof.h"
 
 #define GPS_SENSOR_GROUP "g-ugps"
 
@@ -61,6 +62,9 @@ static bool fTestModeRequested = false;
 static bool fInit = false;
 void sensor_init();
 
+// Set when a measurement completes, so that the poller applies the upload dead bands
+static bool fDeadbandCheckNeeded = false;
+
 // Get the time suppression
 uint16_t sensor_get_mobile_upload_period() {
     return mobile_period;
@@ -175,6 +179,7 @@ void sensor_measurement_completed(sensor_t *s) {
         return;
     s->state.is_completed = true;
     s->state.is_polling_valid = false;
+    fDeadbandCheckNeeded = true;
     if (debug(DBG_SENSOR))
         DEBUG_PRINTF("%s measured\n", s->name);
 }
@@ -268,6 +273,7 @@ bool sensor_schedule_now() {
             g->state.last_repeated = 0;
         }
     }
+    timer_wake();
     DEBUG_PRINTF("Sensor timings have been accelerated.\n");
     return true;
 }
@@ -278,6 +284,7 @@ bool sensor_group_schedule_now(char *gname) {
     if (g == NULL)
         return false;
     g->state.last_repeated = 0;
+    timer_wake();
     return true;
 }
 
@@ -431,7 +438,11 @@ uint16_t group_repeat_seconds(group_t *g) {
     if (bat_status == BAT_TEST)
         return (repeat_seconds/2);
 
-    return(repeat_seconds);
+    // Stretch or shrink the interval according to the power budget
+    uint32_t planned_seconds = battery_plan_interval(repeat_seconds);
+    if (planned_seconds > 65535)
+        planned_seconds = 65535;
+    return((uint16_t) planned_seconds);
 }
 
 // Show the entire sensor state
@@ -523,11 +534,11 @@ void sensor_show_state(bool fVerbose) {
                     strcat(buff, " when twi avail");
                     strcat(buffp, "T");
                 }
-                if (g->uart_required != UART_NONE && gpio_current_uart() != UART_NONE) {
+                if (g->uart_required != UART_NONE && !gpio_uart_available(g->uart_required)) {
                     strcat(buff, " when UART avail");
                     strcat(buffp, "U");
                 }
-                if (comm_uart_switching_allowed() && g->uart_requested != UART_NONE && gpio_current_uart() != UART_NONE) {
+                if (comm_uart_switching_allowed() && g->uart_requested != UART_NONE && !gpio_uart_available(g->uart_requested)) {
                     strcat(buff, " when UART avail");
                     strcat(buffp, "U");
                 }
@@ -587,6 +598,62 @@ void sensor_set_pin_state(uint16_t pin, bool enable) {
         gpio_power_set(pin, enable);
 }
 
+// Advance the state machine as soon as a UART that a group is awaiting has been switched in
+void sensor_uart_ready(uint16_t which) {
+    sensor_poll();
+}
+
+// Dispatch a group's poll timer, accounting for the time it takes
+void sensor_group_timer_handler(void *p_context) {
+    group_t *g = (group_t *) p_context;
+    uint32_t began = prof_begin();
+    g->poll_handler(g);
+    prof_end(PROF_SENSOR_TIMER, began);
+}
+
+// Dispatch a sensor's poll timer, accounting for the time it takes
+void sensor_timer_handler(void *p_context) {
+    sensor_t *s = (sensor_t *) p_context;
+    uint32_t began = prof_begin();
+    s->poll_handler(s);
+    prof_end(PROF_SENSOR_TIMER, began);
+}
+
+// Register a deadline for the next group whose repeat interval will expire, but only if all
+// groups are quiescent.  Groups that would be skipped anyway don't hold back the deadline.
+void sensor_register_deadline() {
+    group_t **gp, *g;
+    uint32_t now, elapsed, repeat, seconds;
+
+    if (fTestModeRequested || sensor_op_mode() != OPMODE_NORMAL || sensor_group_busy())
+        return;
+
+    now = get_seconds_since_boot();
+    seconds = TT_TICKLESS_MAX_SECONDS;
+    for (gp = &sensor_groups[0]; (g = *gp) != END_OF_LIST; gp++) {
+        if (!g->state.is_configured)
+            continue;
+        if (g->state.is_processing || g->state.is_settling)
+            return;
+        if (g->skip_handler != NO_HANDLER && g->skip_handler(g))
+            continue;
+        if ((battery_status() & g->active_battery_status) == 0)
+            continue;
+        if ((comm_mode() & g->active_comm_mode) == 0)
+            continue;
+        if (g->state.last_repeated == 0)
+            return;
+        elapsed = now - g->state.last_repeated;
+        repeat = group_repeat_seconds(g);
+        if (elapsed >= repeat)
+            return;
+        if (repeat - elapsed < seconds)
+            seconds = repeat - elapsed;
+    }
+
+    timer_deadline(TIMER_DEADLINE_SENSOR, seconds);
+}
+
 // Poll, advancing the state machine
 void sensor_poll() {
     static int inside_poll = 0;
@@ -631,6 +698,12 @@ void sensor_poll() {
     if (debug(DBG_SENSOR_SUPERDUPERMAX))
         DEBUG_PRINTF("sensor_poll enter\n");
 
+    // Now that we're outside of the sensor's own completion handling, apply the dead bands to what it measured
+    if (fDeadbandCheckNeeded) {
+        fDeadbandCheckNeeded = false;
+        send_deadband_measured();
+    }
+
     // Loop over all configured sensors in all configured groups
     groups_currently_active = 0;
 
@@ -719,8 +792,8 @@ void sensor_poll() {
                 continue;
             }
 
-            // If this sensor group requires a uart, but the UART is busy, skip the group
-            if (g->uart_required != UART_NONE && gpio_current_uart() != UART_NONE) {
+            // If this sensor group requires a uart, but the UART is busy and can't be lent, skip the group
+            if (g->uart_required != UART_NONE && !gpio_uart_available(g->uart_required)) {
                 if (debug(DBG_SENSOR_SUPERDUPERMAX))
                     DEBUG_PRINTF("Skipping %s because the required UART is busy.\n", g->name);
                 continue;
@@ -728,7 +801,7 @@ void sensor_poll() {
 
             // If this sensor group requests a uart (but is allowed to run without it if
             // it CAN'T be granted), but the UART is busy, skip the group
-            if (comm_uart_switching_allowed() && g->uart_requested != UART_NONE && gpio_current_uart() != UART_NONE) {
+            if (comm_uart_switching_allowed() && g->uart_requested != UART_NONE && !gpio_uart_available(g->uart_requested)) {
                 if (debug(DBG_SENSOR_SUPERDUPERMAX))
                     DEBUG_PRINTF("Skipping %s because the requested UART is busy.\n", g->name);
                 continue;
@@ -773,16 +846,33 @@ void sensor_poll() {
                 g->power_set(g->power_set_parameter, true);
                 g->state.is_powered_on = true;
                 // Delay a bit before proceeding to do anything at all
-                nrf_delay_ms(MAX_NRF_DELAY_MS);
+                prof_delay_ms(MAX_NRF_DELAY_MS);
                 if (debug(DBG_SENSOR_MAX))
                     DEBUG_PRINTF("%s power ON\n", g->name);
             }
 
-            // Select the UART if one is required or requested
+            // Select the UART if one is required or requested, and wait for the switch to
+            // complete before initializing the sensors
             if (g->uart_required != UART_NONE)
-                gpio_uart_select(g->uart_required);
+                g->state.is_awaiting_uart = gpio_uart_request(g->uart_required, sensor_uart_ready);
             if (comm_uart_switching_allowed() && g->uart_requested != UART_NONE)
-                gpio_uart_select(g->uart_requested);
+                g->state.is_awaiting_uart = gpio_uart_request(g->uart_requested, sensor_uart_ready);
+            g->state.is_initializing = true;
+
+        }
+
+        // Are we waiting to initialize the sensors?
+        if (g->state.is_processing && g->state.is_initializing) {
+            groups_currently_active++;
+
+            // If the UART is still being switched in, come back on the next poll
+            if (g->state.is_awaiting_uart && gpio_uart_switching()) {
+                if (debug(DBG_SENSOR_SUPERDUPERMAX))
+                    DEBUG_PRINTF("%s awaiting UART\n", g->name);
+                continue;
+            }
+            g->state.is_awaiting_uart = false;
+            g->state.is_initializing = false;
 
             // Call the sensor power-on init functions
             for (sp = &g->sensors[0]; (s = *sp) != END_OF_LIST; sp++) {
@@ -894,7 +984,7 @@ void sensor_poll() {
         }
 
         // Is it time to do some processing?
-        if (g->state.is_processing && !g->state.is_settling) {
+        if (g->state.is_processing && !g->state.is_initializing && !g->state.is_settling) {
             groups_currently_active++;
 
             if (debug(DBG_SENSOR_SUPERDUPERMAX))
@@ -1025,9 +1115,9 @@ void sensor_poll() {
 
             // Deselect the UART if one was selected
             if (g->uart_required != UART_NONE)
-                gpio_uart_select(UART_NONE);
+                gpio_uart_release(g->uart_required);
             if (comm_uart_switching_allowed() && g->uart_requested != UART_NONE)
-                gpio_uart_select(UART_NONE);
+                gpio_uart_release(g->uart_requested);
 
             // Power OFF the module
             if (g->power_set != NO_HANDLER) {
@@ -1080,6 +1170,9 @@ void sensor_poll() {
         }
     }
 
+    // Tell the timer how long we can sleep before the next group is due
+    sensor_register_deadline();
+
     // Done
 
     if (debug(DBG_SENSOR_SUPERDUPERMAX))
@@ -1097,6 +1190,9 @@ void sensor_init() {
     STORAGE *c = storage();
     uint32_t init_time = get_seconds_since_boot();
 
+    // Load the upload dead bands, which are also in the sensor parameters
+    send_deadband_params();
+
     // Loop over all sensors in all sensor groups
     for (gp = &sensor_groups[0]; (g = *gp) != END_OF_LIST; gp++) {
 
@@ -1127,8 +1223,8 @@ void sensor_init() {
             if (*pgn == '\0' && *psp == '.') {
                 // See if it's a subfield that we recognize
 #define repeat_field ".r="
-                if (memcmp(psp, repeat_field, sizeof(repeat_field)) == 0) {
-                    psp += sizeof(repeat_field);
+                if (memcmp(psp, repeat_field, sizeof(repeat_field)-1) == 0) {
+                    psp += sizeof(repeat_field)-1;
                     uint16_t v = (uint16_t) strtol(psp, &psp, 0);
                     if (debug(DBG_SENSOR))
                         DEBUG_PRINTF("%s override repeat with %d minutes\n", g->name, v);
@@ -1170,7 +1266,7 @@ void sensor_init() {
         if (g->poll_handler != NO_HANDLER) {
             memset(&g->state.group_timer.timer_data, 0, sizeof(g->state.group_timer.timer_data));
             g->state.group_timer.timer_id = &g->state.group_timer.timer_data;
-            app_timer_create(&g->state.group_timer.timer_id, APP_TIMER_MODE_REPEATED, g->poll_handler);
+            app_timer_create(&g->state.group_timer.timer_id, APP_TIMER_MODE_REPEATED, sensor_group_timer_handler);
             // Start it at init if we're polling continuously
             if (g->poll_continuously) {
                 app_timer_start(g->state.group_timer.timer_id, APP_TIMER_TICKS(g->poll_repeat_milliseconds, APP_TIMER_PRESCALER), g);
@@ -1208,7 +1304,7 @@ void sensor_init() {
             if (s->poll_handler != NO_HANDLER) {
                 memset(&s->state.sensor_timer.timer_data, 0, sizeof(s->state.sensor_timer.timer_data));
                 s->state.sensor_timer.timer_id = &s->state.sensor_timer.timer_data;
-                app_timer_create(&s->state.sensor_timer.timer_id, APP_TIMER_MODE_REPEATED, s->poll_handler);
+                app_timer_create(&s->state.sensor_timer.timer_id, APP_TIMER_MODE_REPEATED, sensor_timer_handler);
                 // Start it at init if we're polling continuously
                 if (s->poll_continuously) {
                     app_timer_start(s->state.sensor_timer.timer_id, APP_TIMER_TICKS(s->poll_repeat_milliseconds, APP_TIMER_PRESCALER), s);
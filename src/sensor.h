@@ -81,6 +81,8 @@ struct group_state_s {
     bool is_requesting_deconfiguration;
     bool is_settling;
     bool is_processing;
+    bool is_initializing;
+    bool is_awaiting_uart;
     bool is_polling_valid;
     bool is_powered_on;
     bool is_being_tested;
@@ -157,6 +159,8 @@ typedef struct group_s group_t;
 
 // Misc
 void sensor_poll();
+void sensor_register_deadline(void);
+void sensor_uart_ready(uint16_t which);
 void sensor_show_state(bool fVerbose);
 void sensor_measurement_completed(sensor_t *s);
 void sensor_unconfigure(sensor_t *s);
@@ -14,6 +14,7 @@
 #include "app_uart.h"
 #include "serial.h"
 #include "gpio.h"
+#include "prof.h"
 
 #ifdef LORA
 #include "lora.h"
@@ -113,7 +114,7 @@ void serial_send_byte(uint8_t databyte) {
         // case.  (Note that at 9600 baud, it takes roughly 1ms to transmit
         // a single character - so this is quite a generous delay at that or faster
         // baud rates.)
-        nrf_delay_ms(2);
+        prof_delay_ms(2);
 
         // Transmit, and we're done if it's successful
         if (app_uart_put(databyte) == NRF_SUCCESS) {
@@ -199,6 +200,7 @@ void uart_event_handler(app_uart_evt_t *p_event) {
     if (!fSerialInit)
         return;
 
+    uint32_t began = prof_begin();
     switch (p_event->evt_type) {
 
     case APP_UART_DATA_READY: {
@@ -258,6 +260,7 @@ void uart_event_handler(app_uart_evt_t *p_event) {
     default:
         break;
     }
+    prof_end(PROF_ISR_UART, began);
 }
 #endif // DISABLE_UART
 
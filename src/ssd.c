@@ -17,6 +17,7 @@
 #include "comm.h"
 #include "io.h"
 #include "storage.h"
+#include "prof.h"
 
 #ifdef SSD
 
@@ -430,7 +431,7 @@ bool ssd1306_init() {
     // has been applied, because we've found that a number of units
     // will display garbage unless they are given sufficient time
     // to initialize themselves before taking the first TWI commands.
-    nrf_delay_ms(250);
+    prof_delay_ms(250);
 
     // Request a display reinit
     display_reinit_requested = false;
@@ -492,7 +493,7 @@ void ssd1306_display_needed(void) {
     // Removed 2017-05-24 when debugging MCU crash issues. Remove completely if still #if 0 after 6/15/2017
 #if 0
     if (!display_needed)
-        nrf_delay_ms(250);
+        prof_delay_ms(250);
 #endif
     display_needed = true;
 }
@@ -6,16 +6,98 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "debug.h"
 #include "config.h"
 #include "stats.h"
 #include "storage.h"
 #include "misc.h"
 #include "io.h"
+#include "energy.h"
+#include "timer.h"
 
 // Static statistics
 static stats_t st;
 
+// Counters reported as deltas, each of which maps onto a uint32 field of the stats
+typedef struct {
+    uint8_t key;
+    uint16_t offset;
+} statskey_t;
+#define statsfield(key, field) {key, offsetof(stats_t, field)}
+static const statskey_t statskeys[] = {
+    statsfield(STATS_KEY_TRANSMITTED, transmitted),
+    statsfield(STATS_KEY_RECEIVED, received),
+    statsfield(STATS_KEY_MESSAGES, messages),
+    statsfield(STATS_KEY_JOINS, joins),
+    statsfield(STATS_KEY_DENIES, denies),
+    statsfield(STATS_KEY_RESETS, resets),
+    statsfield(STATS_KEY_POWER_FAILS, power_fails),
+    statsfield(STATS_KEY_ANT_FAILS, ant_fails),
+    statsfield(STATS_KEY_ONESHOTS, oneshots),
+    statsfield(STATS_KEY_OVERCURRENT, overcurrent_events),
+    statsfield(STATS_KEY_MOTION, motion_events),
+    statsfield(STATS_KEY_ERR_OPC, errors_opc),
+    statsfield(STATS_KEY_ERR_PMS, errors_pms),
+    statsfield(STATS_KEY_ERR_BME0, errors_bme0),
+    statsfield(STATS_KEY_ERR_BME1, errors_bme1),
+    statsfield(STATS_KEY_ERR_LORA, errors_lora),
+    statsfield(STATS_KEY_ERR_FONA, errors_fona),
+    statsfield(STATS_KEY_ERR_GEIGER, errors_geiger),
+    statsfield(STATS_KEY_ERR_MAX01, errors_max01),
+    statsfield(STATS_KEY_ERR_UGPS, errors_ugps),
+    statsfield(STATS_KEY_ERR_TWI, errors_twi),
+    statsfield(STATS_KEY_ERR_LIS, errors_lis),
+    statsfield(STATS_KEY_ERR_SPI, errors_spi),
+    statsfield(STATS_KEY_ERR_CON_LORA, errors_connect_lora),
+    statsfield(STATS_KEY_ERR_CON_FONA, errors_connect_fona),
+    statsfield(STATS_KEY_ERR_CON_GW, errors_connect_gateway),
+    statsfield(STATS_KEY_ERR_CON_WIFI, errors_connect_wireless),
+    statsfield(STATS_KEY_ERR_CON_DATA, errors_connect_data),
+    statsfield(STATS_KEY_ERR_CON_SVC, errors_connect_service),
+    statsfield(STATS_KEY_MTU_FAILURES, mtu_failures),
+    statsfield(STATS_KEY_LORA_DELIV, lora_delivered),
+    statsfield(STATS_KEY_LORA_BUSY, lora_busy),
+    statsfield(STATS_KEY_LORA_NO_CH, lora_no_free_ch),
+    statsfield(STATS_KEY_LORA_RADIO_S, lora_radio_seconds),
+    statsfield(STATS_KEY_FONA_SESSIONS, fona_sessions),
+    statsfield(STATS_KEY_FONA_SECONDS, fona_session_seconds),
+    statsfield(STATS_KEY_FONA_COMMANDS, fona_session_commands),
+    statsfield(STATS_KEY_FONA_BILLED, fona_billed_bytes),
+    statsfield(STATS_KEY_ACKED, acked_batches),
+    statsfield(STATS_KEY_RETRANSMITS, acked_retransmits),
+    statsfield(STATS_KEY_ABANDONED, acked_abandoned),
+    statsfield(STATS_KEY_DEADBAND, deadband_suppressed),
+};
+#define STATS_KEYS (sizeof(statskeys)/sizeof(statskeys[0]))
+
+// Values of each counter as last acknowledged and as being sent, and which of them the
+// service has been told about since boot
+static uint32_t stats_sent[STATS_KEYS];
+static uint32_t stats_sending[STATS_KEYS];
+static bool stats_sent_known[STATS_KEYS];
+static bool stats_sending_known[STATS_KEYS];
+static bool stats_delta_outstanding = false;
+static uint32_t stats_delta_sent_time = 0;
+
+// Restore the stats saved before the last restart, other than those describing this boot
+void stats_init() {
+    memset(&st, 0, sizeof(st));
+    if (!storage_load_stats((uint8_t *) &st, sizeof(st)))
+        return;
+    st.last_minute = 0;
+    st.uptime_minutes = 0;
+    st.uptime_hours = 0;
+    st.uptime_days = 0;
+    st.cell_iccid[0] = '\0';
+    st.cell_cpsi[0] = '\0';
+    st.battery[0] = '\0';
+    st.module_lora[0] = '\0';
+    st.module_fona[0] = '\0';
+    DEBUG_PRINTF("Restored stats from flash\n");
+}
+
 // Update uptime stats
 void stats_update() {
     if (!ShouldSuppress(&st.last_minute, 60)) {
@@ -41,13 +123,16 @@ void stats_update() {
                 st.messages_today = 0;
                 st.joins_today = 0;
                 st.denies_today = 0;
-                // Restart the device when appropriate
+                energy_day();
+                // Restart the device when appropriate, which also checkpoints the stats
                 if (storage()->restart_days != 0 && st.uptime_days >= storage()->restart_days) {
                     storage()->uptime_days += st.uptime_days;
                     storage_save(true);
                     io_request_restart();
                 }
             }
+            if ((st.uptime_hours % STATS_CHECKPOINT_HOURS) == 0)
+                storage_save_stats();
         }
     }
 }
@@ -72,6 +157,86 @@ void stats_io(uint16_t transmitted, uint16_t received) {
     }
 }
 
+// Get the counters that have changed since last acknowledged, returning the length or 0 if
+// there's nothing to send.  A NULL buffer just measures it.  Deltas are modulo 2^32, and until
+// the service has been told about every counter since boot the values are absolute.
+uint16_t stats_get_delta_as_binary(uint8_t *buffer, uint16_t length) {
+    uint16_t used = 0;
+    uint16_t keys = 0;
+    bool fBaseline = false;
+
+    for (int i=0; i<STATS_KEYS; i++)
+        if (!stats_sent_known[i])
+            fBaseline = true;
+
+    if (buffer != NULL) {
+        if (length < 1)
+            return 0;
+        buffer[used] = STATS_DELTA_VERSION | (fBaseline ? STATS_DELTA_BASELINE : 0);
+    }
+    used++;
+
+    for (int i=0; i<STATS_KEYS; i++) {
+        uint32_t value = *(uint32_t *) ((uint8_t *) &st + statskeys[i].offset);
+        uint8_t entry[10];
+        uint16_t len;
+        stats_sending[i] = stats_sent[i];
+        stats_sending_known[i] = stats_sent_known[i];
+        // A counter that is still zero needs no baseline
+        if (!stats_sent_known[i] && value == 0) {
+            stats_sending_known[i] = true;
+            continue;
+        }
+        if (stats_sent_known[i] && value == stats_sent[i])
+            continue;
+        len = VarintEncode(entry, statskeys[i].key);
+        len += VarintEncode(&entry[len], fBaseline ? value : value - stats_sent[i]);
+        if (buffer != NULL) {
+            // Leave whatever doesn't fit for the next uplink
+            if ((used + len) > length)
+                continue;
+            memcpy(&buffer[used], entry, len);
+            stats_sending[i] = value;
+            stats_sending_known[i] = true;
+        }
+        used += len;
+        keys++;
+    }
+
+    if (keys == 0)
+        return 0;
+
+    return used;
+}
+
+// Note that the delta most recently gotten has been transmitted, and is awaiting the service's reply
+void stats_delta_sent() {
+    stats_delta_outstanding = true;
+    stats_delta_sent_time = get_seconds_since_boot();
+}
+
+// The service has replied, so remember the counters in the delta that it now knows about
+void stats_delta_acked() {
+    if (!stats_delta_outstanding)
+        return;
+    stats_delta_outstanding = false;
+    memcpy(stats_sent, stats_sending, sizeof(stats_sent));
+    memcpy(stats_sent_known, stats_sending_known, sizeof(stats_sent_known));
+}
+
+// See if we're still waiting for a reply to a delta.  If it never comes we can't know whether
+// the service applied it, so the next report re-baselines with absolute values.
+bool stats_delta_pending() {
+    if (!stats_delta_outstanding)
+        return false;
+    if ((get_seconds_since_boot() - stats_delta_sent_time) < (STATS_DELTA_ACK_MINUTES * 60L))
+        return true;
+    DEBUG_PRINTF("Stats delta unacknowledged; re-baselining\n");
+    stats_delta_outstanding = false;
+    memset(stats_sent_known, 0, sizeof(stats_sent_known));
+    return false;
+}
+
 // Quick status check
 void stats_status_check(bool fVerbose) {
     if (fVerbose) {
@@ -84,3 +249,74 @@ void stats_status_check(bool fVerbose) {
                          st.joins_fullday, st.denies_fullday);
     }
 }
+
+// Clear a histogram
+void histogram_clear(histogram_t *h) {
+    memset(h, 0, sizeof(histogram_t));
+}
+
+// Map a value to its histogram bucket
+uint16_t histogram_bucket(uint32_t value) {
+    uint16_t msb;
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+    for (msb=HIST_SUB_BITS; msb<31 && (value >> (msb+1)) != 0; msb++) ;
+    if (msb > HIST_MAX_BITS)
+        return HIST_BUCKETS-1;
+    return ((msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS) + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS-1));
+}
+
+// Get the lowest value that maps to a histogram bucket
+uint32_t histogram_bucket_value(uint16_t bucket) {
+    uint16_t msb;
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+    msb = (bucket / HIST_SUB_BUCKETS) + HIST_SUB_BITS - 1;
+    return ((uint32_t) (HIST_SUB_BUCKETS + (bucket % HIST_SUB_BUCKETS))) << (msb - HIST_SUB_BITS);
+}
+
+// Halve all counts, which is done when a count would otherwise overflow
+void histogram_decay(histogram_t *h) {
+    int i;
+    for (i=0; i<HIST_BUCKETS; i++)
+        h->count[i] = (h->count[i] + 1) / 2;
+}
+
+// Record a value into a histogram
+void histogram_record(histogram_t *h, uint32_t value) {
+    uint16_t bucket = histogram_bucket(value);
+    if (h->count[bucket] == 255)
+        histogram_decay(h);
+    h->count[bucket]++;
+    if (value > h->max)
+        h->max = value;
+}
+
+// Total number of values in a histogram
+uint32_t histogram_count(histogram_t *h) {
+    int i;
+    uint32_t total = 0;
+    for (i=0; i<HIST_BUCKETS; i++)
+        total += h->count[i];
+    return total;
+}
+
+// Get the value at or below which the given percentage of values fall.  Because
+// we only know the bucket, this returns the highest value that maps to it.
+uint32_t histogram_percentile(histogram_t *h, uint16_t percent) {
+    int i;
+    uint32_t seen = 0, target, value;
+    uint32_t total = histogram_count(h);
+    if (total == 0)
+        return 0;
+    target = ((total * percent) + 99) / 100;
+    for (i=0; i<HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= target && seen != 0)
+            break;
+    }
+    if (i >= HIST_BUCKETS-1)
+        return h->max;
+    value = histogram_bucket_value(i+1) - 1;
+    return (value > h->max ? h->max : value);
+}
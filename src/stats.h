@@ -5,6 +5,29 @@
 #ifndef STATS_H__
 #define STATS_H__
 
+// Log-bucketed histogram, for latencies and the like.  Values below HIST_SUB_BUCKETS
+// have their own bucket, and each power of two above that is split into HIST_SUB_BUCKETS
+// linear buckets, so a bucket is never wider than 1/HIST_SUB_BUCKETS of its value.
+// Counts are halved when one saturates, so the histogram favors recent history.
+#define HIST_SUB_BITS       2
+#define HIST_SUB_BUCKETS    (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS       22
+#define HIST_BUCKETS        ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+typedef struct {
+    uint8_t count[HIST_BUCKETS];
+    uint32_t max;
+} histogram_t;
+
+// Latency phases tracked per comms link
+#define COMM_PHASE_CONNECT  0
+#define COMM_PHASE_MODULE   1
+#define COMM_PHASE_REGISTER 2
+#define COMM_PHASE_ATTACH   3
+#define COMM_PHASE_SEND     4
+#define COMM_PHASE_REPLY    5
+#define COMM_PHASES         6
+#define COMM_LINKS          2
+
 // Stats structure
 struct stats_s {
     uint32_t transmitted;
@@ -61,13 +84,86 @@ struct stats_s {
     uint32_t errors_connect_service;
     uint32_t mtu_failures;
     uint32_t seqno;
+    uint32_t lora_delivered;
+    uint32_t lora_busy;
+    uint32_t lora_no_free_ch;
+    uint32_t lora_radio_seconds;
+    uint32_t fona_sessions;
+    uint32_t fona_session_seconds;
+    uint32_t fona_session_commands;
+    uint32_t fona_billed_bytes;
+    uint32_t acked_batches;
+    uint32_t acked_retransmits;
+    uint32_t acked_abandoned;
+    uint32_t deadband_suppressed;
+    histogram_t latency[COMM_LINKS][COMM_PHASES];
 };
 typedef struct stats_s stats_t;
 
+// Stats delta, a compact alternative to the absolute counters for links with a limited MTU.
+// It is a version byte followed by entries of [key][delta], each an unsigned LEB128 varint,
+// carrying only the counters that have changed since the last report that the service replied
+// to.  The first report after boot, and the first after a report that was never replied to, has
+// STATS_DELTA_BASELINE set in the version byte and carries absolute values instead, so that the
+// service can always resynchronize no matter what it did or didn't receive.
+#define STATS_DELTA_VERSION     1
+#define STATS_DELTA_BASELINE    0x80
+#define STATS_KEY_TRANSMITTED   1
+#define STATS_KEY_RECEIVED      2
+#define STATS_KEY_MESSAGES      3
+#define STATS_KEY_JOINS         4
+#define STATS_KEY_DENIES        5
+#define STATS_KEY_RESETS        6
+#define STATS_KEY_POWER_FAILS   7
+#define STATS_KEY_ANT_FAILS     8
+#define STATS_KEY_ONESHOTS      9
+#define STATS_KEY_OVERCURRENT   10
+#define STATS_KEY_MOTION        11
+#define STATS_KEY_ERR_OPC       12
+#define STATS_KEY_ERR_PMS       13
+#define STATS_KEY_ERR_BME0      14
+#define STATS_KEY_ERR_BME1      15
+#define STATS_KEY_ERR_LORA      16
+#define STATS_KEY_ERR_FONA      17
+#define STATS_KEY_ERR_GEIGER    18
+#define STATS_KEY_ERR_MAX01     19
+#define STATS_KEY_ERR_UGPS      20
+#define STATS_KEY_ERR_TWI       21
+#define STATS_KEY_ERR_LIS       22
+#define STATS_KEY_ERR_SPI       23
+#define STATS_KEY_ERR_CON_LORA  24
+#define STATS_KEY_ERR_CON_FONA  25
+#define STATS_KEY_ERR_CON_GW    26
+#define STATS_KEY_ERR_CON_WIFI  27
+#define STATS_KEY_ERR_CON_DATA  28
+#define STATS_KEY_ERR_CON_SVC   29
+#define STATS_KEY_MTU_FAILURES  30
+#define STATS_KEY_LORA_DELIV    31
+#define STATS_KEY_LORA_BUSY     32
+#define STATS_KEY_LORA_NO_CH    33
+#define STATS_KEY_LORA_RADIO_S  34
+#define STATS_KEY_FONA_SESSIONS 35
+#define STATS_KEY_FONA_SECONDS  36
+#define STATS_KEY_FONA_COMMANDS 37
+#define STATS_KEY_FONA_BILLED   38
+#define STATS_KEY_ACKED         39
+#define STATS_KEY_RETRANSMITS   40
+#define STATS_KEY_ABANDONED     41
+#define STATS_KEY_DEADBAND      42
+
 // Exports
 stats_t *stats();
+void stats_init();
 void stats_update();
+uint16_t stats_get_delta_as_binary(uint8_t *buffer, uint16_t length);
+void stats_delta_sent();
+void stats_delta_acked();
+bool stats_delta_pending();
 void stats_status_check(bool fVerbose);
 void stats_io(uint16_t transmitted, uint16_t received);
+void histogram_clear(histogram_t *h);
+void histogram_record(histogram_t *h, uint32_t value);
+uint32_t histogram_count(histogram_t *h);
+uint32_t histogram_percentile(histogram_t *h, uint16_t percent);
 
 #endif // STATS_H__
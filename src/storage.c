@@ -6,15 +6,23 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include "debug.h"
 #include "comm.h"
 #include "timer.h"
 #include "nrf_delay.h"
 #include "app_error.h"
+#include "app_util.h"
 #include "config.h"
 #include "storage.h"
+#include "gpio.h"
+#include "crc32.h"
 #include "softdevice_handler.h"
+#include "prof.h"
+#include "stats.h"
+#include "evlog.h"
+#include "app_scheduler.h"
 
 #define DEBUGSTORAGE false
 
@@ -31,23 +39,40 @@ static void tt_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result);
 #if DB_ENABLED
 static void db_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result);
 #endif
+static void stats_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result);
+static void evlog_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result);
 
 // Regardless of what it says in the doc, both priority 0 and priority 255 are reserved.
-// Higher priority number is higher address and is given allocation priority.
+// Higher priority number is higher address and is given allocation priority.  Only the relative
+// order matters, so new regions go at the lowest priority in order that existing ones don't move.
+// See storage.h for the resulting layout, all of which the bootloader must preserve.
+STATIC_ASSERT((FLASH_APP_DATA_PAGES*PHY_PAGE_SIZE_BYTES) <= FLASH_APP_DATA_RESERVED);
 FS_REGISTER_CFG(fs_config_t tt_fs_config) =
 {
     .callback  = tt_fs_event_handler,
-    .num_pages = TT_PAGES,
-    .priority = 2
+    .num_pages = TT_PAGES*TT_SLOTS,
+    .priority = 4
 };
 #if DB_ENABLED
 FS_REGISTER_CFG(fs_config_t db_fs_config) =
 {
     .callback  = db_fs_event_handler,
     .num_pages = DB_PAGES,
-    .priority = 1
+    .priority = 3
 };
 #endif
+FS_REGISTER_CFG(fs_config_t stats_fs_config) =
+{
+    .callback  = stats_fs_event_handler,
+    .num_pages = STATS_PAGES*STATS_SLOTS,
+    .priority = 2
+};
+FS_REGISTER_CFG(fs_config_t evlog_fs_config) =
+{
+    .callback  = evlog_fs_event_handler,
+    .num_pages = EVLOG_PAGES,
+    .priority = 1
+};
 
 // Retrieve the address of a page
 const uint32_t * address_of_tt_page(uint16_t page_num) {
@@ -58,6 +83,27 @@ const uint32_t * address_of_db_page(uint16_t page_num) {
     return db_fs_config.p_start_addr + (page_num * PHY_PAGE_SIZE_WORDS);
 }
 #endif
+const uint32_t * address_of_stats_slot(uint16_t slot) {
+    return stats_fs_config.p_start_addr + (slot * STATS_PAGES * PHY_PAGE_SIZE_WORDS);
+}
+const uint32_t * address_of_evlog_page(uint16_t page_num) {
+    return evlog_fs_config.p_start_addr + (page_num * PHY_PAGE_SIZE_WORDS);
+}
+
+// The end of our image in flash, being the code followed by the initializers of RAM sections
+extern uint32_t __etext;
+extern uint32_t __data_start__;
+extern uint32_t __data_end__;
+extern uint32_t __start_fs_data;
+extern uint32_t __stop_fs_data;
+
+// See if our flash regions all lie above the app, which they won't if the app has outgrown them
+static bool storage_regions_above_app() {
+    uint32_t app_end = (uint32_t) &__etext
+        + ((uint32_t) &__data_end__ - (uint32_t) &__data_start__)
+        + ((uint32_t) &__stop_fs_data - (uint32_t) &__start_fs_data);
+    return ((uint32_t) address_of_evlog_page(0) >= app_end);
+}
 #endif  // OLDSTORAGE
 
 // Storage context
@@ -85,25 +131,304 @@ void storage_sys_event_handler(uint32_t sys_evt) {
 #endif
 }
 
-// Event handler for fstorage
+// Asynchronous flash jobs.  An fstorage erase or store completes long after it is requested,
+// and flash erases stall the CPU in a way that disrupts serial I/O, so all writes are queued
+// as jobs that are started only when the uart is idle, that erase and then store their page,
+// and that only commit their effects to the in-memory state once the store has completed.
 #ifndef OLDSTORAGE
-static void tt_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result)
-{
-    if (result != FS_SUCCESS)
-    {
-        // An error occurred.
+#define FLASH_JOB_CONFIG    0
+#define FLASH_JOB_DB        1
+#define FLASH_JOB_STATS     2
+#define FLASH_JOB_EVLOG     3
+#define FLASH_JOBS          4
+#define FLASH_JOB_RETRIES   3
+#define FLASH_JOB_HOLD_SECONDS 300
+#define FLASH_IDLE          0
+#define FLASH_QUEUED        1
+#define FLASH_ERASING       2
+#define FLASH_STORING       3
+typedef struct {
+    uint16_t state;
+    uint16_t retries;
+    uint32_t queued_time;
+    // After repeated failures a job stays queued, but isn't retried until this time
+    uint32_t hold_until;
+    // FLASH_JOB_DB, or the slot for FLASH_JOB_CONFIG and FLASH_JOB_STATS, or the page
+    // and word offset for FLASH_JOB_EVLOG, where offset 0 is a page that must be erased first
+    uint16_t entry;
+    uint16_t length;
+    uint16_t request_type;
+    bool overwrite;
+} flash_job_t;
+static flash_job_t flash_job[FLASH_JOBS];
+typedef struct {
+    uint16_t jobno;
+    uint16_t result;
+} flash_event_t;
+static bool flash_config_dirty = false;
+static uint32_t flash_config_snapshot[TT_SLOT_WORDS];
+static uint16_t tt_slot = 0;
+static uint32_t tt_seq = 0;
+static bool flash_stats_dirty = false;
+static uint32_t flash_stats_snapshot[STATS_SLOT_WORDS];
+static uint16_t stats_slot = 0;
+static uint32_t stats_seq = 0;
+static uint32_t flash_evlog_chunk[EVLOG_PAGE_FIRST+EVLOG_CHUNK_WORDS];
+static uint16_t flash_evlog_words = 0;
+static uint16_t evlog_page = 0;
+static uint16_t evlog_offset = PHY_PAGE_SIZE_WORDS;
+static uint32_t evlog_seq = 0;
+#if DB_ENABLED
+static uint32_t flash_db_page[PHY_PAGE_SIZE_WORDS];
+#endif
+void storage_flash_start();
+#endif
+void storage_evlog_open();
+
+// Determine whether the uart is idle enough that flash I/O won't disrupt it.  In the case of
+// oneshot mode, this means that neither comms nor PMS are using the uart.  In the case of
+// non-oneshot mode where the uart is always busy, this just means when comms is not active.
+bool storage_uart_idle() {
+    if (comm_uart_switching_allowed())
+        return (gpio_current_uart() == UART_NONE);
+    return (!comm_is_busy());
+}
+
+// Determine whether any flash I/O is outstanding, not counting jobs held after repeated failures
+bool storage_flash_busy() {
+#ifndef OLDSTORAGE
+    for (int i=0; i<FLASH_JOBS; i++)
+        if (flash_job[i].state != FLASH_IDLE && flash_job[i].hold_until == 0)
+            return true;
+#endif
+    return false;
+}
+
+#ifndef OLDSTORAGE
+
+// Issue the next fstorage operation of a job
+fs_ret_t storage_flash_issue(uint16_t jobno) {
+    flash_job_t *job = &flash_job[jobno];
+    void *context = (void *) (uint32_t) jobno;
+
+    switch (jobno) {
+
+    case FLASH_JOB_CONFIG:
+        if (job->state == FLASH_ERASING)
+            return fs_erase(&tt_fs_config, address_of_tt_page(job->entry), TT_PAGES, context);
+        return fs_store(&tt_fs_config, address_of_tt_page(job->entry), flash_config_snapshot, TT_SLOT_WORDS, context);
+
+#if DB_ENABLED
+    case FLASH_JOB_DB: {
+        uint8_t *db = (uint8_t *) address_of_db_page(0);
+        uint32_t *page = (uint32_t *) &db[db_offset_of_page(job->entry)];
+        if (job->state == FLASH_ERASING)
+            return fs_erase(&db_fs_config, page, 1, context);
+        return fs_store(&db_fs_config, page, flash_db_page, PHY_PAGE_SIZE_WORDS, context);
+    }
+#endif
+
+    case FLASH_JOB_STATS:
+        if (job->state == FLASH_ERASING)
+            return fs_erase(&stats_fs_config, address_of_stats_slot(job->entry), STATS_PAGES, context);
+        return fs_store(&stats_fs_config, address_of_stats_slot(job->entry), flash_stats_snapshot, STATS_SLOT_WORDS, context);
+
+    case FLASH_JOB_EVLOG: {
+        uint32_t *page = (uint32_t *) address_of_evlog_page(job->entry);
+        if (job->state == FLASH_ERASING)
+            return fs_erase(&evlog_fs_config, page, 1, context);
+        if (job->length == 0)
+            return fs_store(&evlog_fs_config, page, flash_evlog_chunk, EVLOG_PAGE_FIRST+flash_evlog_words, context);
+        return fs_store(&evlog_fs_config, page + job->length, &flash_evlog_chunk[EVLOG_PAGE_FIRST], flash_evlog_words, context);
+    }
+
     }
+
+    return FS_ERR_INVALID_ARG;
+}
+
+// Commit the effects of a job whose data is now safely in flash
+void storage_flash_commit(uint16_t jobno) {
+    flash_job_t *job = &flash_job[jobno];
+
+#if DB_ENABLED
+    if (jobno == FLASH_JOB_DB) {
+        STORAGE *st = storage();
+        st->db_length[job->entry] = job->length;
+        st->db_request_type[job->entry] = job->request_type;
+        if (!job->overwrite)
+            st->db_filled++;
+        st->db_next_to_fill = (job->entry + 1) % DB_ENTRIES;
+#if DEBUGSTORAGE
+        DEBUG_PRINTF("db: committed %d-byte buff #%d (now %d in queue)\n", job->length, job->entry, st->db_filled);
+#endif
+        // The queue indices live in the config block, so it must follow
+        storage_save(true);
+    }
+#endif
+
+    // The slot just written is now the current one
+    if (jobno == FLASH_JOB_CONFIG) {
+        tt_slot = job->entry;
+        tt_seq = flash_config_snapshot[TT_SLOT_SEQ];
+    }
+
+    if (jobno == FLASH_JOB_CONFIG && flash_config_dirty) {
+        flash_config_dirty = false;
+        job->state = FLASH_QUEUED;
+        job->queued_time = get_seconds_since_boot();
+    }
+
+    if (jobno == FLASH_JOB_STATS) {
+        stats_slot = job->entry;
+        stats_seq = flash_stats_snapshot[STATS_SLOT_SEQ];
+        if (flash_stats_dirty) {
+            flash_stats_dirty = false;
+            job->state = FLASH_QUEUED;
+            job->queued_time = get_seconds_since_boot();
+        }
+    }
+
+    if (jobno == FLASH_JOB_EVLOG) {
+        if (job->length == 0) {
+            evlog_page = job->entry;
+            evlog_seq = flash_evlog_chunk[EVLOG_PAGE_SEQ];
+            job->length = EVLOG_PAGE_FIRST;
+        }
+        evlog_offset = job->length + flash_evlog_words;
+        flash_evlog_words = 0;
+    }
+
 }
+
+// Handle completion of a job's fstorage operation.  This runs at app_sched level, because
+// committing a job changes state that the main loop is using.
+void storage_flash_event_handler(void *p_event_data, uint16_t event_size) {
+    flash_event_t *event = (flash_event_t *) p_event_data;
+    uint16_t jobno = event->jobno;
+    fs_ret_t result = (fs_ret_t) event->result;
+    if (jobno >= FLASH_JOBS)
+        return;
+    flash_job_t *job = &flash_job[jobno];
+
+    // Retry the whole job from its erase if anything failed
+    if (result != FS_SUCCESS) {
+        DEBUG_PRINTF("Flash job %d error: 0x%04x\n", jobno, result);
+        evlog2(EV_FLASH_ERROR, jobno, result);
+        // Flash words can't be rewritten without an erase, so the log moves on to a fresh page
+        if (jobno == FLASH_JOB_EVLOG)
+            evlog_offset = PHY_PAGE_SIZE_WORDS;
+        // Never drop a job, because a DB entry has already been reported to its caller as stored
+        job->state = FLASH_QUEUED;
+        if (++job->retries > FLASH_JOB_RETRIES) {
+            DEBUG_PRINTF("Flash job %d held for %ds\n", jobno, FLASH_JOB_HOLD_SECONDS);
+            job->retries = 0;
+            job->hold_until = get_seconds_since_boot() + FLASH_JOB_HOLD_SECONDS;
+        }
+    } else if (job->state == FLASH_ERASING) {
+        job->state = FLASH_STORING;
+        if (storage_flash_issue(jobno) != FS_SUCCESS)
+            job->state = FLASH_QUEUED;
+        return;
+    } else {
+        job->state = FLASH_IDLE;
+#if DEBUGSTORAGE
+        DEBUG_PRINTF("Flash job %d completed in %lds\n", jobno, get_seconds_since_boot() - job->queued_time);
 #endif
+        storage_flash_commit(jobno);
+    }
+
+    // Move on to whatever is next
+    storage_flash_start();
+
+}
+
+// Called by fstorage at interrupt level, and so deferred to app_sched level
+void storage_flash_event(fs_evt_t const * const evt, fs_ret_t result) {
+    flash_event_t event;
+    event.jobno = (uint16_t) (uint32_t) evt->p_context;
+    event.result = (uint16_t) result;
+    if (app_sched_event_put(&event, sizeof(event), storage_flash_event_handler) != NRF_SUCCESS) {
+        // Without a way to get the completion to the main loop, redo the job from its erase
+        if (event.jobno < FLASH_JOBS)
+            flash_job[event.jobno].state = FLASH_QUEUED;
+    }
+}
+
+// Start the next queued job if nothing is in progress and if the uart can tolerate it
+void storage_flash_start() {
+
+    for (int i=0; i<FLASH_JOBS; i++)
+        if (flash_job[i].state == FLASH_ERASING || flash_job[i].state == FLASH_STORING)
+            return;
+
+    if (!storage_uart_idle())
+        return;
+
+    for (int i=0; i<FLASH_JOBS; i++) {
+        flash_job_t *job = &flash_job[i];
+        if (job->state != FLASH_QUEUED)
+            continue;
+        if (job->hold_until != 0 && get_seconds_since_boot() < job->hold_until)
+            continue;
+        job->hold_until = 0;
+        // Config is written from a snapshot so that it may keep changing while being written,
+        // and into the slot that isn't current so that the current one survives a power failure.
+        if (i == FLASH_JOB_CONFIG) {
+            memcpy(flash_config_snapshot, tt.data, sizeof(tt.data));
+            flash_config_snapshot[TT_SLOT_SEQ] = tt_seq + 1;
+            flash_config_snapshot[TT_SLOT_CRC] = crc32_compute((uint8_t *) flash_config_snapshot, TT_SLOT_CRC*PHY_WORD_SIZE, NULL);
+            job->entry = (tt_slot + 1) % TT_SLOTS;
+        }
+        if (i == FLASH_JOB_STATS) {
+            memset(flash_stats_snapshot, 0, sizeof(flash_stats_snapshot));
+            memcpy(flash_stats_snapshot, stats(), sizeof(stats_t));
+            flash_stats_snapshot[STATS_SLOT_HEADER] = (STATS_VERSION << 16) | sizeof(stats_t);
+            flash_stats_snapshot[STATS_SLOT_SEQ] = stats_seq + 1;
+            flash_stats_snapshot[STATS_SLOT_CRC] = crc32_compute((uint8_t *) flash_stats_snapshot, STATS_SLOT_CRC*PHY_WORD_SIZE, NULL);
+            job->entry = (stats_slot + 1) % STATS_SLOTS;
+        }
+        // The log is appended to its current page until it's full, and only then erases the next
+        if (i == FLASH_JOB_EVLOG) {
+            job->entry = evlog_page;
+            job->length = evlog_offset;
+            if (evlog_offset + flash_evlog_words > PHY_PAGE_SIZE_WORDS) {
+                job->entry = (evlog_page + 1) % EVLOG_PAGES;
+                job->length = 0;
+                flash_evlog_chunk[EVLOG_PAGE_SEQ] = evlog_seq + 1;
+                flash_evlog_chunk[EVLOG_PAGE_CHECK] = (evlog_seq + 1) ^ EVLOG_PAGE_MAGIC;
+            }
+        }
+        job->state = (i == FLASH_JOB_EVLOG && job->length != 0) ? FLASH_STORING : FLASH_ERASING;
+        if (storage_flash_issue(i) == FS_SUCCESS)
+            return;
+        DEBUG_PRINTF("Flash job %d couldn't start\n", i);
+        job->state = FLASH_QUEUED;
+    }
+
+}
+
+// Event handlers for fstorage
+static void tt_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result)
+{
+    storage_flash_event(evt, result);
+}
 #if DB_ENABLED
 static void db_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result)
 {
-    if (result != FS_SUCCESS)
-    {
-        // An error occurred.
-    }
+    storage_flash_event(evt, result);
 }
 #endif
+static void stats_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result)
+{
+    storage_flash_event(evt, result);
+}
+static void evlog_fs_event_handler(fs_evt_t const * const evt, fs_ret_t result)
+{
+    storage_flash_event(evt, result);
+}
+
+#endif // OLDSTORAGE
 
 // Persistent storage callback
 #ifdef OLDSTORAGE
@@ -183,11 +508,20 @@ void storage_init() {
         storage_set_to_default();
         return;
     }
+    // Never erase or write flash that holds our own code
+    if (!storage_regions_above_app()) {
+        DEBUG_PRINTF("Storage overlaps app, disabled\n");
+        storage_set_to_default();
+        return;
+    }
 #endif
 
     // We've successfully initialized
     storage_initialized = true;
 
+    // Pick up the event log where it left off
+    storage_evlog_open();
+
     // Load it
     initSuccess = storage_load();
 
@@ -205,9 +539,11 @@ void storage_init() {
         storage_set_to_default();
         // Write it, because we always keep the latest copy on-disk
         storage_save(true);
+#ifdef OLDSTORAGE
         // Wait a few seconds, just to make sure that when we boot
         // we have a stable state in NVRAM for subsequent boots
-        nrf_delay_ms(3000);
+        prof_delay_ms(3000);
+#endif
     }
 
 }
@@ -756,6 +1092,155 @@ void storage_set_sensor_params_as_string(char *str) {
     strlcpy(tt.storage.versions.v1.sensor_params, str, sizeof(tt.storage.versions.v1.sensor_params));
 }
 
+// Binary config keys, each of which maps onto a field of the storage block
+#define CFG_INT             0
+#define CFG_FLOAT           1
+#define CFG_STRING          2
+#define CFG_WRITEONLY       0x80
+typedef struct {
+    uint8_t key;
+    uint8_t type;
+    uint16_t offset;
+    uint16_t size;
+} cfgkey_t;
+#define cfgfield(key, type, field) {key, type, offsetof(STORAGE, field), sizeof(((STORAGE *)0)->field)}
+static const cfgkey_t cfgkeys[] = {
+    cfgfield(CFG_KEY_PRODUCT, CFG_INT, product),
+    cfgfield(CFG_KEY_FLAGS, CFG_INT, flags),
+    cfgfield(CFG_KEY_SENSORS, CFG_INT, sensors),
+    cfgfield(CFG_KEY_DEVICE_ID, CFG_INT, device_id),
+    cfgfield(CFG_KEY_DEVICE_LABEL, CFG_STRING, device_label),
+    cfgfield(CFG_KEY_ONESHOT_MINUTES, CFG_INT, oneshot_minutes),
+    cfgfield(CFG_KEY_CELL_MINUTES, CFG_INT, oneshot_cell_minutes),
+    cfgfield(CFG_KEY_STATS_MINUTES, CFG_INT, stats_minutes),
+    cfgfield(CFG_KEY_RESTART_DAYS, CFG_INT, restart_days),
+    cfgfield(CFG_KEY_WAN, CFG_INT, wan),
+    cfgfield(CFG_KEY_LPWAN_REGION, CFG_STRING, lpwan_region),
+    cfgfield(CFG_KEY_CARRIER_APN, CFG_STRING, carrier_apn),
+    cfgfield(CFG_KEY_SERVICE_ADDR, CFG_STRING, service_addr),
+    cfgfield(CFG_KEY_TTN_DEV_EUI, CFG_STRING, ttn_dev_eui),
+    cfgfield(CFG_KEY_TTN_APP_EUI, CFG_STRING|CFG_WRITEONLY, ttn_app_eui),
+    cfgfield(CFG_KEY_TTN_APP_KEY, CFG_STRING|CFG_WRITEONLY, ttn_app_key),
+    cfgfield(CFG_KEY_GPS_LATITUDE, CFG_FLOAT, gps_latitude),
+    cfgfield(CFG_KEY_GPS_LONGITUDE, CFG_FLOAT, gps_longitude),
+    cfgfield(CFG_KEY_GPS_ALTITUDE, CFG_FLOAT, gps_altitude),
+    cfgfield(CFG_KEY_SENSOR_PARAMS, CFG_STRING, sensor_params),
+    cfgfield(CFG_KEY_DFU_FILENAME, CFG_STRING, dfu_filename),
+};
+#define CFG_KEYS (sizeof(cfgkeys)/sizeof(cfgkeys[0]))
+
+// CRCs of the values of each key as last sent, and as being sent
+static uint32_t cfg_sent_crc[CFG_KEYS];
+static uint32_t cfg_sending_crc[CFG_KEYS];
+static bool cfg_sent_valid = false;
+
+// Determine the encoded length of a key's value
+static uint16_t storage_config_value_length(const cfgkey_t *k) {
+    uint8_t *value = (uint8_t *) storage() + k->offset;
+    uint16_t len = k->size;
+    if ((k->type & ~CFG_WRITEONLY) == CFG_STRING)
+        return strnlen((char *) value, k->size);
+    if ((k->type & ~CFG_WRITEONLY) == CFG_INT)
+        while (len > 0 && value[len-1] == 0)
+            len--;
+    return len;
+}
+
+// Get the binary config, optionally only the keys that have changed since last sent,
+// returning the length or 0 if there's nothing to send.  A NULL buffer just measures it.
+uint16_t storage_get_config_as_binary(uint8_t *buffer, uint16_t length, bool fDeltaOnly) {
+    uint16_t used = 0;
+    uint16_t keys = 0;
+
+    if (buffer != NULL) {
+        if (length < 1)
+            return 0;
+        buffer[used] = CFG_VERSION;
+    }
+    used++;
+
+    for (int i=0; i<CFG_KEYS; i++) {
+        const cfgkey_t *k = &cfgkeys[i];
+        if ((k->type & CFG_WRITEONLY) != 0)
+            continue;
+        uint8_t *value = (uint8_t *) storage() + k->offset;
+        uint16_t len = storage_config_value_length(k);
+        uint32_t crc = crc32_compute(value, len, NULL);
+        if (fDeltaOnly && cfg_sent_valid && crc == cfg_sent_crc[i]) {
+            cfg_sending_crc[i] = crc;
+            continue;
+        }
+        if (buffer != NULL) {
+            // A key that wouldn't fit even in an empty uplink never will, so don't let it hold up the rest
+            if ((1 + 2 + len) > length) {
+                DEBUG_PRINTF("Binary config key %d too long to send\n", k->key);
+                cfg_sending_crc[i] = crc;
+                continue;
+            }
+            // Leave whatever doesn't fit for the next uplink
+            if ((used + 2 + len) > length) {
+                cfg_sending_crc[i] = cfg_sent_valid ? cfg_sent_crc[i] : ~crc;
+                continue;
+            }
+            cfg_sending_crc[i] = crc;
+            buffer[used] = k->key;
+            buffer[used+1] = (uint8_t) len;
+            memcpy(&buffer[used+2], value, len);
+        }
+        used += 2 + len;
+        keys++;
+    }
+
+    if (keys == 0)
+        return 0;
+
+    return used;
+}
+
+// Remember the values most recently gotten as binary, once they've been sent
+void storage_config_binary_sent() {
+    memcpy(cfg_sent_crc, cfg_sending_crc, sizeof(cfg_sent_crc));
+    cfg_sent_valid = true;
+}
+
+// Apply binary config, changing only the keys that are present
+bool storage_set_config_as_binary(uint8_t *buffer, uint16_t length) {
+    uint16_t used = 1;
+    bool fChanged = false;
+
+    if (length < 1 || buffer[0] != CFG_VERSION) {
+        DEBUG_PRINTF("Unsupported binary config version\n");
+        return false;
+    }
+
+    while ((used + 2) <= length) {
+        uint8_t key = buffer[used];
+        uint8_t len = buffer[used+1];
+        uint8_t *value = &buffer[used+2];
+        used += 2 + len;
+        if (used > length)
+            return false;
+        for (int i=0; i<CFG_KEYS; i++) {
+            const cfgkey_t *k = &cfgkeys[i];
+            if (k->key != key)
+                continue;
+            uint8_t *field = (uint8_t *) storage() + k->offset;
+            uint8_t type = k->type & ~CFG_WRITEONLY;
+            // Strings must leave room for the terminator, and numbers may be shortened
+            if ((type == CFG_STRING && len >= k->size) || (type != CFG_STRING && len > k->size)) {
+                DEBUG_PRINTF("Binary config key %d too long\n", key);
+                break;
+            }
+            memset(field, 0, k->size);
+            memcpy(field, value, len);
+            fChanged = true;
+            break;
+        }
+    }
+
+    return fChanged;
+}
+
 // Load from pstorage
 bool storage_load() {
     if (storage_initialized) {
@@ -765,13 +1250,44 @@ bool storage_load() {
         pstorage_waiting = true;
         pstorage_load(tt.data, &block_0_handle, TTSTORAGE_MAX, 0);
         for (i=0; i<10 && pstorage_waiting; i++) {
-            nrf_delay_ms(500);
+            prof_delay_ms(500);
         }
         if (!pstorage_waiting && pstorage_wait_result == NRF_SUCCESS)
             return true;
 #else
-        memcpy(tt.data, (uint8_t *) address_of_tt_page(0), sizeof(tt.data));
-        return true;
+        // Use the valid slot with the most recent sequence number
+        bool found = false;
+        for (uint16_t slot=0; slot<TT_SLOTS; slot++) {
+            const uint32_t *page = address_of_tt_page(slot);
+            if (page[TT_SLOT_CRC] != crc32_compute((uint8_t *) page, TT_SLOT_CRC*PHY_WORD_SIZE, NULL))
+                continue;
+            if (found && (int32_t) (page[TT_SLOT_SEQ] - tt_seq) <= 0)
+                continue;
+            found = true;
+            tt_slot = slot;
+            tt_seq = page[TT_SLOT_SEQ];
+        }
+        if (found) {
+            memcpy(tt.data, (uint8_t *) address_of_tt_page(tt_slot), sizeof(tt.data));
+            return true;
+        }
+        // Otherwise, look for a block saved before there were slots, which had no CRC.  The flash
+        // beneath the config has moved by a page since then, so buffered readings are abandoned.
+        for (uint16_t slot=0; slot<TT_SLOTS; slot++) {
+            memcpy(tt.data, (uint8_t *) address_of_tt_page(slot), sizeof(tt.data));
+            if (tt.storage.signature_top == VALID_SIGNATURE && tt.storage.signature_bottom == VALID_SIGNATURE) {
+                DEBUG_PRINTF("Migrating params to A/B storage\n");
+                tt_slot = slot;
+                tt_seq = 0;
+#if DB_ENABLED
+                tt.storage.versions.v1.db_filled = 0;
+                tt.storage.versions.v1.db_next_to_fill = 0;
+                tt.storage.versions.v1.db_next_to_upload = 0;
+#endif
+                storage_save(true);
+                return true;
+            }
+        }
 #endif
     }
     storage_set_to_default();
@@ -781,13 +1297,21 @@ bool storage_load() {
 // Save if necessary.  Note that we utilize deferred storage saving and storage checkpointing
 // in cases where we're trying to do nvram I/O during serial I/O.  There are issues related to
 // IRQ priorities that cause serial to be interrupted during periods of flash erase, and so
-// it is best to defer the storage writes unless absolutely necessary to do synchronously.
+// this is called when the uart is idle, which is when queued flash jobs are started.  Once no
+// flash I/O is outstanding, we don't hold back a tickless timer.
 void storage_checkpoint() {
+    evlog_checkpoint();
     if (storage_save_pending)
         storage_save(true);
+#ifndef OLDSTORAGE
+    storage_flash_start();
+#endif
+    if (!storage_flash_busy())
+        timer_deadline(TIMER_DEADLINE_STORAGE, TT_TICKLESS_MAX_SECONDS);
 }
 
-// Save the in-memory storage block
+// Save the in-memory storage block.  Synchronous saves are queued immediately and deferred saves
+// wait for a checkpoint, however in either case the write completes asynchronously.
 void storage_save(bool fSynchronous) {
 
     // Allows for deferred storage I/O
@@ -802,25 +1326,173 @@ void storage_save(bool fSynchronous) {
     if (!storage_initialized)
         return;
 
-    DEBUG_PRINTF("Checkpointing flash.\n");
-
 #ifdef OLDSTORAGE
+    DEBUG_PRINTF("Checkpointing flash.\n");
     pstorage_clear(&block_0_handle, TTSTORAGE_MAX);
     pstorage_store(&block_0_handle, tt.data, TTSTORAGE_MAX, 0);
 #else
-    uint32_t err_code;
 #if DEBUGSTORAGE
-    DEBUG_PRINTF("At 0x%08lx, erase %d pages, write %d words\n", address_of_tt_page(0), TT_PAGES, TT_WORDS);
+    DEBUG_PRINTF("At 0x%08lx, erase %d pages, write %d words\n", address_of_tt_page((tt_slot + 1) % TT_SLOTS), TT_PAGES, TT_SLOT_WORDS);
+#endif
+
+    // Coalesce with a save that hasn't started yet, or follow one that is already being written
+    flash_job_t *job = &flash_job[FLASH_JOB_CONFIG];
+    if (job->state == FLASH_QUEUED)
+        return;
+    if (job->state != FLASH_IDLE) {
+        flash_config_dirty = true;
+        return;
+    }
+
+    DEBUG_PRINTF("Checkpointing flash.\n");
+    job->state = FLASH_QUEUED;
+    job->retries = 0;
+    job->queued_time = get_seconds_since_boot();
+    storage_flash_start();
 #endif
-    err_code = fs_erase(&tt_fs_config, address_of_tt_page(0), TT_PAGES, NULL);
-    if (err_code != NRF_SUCCESS)
-        DEBUG_PRINTF("Flash storage erase error: 0x%04x\n", err_code);
-    err_code = fs_store(&tt_fs_config, address_of_tt_page(0), (uint32_t *) tt.data, TT_WORDS, NULL);
-    if (err_code != NRF_SUCCESS)
-        DEBUG_PRINTF("Flash storage save error: 0x%04x\n", err_code);
 
+}
+
+// The stats must fit in their slot, else checkpointing them would silently stop
+#ifndef OLDSTORAGE
+STATIC_ASSERT(sizeof(stats_t) <= STATS_MAX);
 #endif
 
+// Queue the stats to be saved, coalescing with a save that is already pending
+void storage_save_stats() {
+#ifndef OLDSTORAGE
+    if (!storage_initialized)
+        return;
+    flash_job_t *job = &flash_job[FLASH_JOB_STATS];
+    if (job->state == FLASH_QUEUED)
+        return;
+    if (job->state != FLASH_IDLE) {
+        flash_stats_dirty = true;
+        return;
+    }
+    DEBUG_PRINTF("Checkpointing stats.\n");
+    job->state = FLASH_QUEUED;
+    job->retries = 0;
+    job->queued_time = get_seconds_since_boot();
+    storage_flash_start();
+#endif
+}
+
+// Load the stats most recently saved, if they were saved by a version with the same layout
+bool storage_load_stats(uint8_t *buffer, uint16_t length) {
+#ifndef OLDSTORAGE
+    bool found = false;
+    if (!storage_initialized || length > STATS_MAX)
+        return false;
+    for (uint16_t slot=0; slot<STATS_SLOTS; slot++) {
+        const uint32_t *page = address_of_stats_slot(slot);
+        if (page[STATS_SLOT_HEADER] != ((STATS_VERSION << 16) | length))
+            continue;
+        if (page[STATS_SLOT_CRC] != crc32_compute((uint8_t *) page, STATS_SLOT_CRC*PHY_WORD_SIZE, NULL))
+            continue;
+        if (found && (int32_t) (page[STATS_SLOT_SEQ] - stats_seq) <= 0)
+            continue;
+        found = true;
+        stats_slot = slot;
+        stats_seq = page[STATS_SLOT_SEQ];
+    }
+    if (found)
+        memcpy(buffer, (uint8_t *) address_of_stats_slot(stats_slot), length);
+    return found;
+#else
+    return false;
+#endif
+}
+
+// Determine whether the event log can accept another chunk
+bool storage_evlog_ready() {
+#ifndef OLDSTORAGE
+    return (storage_initialized && flash_job[FLASH_JOB_EVLOG].state == FLASH_IDLE);
+#else
+    return false;
+#endif
+}
+
+// Queue a chunk of events to be appended to the log
+bool storage_evlog_put(uint32_t *chunk, uint16_t words) {
+#ifndef OLDSTORAGE
+    flash_job_t *job = &flash_job[FLASH_JOB_EVLOG];
+    if (!storage_evlog_ready() || words > EVLOG_CHUNK_WORDS)
+        return false;
+    memcpy(&flash_evlog_chunk[EVLOG_PAGE_FIRST], chunk, words*PHY_WORD_SIZE);
+    flash_evlog_words = words;
+    job->state = FLASH_QUEUED;
+    job->retries = 0;
+    job->queued_time = get_seconds_since_boot();
+    storage_flash_start();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Get the sequence number of the newest page of the log, or 0 if nothing has been logged
+uint32_t storage_evlog_seq() {
+#ifndef OLDSTORAGE
+    return evlog_seq;
+#else
+    return 0;
+#endif
+}
+
+// See if a page was written by the log, rather than being erased or holding something else
+#ifndef OLDSTORAGE
+static bool storage_evlog_page_valid(const uint32_t *page) {
+    return (page[EVLOG_PAGE_SEQ] != 0xFFFFFFFF && page[EVLOG_PAGE_CHECK] == (page[EVLOG_PAGE_SEQ] ^ EVLOG_PAGE_MAGIC));
+}
+#endif
+
+// Get the page of the log with a given sequence number, if it is still in the ring
+const uint32_t *storage_evlog_page(uint32_t seq) {
+#ifndef OLDSTORAGE
+    if (!storage_initialized || seq == 0 || seq == 0xFFFFFFFF)
+        return NULL;
+    for (uint16_t i=0; i<EVLOG_PAGES; i++) {
+        const uint32_t *page = address_of_evlog_page(i);
+        if (page[EVLOG_PAGE_SEQ] == seq && storage_evlog_page_valid(page))
+            return page;
+    }
+#endif
+    return NULL;
+}
+
+// Get the number of words of a log page that have been written, by walking its chunks
+uint16_t storage_evlog_page_used(const uint32_t *page) {
+    uint16_t offset = EVLOG_PAGE_FIRST;
+    while ((offset + EVLOG_CHUNK_HEADER) <= PHY_PAGE_SIZE_WORDS && page[offset+EVLOG_CHUNK_LENGTH] != 0xFFFFFFFF) {
+        uint32_t words = EVLOG_CHUNK_HEADER + ((page[offset+EVLOG_CHUNK_LENGTH] + PHY_WORD_SIZE - 1) / PHY_WORD_SIZE);
+        if (offset + words > PHY_PAGE_SIZE_WORDS)
+            return PHY_PAGE_SIZE_WORDS;
+        offset += words;
+    }
+    return offset;
+}
+
+// Find where the log left off, which is the end of the valid page with the highest sequence number.
+// Pages that fail their check are never adopted, and because the log always erases a page before
+// moving onto it, they are erased before anything is written to them.  If none are valid, such as
+// on the first boot with a log, the next chunk starts a fresh page.
+void storage_evlog_open() {
+#ifndef OLDSTORAGE
+    bool found = false;
+    for (uint16_t i=0; i<EVLOG_PAGES; i++) {
+        const uint32_t *page = address_of_evlog_page(i);
+        if (!storage_evlog_page_valid(page))
+            continue;
+        if (found && (int32_t) (page[EVLOG_PAGE_SEQ] - evlog_seq) <= 0)
+            continue;
+        found = true;
+        evlog_page = i;
+        evlog_seq = page[EVLOG_PAGE_SEQ];
+    }
+    if (found)
+        evlog_offset = storage_evlog_page_used(address_of_evlog_page(evlog_page));
+#endif
 }
 
 // Peek at the next to be uploaded, returning its length or the buffer itself
@@ -848,6 +1520,29 @@ uint16_t db_get(uint8_t *buffer, uint16_t *length, uint16_t *request_type) {
 #endif
 }
 
+// Peek at the Nth entry beyond the next to be uploaded, returning the number of entries
+// filled.  The entry is only returned if it exists.
+uint16_t db_get_nth(uint16_t n, uint8_t *buffer, uint16_t *length, uint16_t *request_type) {
+#if defined(OLDSTORAGE) || !DB_ENABLED
+    return 0;
+#else
+    STORAGE *st = storage();
+    uint16_t entryno = (st->db_next_to_upload + n) % DB_ENTRIES;
+    uint8_t *db = (uint8_t *) address_of_db_page(0);
+    uint8_t *page = &db[db_offset_of_page(entryno)];
+    uint8_t *entry = &page[page_offset_of_entry(entryno)];
+    if (n < st->db_filled) {
+        if (buffer != NULL)
+            memcpy(buffer, entry, DB_ENTRY_BYTES);
+        if (length != NULL)
+            *length = st->db_length[entryno];
+        if (request_type != NULL)
+            *request_type = st->db_request_type[entryno];
+    }
+    return st->db_filled;
+#endif
+}
+
 // Peek at the next to be uploaded, returning its length
 void db_get_release() {
 #if defined(OLDSTORAGE) || !DB_ENABLED
@@ -871,28 +1566,42 @@ bool db_enabled() {
     return DB_ENABLED;
 }
 
+// See if db_put can accept an entry now, which it can't while the previous one is being written
+bool db_can_put() {
+#if defined(OLDSTORAGE) || !DB_ENABLED
+    return false;
+#else
+    return (flash_job[FLASH_JOB_DB].state == FLASH_IDLE);
+#endif
+}
+
 // Save these readings, using a policy of preferring OLDER
-// readings if we run out of buffering space.
+// readings if we run out of buffering space.  The readings are queued to be written,
+// and are only visible to db_get() once they have been committed to flash.
 bool db_put(uint8_t *buffer, uint16_t length, uint16_t request_type) {
 #if defined(OLDSTORAGE) || !DB_ENABLED
     return false;
 #else
-    uint32_t err_code;
     STORAGE *st = storage();
-    uint16_t db_filled = st->db_filled;
     uint16_t db_next_to_fill = st->db_next_to_fill;
 
+    // We have a single page buffer, so only one entry may be in flight at a time
+    flash_job_t *job = &flash_job[FLASH_JOB_DB];
+    if (job->state != FLASH_IDLE)
+        return false;
+
     // Back up and overwrite the most recent if we run out of room, so that
     // if there is a bad event that knocks out communications we save the data
     // that is in closest proximity to the event.
-    if (db_filled == DB_ENTRIES) {
-        db_filled--;
+    bool overwrite = false;
+    if (st->db_filled == DB_ENTRIES) {
+        overwrite = true;
         if (db_next_to_fill-- == 0)
             db_next_to_fill = DB_ENTRIES-1;
     }
 
     // Create a page buffer and replace just the entry
-    char pagebuf[PHY_PAGE_SIZE_BYTES];
+    uint8_t *pagebuf = (uint8_t *) flash_db_page;
     uint8_t *db = (uint8_t *) address_of_db_page(0);
     uint8_t *page = &db[db_offset_of_page(db_next_to_fill)];
 
@@ -900,35 +1609,21 @@ bool db_put(uint8_t *buffer, uint16_t length, uint16_t request_type) {
     DEBUG_PRINTF("Base 0x%08lx at 0x%08lx, copyoff %d, erase %d pages, write %d words\n", address_of_db_page(0), page, page_offset_of_entry(db_next_to_fill), 1, PHY_PAGE_SIZE_WORDS);
 #endif
 
-    memcpy(pagebuf, page, sizeof(pagebuf));
-    memcpy(&pagebuf[page_offset_of_entry(db_next_to_fill)], buffer, DB_ENTRY_BYTES);
+    memcpy(pagebuf, page, PHY_PAGE_SIZE_BYTES);
+    memcpy(&pagebuf[page_offset_of_entry(db_next_to_fill)], buffer, length < DB_ENTRY_BYTES ? length : DB_ENTRY_BYTES);
 
-    // Write it to flash
+    // Queue it to be written to flash, remembering what to commit when it's done
 #if DEBUGSTORAGE
-    DEBUG_PRINTF("db: queueing %d-byte buff #%d (now %d in queue)\n", length, db_next_to_fill, db_filled+1);
+    DEBUG_PRINTF("db: queueing %d-byte buff #%d\n", length, db_next_to_fill);
 #endif
-    err_code = fs_erase(&db_fs_config, (uint32_t *) page, 1, NULL);
-    if (err_code != NRF_SUCCESS) {
-        DEBUG_PRINTF("Flash storage erase error: 0x%04x\n", err_code);
-        return false;
-    }
-    err_code = fs_store(&db_fs_config, (uint32_t *) page, (uint32_t *) pagebuf, PHY_PAGE_SIZE_WORDS, NULL);
-    if (err_code != NRF_SUCCESS) {
-        DEBUG_PRINTF("Flash storage save error: 0x%04x\n", err_code);
-        return false;
-    }
-
-    // Save length and request type before bumping to the next one
-    st->db_length[db_next_to_fill] = length;
-    st->db_request_type[db_next_to_fill] = request_type;
-
-    // Now that it's successfully saved, advance the pointers and update them in storage
-    db_filled++;
-    if (++db_next_to_fill >= DB_ENTRIES)
-        db_next_to_fill = 0;
-    st->db_filled = db_filled;
-    st->db_next_to_fill = db_next_to_fill;
-    storage_save(true);
+    job->entry = db_next_to_fill;
+    job->length = length;
+    job->request_type = request_type;
+    job->overwrite = overwrite;
+    job->retries = 0;
+    job->queued_time = get_seconds_since_boot();
+    job->state = FLASH_QUEUED;
+    storage_flash_start();
     return true;
 
 #endif
@@ -57,13 +57,48 @@
 #endif
 #define PHY_PAGE_SIZE_BYTES   (PHY_PAGE_SIZE_WORDS*PHY_WORD_SIZE)
 
-// Our app's settings
+// Our app's settings, which alternate between two slots of one page apiece so that there is
+// always an intact copy in flash even if power fails during a save.  Each slot holds the block
+// followed by a sequence number and a CRC32 over both, and the valid slot with the higher
+// sequence number is the current one.
 #define TT_PAGES            1
-#define TT_WORDS            ((TTSTORAGE_MAX/PHY_WORD_SIZE)+1)
-#if (PHY_PAGE_SIZE_WORDS < TT_WORDS)
+#define TT_SLOTS            2
+#define TT_SLOT_WORDS       ((TTSTORAGE_MAX/PHY_WORD_SIZE)+2)
+#define TT_SLOT_SEQ         (TTSTORAGE_MAX/PHY_WORD_SIZE)
+#define TT_SLOT_CRC         (TTSTORAGE_MAX/PHY_WORD_SIZE+1)
+#if (PHY_PAGE_SIZE_WORDS < TT_SLOT_WORDS)
 @error Code is written assuming max of 1 physical page
 #endif
 
+// Stats, which alternate between two slots in the same way so that counters survive restarts.
+// Each slot holds the stats followed by a header of the version and length of what was saved,
+// which must match exactly for them to be restored, then a sequence number and a CRC32.
+#define STATS_MAX           2048
+#define STATS_VERSION       1
+#define STATS_SLOTS         2
+#define STATS_SLOT_WORDS    ((STATS_MAX/PHY_WORD_SIZE)+3)
+#define STATS_SLOT_HEADER   (STATS_MAX/PHY_WORD_SIZE)
+#define STATS_SLOT_SEQ      (STATS_MAX/PHY_WORD_SIZE+1)
+#define STATS_SLOT_CRC      (STATS_MAX/PHY_WORD_SIZE+2)
+#define STATS_PAGES         (((STATS_SLOT_WORDS-1)/PHY_PAGE_SIZE_WORDS)+1)
+
+// Event log, a ring of pages that are each erased only when the ring comes back around to them,
+// so that wear is spread evenly.  Each page starts with a sequence number and a check word that
+// is the sequence number xor EVLOG_PAGE_MAGIC, so that flash which held something else before the
+// log existed isn't mistaken for it.  They are followed by chunks, each of which is a word holding
+// its length in bytes, a word holding the ms since boot of its first event, and then its events
+// padded to a whole word.  Unwritten flash ends a page.
+#define EVLOG_PAGES         4
+#define EVLOG_PAGE_SEQ      0
+#define EVLOG_PAGE_CHECK    1
+#define EVLOG_PAGE_FIRST    2
+#define EVLOG_PAGE_MAGIC    0x45564c47
+#define EVLOG_CHUNK_LENGTH  0
+#define EVLOG_CHUNK_MS      1
+#define EVLOG_CHUNK_HEADER  2
+#define EVLOG_CHUNK_BYTES   256
+#define EVLOG_CHUNK_WORDS   (EVLOG_CHUNK_HEADER+(EVLOG_CHUNK_BYTES/PHY_WORD_SIZE))
+
 #if !DB_ENABLED
 // Just to allow code to compile with static buffers that are never used
 #define DB_ENTRY_BYTES      10      
@@ -79,6 +114,24 @@
 #define page_offset_of_entry(x) ((x%DB_ENTRIES_PER_PAGE)*DB_ENTRY_BYTES)
 #endif
 
+// Flash layout.  fstorage places our regions at the top of application flash, just beneath the
+// bootloader, highest priority highest, so from the top down they are:
+//   config     TT_PAGES*TT_SLOTS           2 pages (was 1 page before A/B slots)
+//   db         DB_PAGES                    3 pages
+//   stats      STATS_PAGES*STATS_SLOTS     2 pages
+//   evlog      EVLOG_PAGES                 4 pages
+// Doubling the config pushed the db down by a page, so the first boot after upgrading from the
+// single-page layout migrates the config and empties the db rather than read it from the wrong
+// place.  The bootloader must preserve all of these pages across a DFU, so its makefile sets
+// DFU_APP_DATA_RESERVED to FLASH_APP_DATA_RESERVED, and the app checks at startup that the
+// lowest region still lies above the end of its own image.
+#if DB_ENABLED
+#define FLASH_APP_DATA_PAGES ((TT_PAGES*TT_SLOTS)+DB_PAGES+(STATS_PAGES*STATS_SLOTS)+EVLOG_PAGES)
+#else
+#define FLASH_APP_DATA_PAGES ((TT_PAGES*TT_SLOTS)+(STATS_PAGES*STATS_SLOTS)+EVLOG_PAGES)
+#endif
+#define FLASH_APP_DATA_RESERVED 0xB000
+
 // This structure must never exceed the above size
 union ttstorage_ {
 
@@ -122,6 +175,12 @@ union ttstorage_ {
 #define FLAG_TEST               0x00000040
 // Flip the display upside down
 #define FLAG_FLIP               0x00000080
+// Send buffered updates via UDP, retransmitting from flash until acknowledged by the service
+#define FLAG_BUFFERED_ACKED     0x00000100
+// Send unbuffered updates on limited-MTU links in compact fixed-point format
+#define FLAG_COMPACT            0x00000200
+// When idle and stationary, wake only when a subsystem's registered deadline is due
+#define FLAG_TICKLESS           0x00000400
                 uint32_t flags;
 
 // Sensors
@@ -241,6 +300,15 @@ STORAGE *storage();
 void storage_init();
 void storage_save(bool);
 void storage_checkpoint();
+void storage_save_stats();
+bool storage_load_stats(uint8_t *buffer, uint16_t length);
+bool storage_evlog_ready();
+bool storage_evlog_put(uint32_t *chunk, uint16_t words);
+uint32_t storage_evlog_seq();
+const uint32_t *storage_evlog_page(uint32_t seq);
+uint16_t storage_evlog_page_used(const uint32_t *page);
+bool storage_uart_idle();
+bool storage_flash_busy();
 bool storage_load();
 void storage_set_to_default();
 void storage_sys_event_handler(uint32_t sys_evt);
@@ -266,9 +334,42 @@ bool storage_get_sensor_params_as_string(char *buffer, uint16_t length);
 char *storage_get_sensor_params_as_string_help();
 void storage_set_sensor_params_as_string(char *str);
 
+// Binary config, a compact alternative to the text parameters for links with a limited MTU.
+// It is a version byte followed by entries of [key][length][value], where integers and floats
+// are little-endian and may be shortened by dropping high-order zero bytes, and where strings
+// have no terminator.  Only the keys present are changed, and uplinks only carry keys whose
+// values have changed since they were last sent.
+#define CFG_VERSION             1
+#define CFG_KEY_PRODUCT         1
+#define CFG_KEY_FLAGS           2
+#define CFG_KEY_SENSORS         3
+#define CFG_KEY_DEVICE_ID       4
+#define CFG_KEY_DEVICE_LABEL    5
+#define CFG_KEY_ONESHOT_MINUTES 6
+#define CFG_KEY_CELL_MINUTES    7
+#define CFG_KEY_STATS_MINUTES   8
+#define CFG_KEY_RESTART_DAYS    9
+#define CFG_KEY_WAN             10
+#define CFG_KEY_LPWAN_REGION    11
+#define CFG_KEY_CARRIER_APN     12
+#define CFG_KEY_SERVICE_ADDR    13
+#define CFG_KEY_TTN_DEV_EUI     14
+#define CFG_KEY_TTN_APP_EUI     15
+#define CFG_KEY_TTN_APP_KEY     16
+#define CFG_KEY_GPS_LATITUDE    17
+#define CFG_KEY_GPS_LONGITUDE   18
+#define CFG_KEY_GPS_ALTITUDE    19
+#define CFG_KEY_SENSOR_PARAMS   20
+#define CFG_KEY_DFU_FILENAME    21
+uint16_t storage_get_config_as_binary(uint8_t *buffer, uint16_t length, bool fDeltaOnly);
+void storage_config_binary_sent();
+bool storage_set_config_as_binary(uint8_t *buffer, uint16_t length);
+
 uint16_t db_get(uint8_t *buffer, uint16_t *length, uint16_t *request_type);
+uint16_t db_get_nth(uint16_t n, uint8_t *buffer, uint16_t *length, uint16_t *request_type);
 void db_get_release();
 bool db_put(uint8_t *buffer, uint16_t length, uint16_t request_type);
 bool db_enabled();
+bool db_can_put();
 
 #endif
@@ -24,24 +24,36 @@
 #include "btdebug.h"
 #include "app_scheduler.h"
 #include "app_timer_appsh.h"
+#include "app_util_platform.h"
 #include "stats.h"
+#include "evlog.h"
 #include "misc.h"
 #include "ssd.h"
+#include "prof.h"
 
 // Primary app-level timers
 #define TT_SLOW_TIMER_INTERVAL APP_TIMER_TICKS((TT_SLOW_TIMER_SECONDS*1000), APP_TIMER_PRESCALER)
-#define TT_FAST_TIMER_INTERVAL APP_TIMER_TICKS((TT_FAST_TIMER_SECONDS*1000), APP_TIMER_PRESCALER)
 APP_TIMER_DEF(tt_timer);
 
-// Primary clock, maintained by the primary app timer
-// Initialize non-zero because zero is the default init value of all counters, and we want to look later than that.
-static uint32_t seconds_since_boot = 1;
-static uint32_t ticks_at_measurement = 0;
+// Primary clock, which extends the 24-bit RTC counter to a 64-bit count of ticks since boot.  The RTC
+// wraps every 512 seconds, so it must be sampled at least that often, which the primary app timer does.
+// The clock begins at a non-zero number of seconds because zero is the default init value of all counters,
+// and we want to look later than that.
+#define RTC_COUNTER_MASK 0x00FFFFFF
+static uint64_t ticks_since_boot = 0;
+static uint32_t ticks_last_counter = 0;
+static uint32_t boot_offset_seconds = 1;
 static bool tt_fast_timer_mode = false;
 static bool tt_request_timer_mode_reset = false;
+static uint32_t tt_timer_seconds = TT_SLOW_TIMER_SECONDS;
+
+// Tickless mode deadlines, in seconds since boot, which are cleared on every tick so that
+// a subsystem that doesn't re-register is polled at the normal slow interval.
+static uint32_t tt_deadline[TIMER_DEADLINES];
 
 // Date/time
 static uint32_t dt_seconds_since_boot_when_set = 0;
+static uint64_t dt_ms_since_boot_when_set = 0;
 static uint32_t dt_date = 0;
 static uint32_t dt_time = 0;
 
@@ -50,28 +62,35 @@ static char timebuf[32];;
 
 // Forwards
 void timer_refresh_mode();
+void timer_refresh_interval();
 
-// Access to our app-maintained system clock
-uint32_t get_seconds_since_boot() {
-    uint32_t ticks;
+// Monotonic RTC ticks since boot, accounting for any wrap of the counter since it was last sampled
+uint64_t get_ticks_since_boot() {
+    uint32_t counter;
+    uint64_t ticks;
 
+    CRITICAL_REGION_ENTER();
 #if defined(NSDKV10) || defined(NSDKV11)
-    app_timer_cnt_get(&ticks);
+    app_timer_cnt_get(&counter);
 #else
-    ticks = app_timer_cnt_get();
+    counter = app_timer_cnt_get();
 #endif
+    ticks_since_boot += (counter - ticks_last_counter) & RTC_COUNTER_MASK;
+    ticks_last_counter = counter;
+    ticks = ticks_since_boot;
+    CRITICAL_REGION_EXIT();
 
-    // If the clock has wrapped, just return the clock in our clock's granularity
-    if (ticks < ticks_at_measurement)
-        return seconds_since_boot;
-
-    // Compute seconds since last increment of our clock
-    uint32_t elapsed_ticks = ticks - ticks_at_measurement;
-    uint32_t elapsed_seconds = elapsed_ticks / APP_TIMER_TICKS_PER_SECOND;
+    return ticks;
+}
 
-    // Return finer-grained time
-    return (seconds_since_boot + elapsed_seconds);
+// Milliseconds since boot
+uint64_t get_ms_since_boot() {
+    return ((uint64_t) boot_offset_seconds * 1000) + ((get_ticks_since_boot() * 1000) / APP_TIMER_TICKS_PER_SECOND);
+}
 
+// Access to our app-maintained system clock
+uint32_t get_seconds_since_boot() {
+    return (boot_offset_seconds + (uint32_t) (get_ticks_since_boot() / APP_TIMER_TICKS_PER_SECOND));
 }
 
 // Set the date/time
@@ -87,7 +106,9 @@ void set_timestamp(uint32_t ddmmyy, uint32_t hhmmss) {
     // 191194 Date of fix  19 November 1994
     dt_date = ddmmyy;
     dt_time = hhmmss;
-    dt_seconds_since_boot_when_set = get_seconds_since_boot();
+    dt_ms_since_boot_when_set = get_ms_since_boot();
+    dt_seconds_since_boot_when_set = (uint32_t) (dt_ms_since_boot_when_set / 1000);
+    evlog2(EV_CLOCK, ddmmyy, hhmmss);
 
     // Just for debugging, so we can see when we actually acquire a timestamp
     uint16_t yr = (ddmmyy % 100) + 2000;
@@ -117,8 +138,9 @@ bool get_current_timestamp(uint32_t *date, uint32_t *time, uint32_t *offset) {
         *date = dt_date;
     if (time != NULL)
         *time = dt_time;
+    // Round the offset from milliseconds so that closely-spaced mobile samples don't skew by a second
     if (offset != NULL)
-        *offset = (get_seconds_since_boot() - dt_seconds_since_boot_when_set);
+        *offset = (uint32_t) ((get_ms_since_boot() - dt_ms_since_boot_when_set + 500) / 1000);
 
     return true;
 
@@ -188,17 +210,8 @@ void tt_timer_handler(void *p_context) {
     static bool overcurrent = false;
     static uint32_t overcurrent_report = 0;
 
-    // Remember the number of ticks the last time we set seconds_since_boot
-    uint32_t ticks;
-#if defined(NSDKV10) || defined(NSDKV11)
-    app_timer_cnt_get(&ticks);
-#else
-    ticks = app_timer_cnt_get();
-#endif
-
-    // Bump the number of seconds since boot, leaving overflow to be dealt with by users
-    seconds_since_boot += tt_fast_timer_mode ? TT_FAST_TIMER_SECONDS : TT_SLOW_TIMER_SECONDS;
-    ticks_at_measurement = ticks;
+    // Sample the clock, which is how we keep track of RTC wraps
+    get_ticks_since_boot();
 
     // Exit if we've somehow gone re-entrant
     static int inside_timer = 0;
@@ -207,10 +220,14 @@ void tt_timer_handler(void *p_context) {
         DEBUG_PRINTF("tt_timer REENTRANCY!\n");
         return;
     }
+    uint32_t began = prof_begin();
 
     // Refresh the timer operating mode, if necessary
     timer_refresh_mode();
 
+    // Subsystems re-register their deadlines as they are polled
+    memset(tt_deadline, 0, sizeof(tt_deadline));
+
     // Update the status of whether or not the device is currently in-motion
     gpio_motion_sense(MOTION_UPDATE);
 
@@ -250,18 +267,12 @@ void tt_timer_handler(void *p_context) {
         if (overcurrent) {
             overcurrent = false;
             stats()->overcurrent_events++;
+            evlog0(EV_OVERCURRENT);
         }
 
-    // Checkpoint deferred NVRAM I/O if serial I/O is not in progress.  In the case of
-    // oneshot mode, this means that neither comms nor PMS are using the uart.  In the case
-    // of non-oneshot mode where the uart is always busy, this just means when comms is not active.
-    if (comm_uart_switching_allowed()) {
-        if (gpio_current_uart() == UART_NONE)
-            storage_checkpoint();
-    } else {
-        if (!comm_is_busy())
-            storage_checkpoint();
-    }
+    // Checkpoint deferred NVRAM I/O, and start queued flash jobs, if serial I/O is not in progress
+    if (storage_uart_idle())
+        storage_checkpoint();
 
     // Restart if it's been requested
     io_restart_if_requested();
@@ -274,7 +285,7 @@ void tt_timer_handler(void *p_context) {
     }
 
     // This is just defensive programming; they should shut down themselves WAY before this
-    if (seconds_since_boot > 15*60)
+    if (get_seconds_since_boot() > 15*60)
         gpio_indicators_off();
 
     // Poll geiger counters
@@ -285,10 +296,14 @@ void tt_timer_handler(void *p_context) {
 
     // Poll the sensor package BEFORE polling comms, so that if there is anything
     // marked as "completed" by the sensor package it will be immediately communicated
+    uint32_t poll_began = prof_begin();
     sensor_poll();
+    prof_end(PROF_SENSOR_POLL, poll_began);
 
     // Poll and advance our communications state machine
+    poll_began = prof_begin();
     comm_poll();
+    prof_end(PROF_COMM_POLL, poll_began);
 
     // Say hello if we're just now connecting to BT
     welcome_message();
@@ -296,7 +311,11 @@ void tt_timer_handler(void *p_context) {
     // Report any UART errors, but only after comm_poll had a chance to check
     serial_uart_error_check(false);
 
+    // Stretch or shrink the timer to the next deadline
+    timer_refresh_interval();
+
     // Exit
+    prof_end(PROF_TT_TIMER, began);
     inside_timer--;
 
 }
@@ -307,7 +326,7 @@ void timer_init() {
     // Initialize the clock to a small random number of seconds, so that
     // if someone intentionally tries to synchronize the power-on of multiple
     // devices the Lora uploads won't also necessarily be synchronized
-    seconds_since_boot += io_get_random(60);
+    boot_offset_seconds += io_get_random(60);
 
     // Init the completed task scheduler that lets us handle command
     // processing outside the interrupt handlers, and instead via app_sched_execute()
@@ -337,6 +356,7 @@ void timer_start() {
 
     // Enable the slow timer
     tt_fast_timer_mode = false;
+    tt_timer_seconds = TT_SLOW_TIMER_SECONDS;
     app_timer_start(tt_timer, TT_SLOW_TIMER_INTERVAL, NULL);
 
     // Turn on the display immediately if it's available
@@ -361,11 +381,60 @@ void timer_refresh_mode() {
     // Switch from one clock to the other if we're in the wrong mode
     if (tt_fast_timer_mode != fast_timer_mode_needed) {
         tt_fast_timer_mode = fast_timer_mode_needed;
+        tt_timer_seconds = tt_fast_timer_mode ? TT_FAST_TIMER_SECONDS : TT_SLOW_TIMER_SECONDS;
         tt_request_timer_mode_reset = true;
     };
 
 }
 
+// Register that a subsystem doesn't need to be polled again for the specified number of seconds
+void timer_deadline(uint16_t who, uint32_t seconds) {
+    if (who < TIMER_DEADLINES)
+        tt_deadline[who] = get_seconds_since_boot() + seconds;
+}
+
+// Determine how long we can sleep until the next registered deadline, which is only worth doing
+// when we're stationary, bluetooth has been dropped, and every subsystem has registered one.
+uint32_t timer_tickless_seconds() {
+    int i;
+    uint32_t now, seconds;
+
+    if (tt_fast_timer_mode)
+        return TT_FAST_TIMER_SECONDS;
+    if ((storage()->flags & FLAG_TICKLESS) == 0 || !io_optimize_power())
+        return TT_SLOW_TIMER_SECONDS;
+
+    now = get_seconds_since_boot();
+    seconds = TT_TICKLESS_MAX_SECONDS;
+    for (i=0; i<TIMER_DEADLINES; i++) {
+        if (tt_deadline[i] <= now + TT_SLOW_TIMER_SECONDS)
+            return TT_SLOW_TIMER_SECONDS;
+        if (tt_deadline[i] - now < seconds)
+            seconds = tt_deadline[i] - now;
+    }
+
+    return seconds;
+}
+
+// Request that the primary timer be restarted if its interval needs to change
+void timer_refresh_interval() {
+    uint32_t seconds = timer_tickless_seconds();
+    if (seconds != tt_timer_seconds) {
+        if (debug(DBG_SENSOR_MAX))
+            DEBUG_PRINTF("Timer interval %lus\n", seconds);
+        tt_timer_seconds = seconds;
+        tt_request_timer_mode_reset = true;
+    }
+}
+
+// Drop out of a stretched tickless interval because something needs prompt attention
+void timer_wake() {
+    if (!tt_fast_timer_mode && tt_timer_seconds != TT_SLOW_TIMER_SECONDS) {
+        tt_timer_seconds = TT_SLOW_TIMER_SECONDS;
+        tt_request_timer_mode_reset = true;
+    }
+}
+
 // Process timer change requests from the main scheduling loop, because we can't
 // stop or start a timer from within the timer handler itself.
 void timer_update_mode() {
@@ -373,7 +442,7 @@ void timer_update_mode() {
     if (tt_request_timer_mode_reset) {
         tt_request_timer_mode_reset = false;
         app_timer_stop(tt_timer);
-        app_timer_start(tt_timer, tt_fast_timer_mode ? TT_FAST_TIMER_INTERVAL :  TT_SLOW_TIMER_INTERVAL, NULL);
+        app_timer_start(tt_timer, APP_TIMER_TICKS((tt_timer_seconds*1000), APP_TIMER_PRESCALER), NULL);
     }
 
 }
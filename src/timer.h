@@ -30,7 +30,17 @@ void timer_init(void);
 void timer_start();
 char *time_since_boot();
 void timer_update_mode();
+void timer_wake(void);
 
+// Subsystems that may stretch the primary timer by registering when they next need to be polled
+#define TIMER_DEADLINE_SENSOR           0
+#define TIMER_DEADLINE_COMM             1
+#define TIMER_DEADLINE_STORAGE          2
+#define TIMER_DEADLINES                 3
+void timer_deadline(uint16_t who, uint32_t seconds);
+
+uint64_t get_ticks_since_boot(void);
+uint64_t get_ms_since_boot(void);
 uint32_t get_seconds_since_boot(void);
 void set_timestamp(uint32_t date, uint32_t time);
 bool get_current_timestamp(uint32_t *date, uint32_t *time, uint32_t *offset);
@@ -10,7 +10,7 @@
 
 
 
-const pb_field_t ttproto_Telecast_fields[110] = {
+const pb_field_t ttproto_Telecast_fields[116] = {
     PB_FIELD(  1, UENUM   , OPTIONAL, STATIC  , FIRST, ttproto_Telecast, device_type, device_type, 0),
     PB_FIELD(  2, STRING  , OPTIONAL, CALLBACK, OTHER, ttproto_Telecast, DEPRECATED2017FEBDeviceIDString, device_type, 0),
     PB_FIELD(  3, UINT32  , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, device_id, DEPRECATED2017FEBDeviceIDString, 0),
@@ -120,6 +120,12 @@ const pb_field_t ttproto_Telecast_fields[110] = {
     PB_FIELD(107, FLOAT   , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, opc_std10_0, opc_std02_5, 0),
     PB_FIELD(108, UINT32  , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, errors_mtu, opc_std10_0, 0),
     PB_FIELD(109, UINT32  , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_seqno, errors_mtu, 0),
+    PB_FIELD(110, STRING  , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_latency, stats_seqno, 0),
+    PB_FIELD(111, BYTES   , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_config, stats_latency, 0),
+    PB_FIELD(112, STRING  , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_profile, stats_config, 0),
+    PB_FIELD(113, STRING  , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_energy, stats_profile, 0),
+    PB_FIELD(114, BYTES   , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_delta, stats_energy, 0),
+    PB_FIELD(115, BYTES   , OPTIONAL, STATIC  , OTHER, ttproto_Telecast, stats_evlog, stats_delta, 0),
     PB_LAST_FIELD
 };
 
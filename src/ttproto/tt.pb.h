@@ -32,6 +32,9 @@ typedef enum _ttproto_Telecast_replyType {
 } ttproto_Telecast_replyType;
 
 /* Struct definitions */
+typedef PB_BYTES_ARRAY_T(64) ttproto_Telecast_stats_config_t;
+typedef PB_BYTES_ARRAY_T(64) ttproto_Telecast_stats_delta_t;
+typedef PB_BYTES_ARRAY_T(64) ttproto_Telecast_stats_evlog_t;
 typedef struct _ttproto_Telecast {
     bool has_device_type;
     ttproto_Telecast_deviceType device_type;
@@ -250,14 +253,26 @@ typedef struct _ttproto_Telecast {
     uint32_t errors_mtu;
     bool has_stats_seqno;
     uint32_t stats_seqno;
+    bool has_stats_latency;
+    char stats_latency[96];
+    bool has_stats_config;
+    ttproto_Telecast_stats_config_t stats_config;
+    bool has_stats_profile;
+    char stats_profile[96];
+    bool has_stats_energy;
+    char stats_energy[96];
+    bool has_stats_delta;
+    ttproto_Telecast_stats_delta_t stats_delta;
+    bool has_stats_evlog;
+    ttproto_Telecast_stats_evlog_t stats_evlog;
 /* @@protoc_insertion_point(struct:ttproto_Telecast) */
 } ttproto_Telecast;
 
 /* Default values for struct fields */
 
 /* Initializer values for message structs */
-#define ttproto_Telecast_init_default            {false, (ttproto_Telecast_deviceType)0, {{NULL}, NULL}, false, 0, false, "", false, "", false, (ttproto_Telecast_replyType)0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, "", false, "", false, "", false, "", false, 0, false, "", false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0}
-#define ttproto_Telecast_init_zero               {false, (ttproto_Telecast_deviceType)0, {{NULL}, NULL}, false, 0, false, "", false, "", false, (ttproto_Telecast_replyType)0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, "", false, "", false, "", false, "", false, 0, false, "", false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0}
+#define ttproto_Telecast_init_default            {false, (ttproto_Telecast_deviceType)0, {{NULL}, NULL}, false, 0, false, "", false, "", false, (ttproto_Telecast_replyType)0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, "", false, "", false, "", false, "", false, 0, false, "", false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, {0, {0}}, false, "", false, "", false, {0, {0}}, false, {0, {0}}}
+#define ttproto_Telecast_init_zero               {false, (ttproto_Telecast_deviceType)0, {{NULL}, NULL}, false, 0, false, "", false, "", false, (ttproto_Telecast_replyType)0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, "", false, "", false, "", false, "", false, "", false, 0, false, "", false, "", false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, 0, false, "", false, {0, {0}}, false, "", false, "", false, {0, {0}}, false, {0, {0}}}
 
 /* Field tags (for use in manual encoding/decoding) */
 #define ttproto_Telecast_device_type_tag         1
@@ -369,9 +384,15 @@ typedef struct _ttproto_Telecast {
 #define ttproto_Telecast_opc_std10_0_tag         107
 #define ttproto_Telecast_errors_mtu_tag          108
 #define ttproto_Telecast_stats_seqno_tag         109
+#define ttproto_Telecast_stats_latency_tag       110
+#define ttproto_Telecast_stats_config_tag        111
+#define ttproto_Telecast_stats_profile_tag       112
+#define ttproto_Telecast_stats_energy_tag        113
+#define ttproto_Telecast_stats_delta_tag         114
+#define ttproto_Telecast_stats_evlog_tag         115
 
 /* Struct field encoding specification for nanopb */
-extern const pb_field_t ttproto_Telecast_fields[110];
+extern const pb_field_t ttproto_Telecast_fields[116];
 
 /* Maximum encoded size of messages (where known) */
 
@@ -26,6 +26,7 @@
 #include "io.h"
 #include "stats.h"
 #include "ssd.h"
+#include "prof.h"
 
 #ifdef TWIX
 
@@ -76,7 +77,7 @@ static twi_context_t *find_transaction(char *c) {
     // Can't happen
     while (true) {
         DEBUG_PRINTF("*** Array not big enough for the number of types of transaction\n");
-        nrf_delay_ms(500);
+        prof_delay_ms(500);
     }
 
 }
@@ -200,6 +201,7 @@ void twi_callback(ret_code_t result, void *p_user_data) {
 
     // Don't allow recursion because of DEBUG_PRINTF
     disable_twi_debug_printf++;
+    uint32_t began = prof_begin();
 
     // Find the transaction
     twi_context_t *t = find_transaction(p_user_data);
@@ -220,6 +222,7 @@ void twi_callback(ret_code_t result, void *p_user_data) {
 #endif
 
     // Done
+    prof_end(PROF_ISR_TWI, began);
     disable_twi_debug_printf--;
 }
 
@@ -239,7 +242,7 @@ bool twi_schedule(void *sensor, sensor_callback_t callback, app_twi_transaction_
     // transaction_began to 0, however it is better than blocking TWI transactions indefinitely.
     if (t->transaction_began != 0) {
         DEBUG_PRINTF("%s TWI double-schedule\n", p_transaction->p_user_data);
-        nrf_delay_ms(250);
+        prof_delay_ms(250);
         t->transaction_began = 0;
         disable_twi_debug_printf--;
         return false;
@@ -251,7 +254,7 @@ bool twi_schedule(void *sensor, sensor_callback_t callback, app_twi_transaction_
         if (t->sched_error != NRF_ERROR_BUSY)
             break;
         DEBUG_PRINTF("%s busy\n", p_transaction->p_user_data);
-        nrf_delay_ms(500);
+        prof_delay_ms(500);
     }
     if (t->sched_error != NRF_SUCCESS) {
         SchedulingErrors++;
@@ -316,7 +319,7 @@ bool twi_init() {
     gpio_power_set(POWER_PIN_TWI, true);
 
     // Delay to allow the device to power on.  This is ** REQUIRED ** for TWI devices to function.
-    nrf_delay_ms(MAX_NRF_DELAY_MS);
+    prof_delay_ms(MAX_NRF_DELAY_MS);
 
     // Initialize TWI
     APP_TWI_INIT(&m_app_twi, &config, MAX_PENDING_TWI_TRANSACTIONS, err_code);